@@ -7,26 +7,68 @@
 */
 
 #define	FUSE_USE_VERSION 26
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE	//fallocate, to punch holes into the image
+#endif
 
 #include <fuse.h>
+#include <fuse_lowlevel.h>
 #include <stdio.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <endian.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <time.h>
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+//<linux/fs.h>, pulled in by io_uring.h, has its own BLOCK_SIZE
+#pragma push_macro("BLOCK_SIZE")
+#undef BLOCK_SIZE
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE
+#pragma pop_macro("BLOCK_SIZE")
+#include <sys/syscall.h>
+#define CS1550_URING 1
+#endif
+#endif
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CS1550_CRC32 1	//SSE4.2 crc32 instruction, used when the CPU has it
+#endif
 
-//size of a disk block
+//size of a disk block: 512, 4096 or 65536, picked at build time with
+//-DBLOCK_SIZE=n so all the geometry below stays constant. It is recorded in
+//the superblock when an image is formatted, and a build refuses to mount an
+//image made with another size.
+#ifndef BLOCK_SIZE
 #define	BLOCK_SIZE 512
+#endif
+#if BLOCK_SIZE != 512 && BLOCK_SIZE != 4096 && BLOCK_SIZE != 65536
+#error "BLOCK_SIZE must be 512, 4096 or 65536"
+#endif
 //we'll use 8.3 filenames
 #define	MAX_FILENAME 8
 #define	MAX_EXTENSION 3
 
-//How many files can there be in one directory?
-#define MAX_FILES_IN_DIR (BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+//How many files can there be in one directory block? A directory grows a
+//block at a time, up to MAX_FILES_PER_DIR files.
+#define MAX_FILES_IN_DIR ((BLOCK_SIZE - sizeof(int)) / ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long)))
+#define MAX_FILES_PER_DIR 65534	//inode numbers of -o lowlevel leave 16 bits for the slot
 
 //The attribute packed means to not align these things
 struct cs1550_directory_entry
 {
-	int nFiles;	//How many files are in this directory.
+	int nFiles;	//How many files are in this block of the directory.
 				//Needs to be less than MAX_FILES_IN_DIR
 
 	struct cs1550_file_directory
@@ -53,7 +95,8 @@ struct cs1550_root_directory
 	struct cs1550_directory
 	{
 		char dname[MAX_FILENAME + 1];	//directory name (plus space for nul)
-		long nStartBlock;				//where the directory block is on disk
+		long nStartBlock;				//where the directory's first extent block is on disk,
+								//before version 3 its only directory block
 	} __attribute__((packed)) directories[MAX_DIRS_IN_ROOT];	//There is an array of these
 
 	//This is some space to get this to be exactly the size of the disk block.
@@ -76,6 +119,152 @@ struct cs1550_disk_block
 
 typedef struct cs1550_disk_block cs1550_disk_block;
 
+#define CS1550_MAGIC 0x30353531	//"1550" on disk
+//1 had no journal; such images still mount, unjournaled. Before 3 every
+//directory was a single block, and directories of older images stay that way.
+//Before 4 every file with data had blocks of its own, before 5 none of its
+//extents was compressed, before 6 no image had a dedup table, and before 7
+//none had block checksums and the journal was checksummed with FNV-1a.
+#define CS1550_VERSION 7
+
+//Since version 4, files of up to TAIL_MAX bytes keep their data in tail
+//blocks that the small files of a directory share, in runs of TAIL_UNIT
+//bytes, instead of in an extent block and a data block of their own. Such a
+//file's nStartBlock is minus the byte address of its run. Tail blocks are
+//metadata: they go through the journal and the block cache.
+#define TAIL_UNIT 32
+#define TAIL_UNITS (BLOCK_SIZE / TAIL_UNIT)
+#define TAIL_MAX (BLOCK_SIZE / 4)
+
+//Since version 5, with -o compress, files are written in chunks of
+//CHUNK_BLOCKS blocks, and a whole chunk that compresses into fewer blocks is
+//stored that way: as one extent whose nBlocks is minus the compressed length
+//in bytes. Such an extent always stands for a whole chunk of the file. Chunks
+//that do not compress and the part chunk at the end of a file stay plain.
+#define CHUNK_BLOCKS (BLOCK_SIZE < 16384 ? (64 << 10) / BLOCK_SIZE : 4)
+#define CHUNK_BYTES ((long)CHUNK_BLOCKS * BLOCK_SIZE)
+
+//Blocks per allocation group. A multiple of 64 so groups start on a bitmap word.
+#define GROUP_BLOCKS 32768
+
+//Block 0 of the image. It describes where everything else lives:
+//block 1 is the root directory, the free-space bitmap follows it, the
+//metadata journal follows the bitmap, the dedup table and share counts
+//follow the journal and the block checksums come last, if there are any.
+struct cs1550_superblock
+{
+	unsigned int magic;
+	unsigned int version;
+	unsigned int blockSize;
+	unsigned int unused;
+	long nBlocks;			//size of the image in blocks
+	long nRootBlock;		//block number of the root directory
+	long nBitmapStart;		//block number of the first bitmap block
+	long nBitmapBlocks;		//how many bitmap blocks follow it
+	long nGroupBlocks;		//blocks per allocation group
+	long nGroups;			//how many groups the image is split into
+	long nJournalStart;		//block number of the journal header
+	long nJournalBlocks;	//journal size including its header, 0 for none
+	long nDedupStart;		//block number of the first dedup table block
+	long nDedupBlocks;		//how many dedup table blocks follow it, 0 for none
+	long nShareStart;		//block number of the first share count block
+	long nShareBlocks;		//how many share count blocks follow it
+	long nSumStart;			//block number of the first checksum block
+	long nSumBlocks;		//how many checksum blocks follow it, 0 for none
+
+	//This is some space to get this to be exactly the size of the disk block.
+	//Don't use it for anything.
+	char padding[BLOCK_SIZE - 4 * sizeof(int) - 14 * sizeof(long)];
+} ;
+
+typedef struct cs1550_superblock cs1550_superblock;
+
+//How many extents fit in one extent block?
+#define MAX_EXTENTS_IN_BLOCK ((BLOCK_SIZE - sizeof(long) - sizeof(int)) / (2 * sizeof(long)))
+
+//A file's data is a list of extents (runs of contiguous blocks) kept in a
+//chain of these blocks. The file's nStartBlock points at the first one.
+struct cs1550_extent_block
+{
+	long nNextBlock;	//block number of the next extent block, 0 if none
+	int nExtents;	//How many extents are used in this block
+
+	struct cs1550_extent
+	{
+		long nStartBlock;	//block number of the first block in the run
+		long nBlocks;		//length of the run in blocks
+	} __attribute__((packed)) extents[MAX_EXTENTS_IN_BLOCK];
+
+	//This is some space to get this to be exactly the size of the disk block.
+	//Don't use it for anything.
+	char padding[BLOCK_SIZE - MAX_EXTENTS_IN_BLOCK * sizeof(struct cs1550_extent) - sizeof(long) - sizeof(int)];
+} ;
+
+typedef struct cs1550_extent_block cs1550_extent_block;
+
+//Since version 6, an image formatted with -o dedup lets files share data
+//blocks that hold the same bytes. A table after the journal indexes blocks
+//by a fingerprint of their bytes, in blocks of these entries, and the share
+//counts after the table hold, for each block of the image, how many extents
+//point at it besides the first, as 16-bit numbers.
+struct cs1550_dedup_entry
+{
+	uint64_t hash;	//fingerprint of the block's bytes
+	long block;		//block number of the block, 0 for an unused entry
+};
+
+#define DEDUP_ENTRIES_PER_BLOCK (BLOCK_SIZE / sizeof(struct cs1550_dedup_entry))
+#define SHARES_PER_BLOCK (BLOCK_SIZE / sizeof(uint16_t))
+
+//Since version 7, an image formatted with -o checksum keeps the CRC32C of
+//each block in a region after all the others, as 32-bit numbers. The ones of
+//the blocks before it are not used, except the root block's.
+#define SUMS_PER_BLOCK (BLOCK_SIZE / sizeof(uint32_t))
+
+//The extents of a file or directory, as loaded into memory.
+struct cs1550_extent_map
+{
+	int nExtents;
+	int capacity;
+	struct cs1550_extent *extents;
+	int nChain;	//extent blocks the map was loaded from
+	int chainCapacity;
+	long *chain;
+};
+
+//Every on-disk structure has to fill exactly one block at each block size
+typedef char cs1550_layout_check[(sizeof(struct cs1550_root_directory) == BLOCK_SIZE &&
+	sizeof(struct cs1550_directory_entry) == BLOCK_SIZE &&
+	sizeof(struct cs1550_extent_block) == BLOCK_SIZE &&
+	sizeof(struct cs1550_superblock) == BLOCK_SIZE) ? 1 : -1];
+
+//Mount options understood on top of the standard FUSE ones (-o name)
+struct cs1550_options
+{
+	int useMmap;	//map the whole image instead of using pread/pwrite
+	unsigned int cacheMiB;	//size of the block cache, 0 to turn it off
+	unsigned int readAheadKiB;	//largest read-ahead window per file
+	int cacheStats;	//print the cache counters at unmount
+	unsigned int writeBackKiB;	//largest buffered write range per file, 0 to write through
+	unsigned int dirtyMiB;	//buffered writes across all files before writers flush
+	unsigned int commitMs;	//journal commit interval, 0 to commit only when needed
+	int ioUring;	//submit batched block I/O through io_uring
+	int lowLevel;	//serve inode-based requests instead of path-based ones
+	unsigned int llTimeout;	//seconds the kernel may cache entries and attributes
+	int compress;	//store the chunks of files written from now on compressed
+	int dedup;	//share the blocks of files written from now on; formats with a dedup table
+	int checksum;	//formats with block checksums, which reads from the image are checked against
+};
+
+static struct cs1550_options options = {
+	.cacheMiB = 32,
+	.readAheadKiB = 128,
+	.writeBackKiB = 1024,
+	.dirtyMiB = 64,
+	.commitMs = 5000,
+	.llTimeout = 60,
+};
+
 static void tokenPath(const char *path, char *directory, char *filename, char *extension) {
 	strcpy(directory, "");
 	strcpy(filename, "");
@@ -84,648 +273,7338 @@ static void tokenPath(const char *path, char *directory, char *filename, char *e
 	sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
 }
 
-static struct cs1550_root_directory readDisk() {
-	FILE *fp = fopen(".disk", "rb+");
-	fseek(fp, 0, SEEK_SET);
-	cs1550_root_directory root;
-	root.nDirectories = 0;
-	memset(&root.directories, 0, MAX_DIRS_IN_ROOT*sizeof(struct cs1550_directory));
-	fread(&root, BLOCK_SIZE, 1, fp);
-	fclose(fp);
+//Statistics for /.stats, a virtual file at the root of the mount. Every
+//thread counts into a slab of its own, so recording is a few plain stores
+//that never contend, and reading the file adds the slabs up. Writing
+//anything to the file starts all counts over.
+#define STATS_NAME ".stats"
+#define STATS_PATH "/" STATS_NAME
+#define STATS_BUCKETS 40	//latency histogram: bucket k counts [2^k, 2^(k+1)) ns
 
-	return root;
-}
+//timed handlers; the inode-based ones share the slot of their path-based
+//counterpart
+#define STAT_GETATTR 0
+#define STAT_READDIR 1
+#define STAT_MKDIR 2
+#define STAT_RMDIR 3
+#define STAT_MKNOD 4
+#define STAT_UNLINK 5
+#define STAT_TRUNCATE 6
+#define STAT_OPEN 7
+#define STAT_READ 8
+#define STAT_WRITE 9
+#define STAT_READ_BUF 10
+#define STAT_WRITE_BUF 11
+#define STAT_FLUSH 12
+#define STAT_FSYNC 13
+#define STAT_RELEASE 14
+#define STAT_LOOKUP 15
+#define STAT_FORGET 16
+#define STAT_SETATTR 17
+#define STAT_OPS 18
 
-static cs1550_directory_entry readDirectory(long location) {
-	FILE *fp = fopen(".disk", "rb+");
-	fseek(fp, location, SEEK_SET);
-	cs1550_directory_entry currDir;
-	currDir.nFiles = 0;
-	memset(&currDir.files, 0, MAX_FILES_IN_DIR*sizeof(struct cs1550_file_directory));
-	fread(&currDir, BLOCK_SIZE, 1, fp);
-	fclose(fp);
+//event counters
+#define STAT_DEV_READS 0
+#define STAT_DEV_READ_BYTES 1
+#define STAT_DEV_WRITES 2
+#define STAT_DEV_WRITE_BYTES 3
+#define STAT_DEV_SYNCS 4
+#define STAT_RING_SUBMITS 5
+#define STAT_ALLOCS 6
+#define STAT_ALLOC_SCANS 7
+#define STAT_ALLOC_FAILURES 8
+#define STAT_COMMITS 9
+#define STAT_LOGGED_BLOCKS 10
+#define STAT_CHECKPOINT_BLOCKS 11
+#define STAT_FREED_BLOCKS 12
+#define STAT_HOLE_PUNCHES 13
+#define STAT_CHUNKS_PACKED 14
+#define STAT_PACKED_BYTES 15
+#define STAT_CHUNK_LOADS 16
+#define STAT_DEDUP_HITS 17
+#define STAT_DEDUP_COPIES 18
+#define STAT_CHECKSUM_ERRORS 19
+#define STAT_COUNTERS 20
 
-	return currDir;
+static const char *statOpNames[STAT_OPS] = {
+	"getattr", "readdir", "mkdir", "rmdir", "mknod", "unlink", "truncate", "open", "read",
+	"write", "read_buf", "write_buf", "flush", "fsync", "release", "lookup", "forget", "setattr",
+};
+
+static const char *statCounterNames[STAT_COUNTERS] = {
+	"dev_reads", "dev_read_bytes", "dev_writes", "dev_write_bytes", "dev_syncs", "ring_submits",
+	"allocs", "alloc_scans", "alloc_failures", "journal_commits", "journal_blocks", "checkpoint_blocks",
+	"freed_blocks", "hole_punches", "chunks_packed", "packed_bytes", "chunk_loads",
+	"dedup_hits", "dedup_copies", "checksum_errors",
+};
+
+struct cs1550_op_stats
+{
+	unsigned long calls;
+	unsigned long errors;
+	unsigned long nanos;
+	unsigned long maxNanos;
+	unsigned long hist[STATS_BUCKETS];
+};
+
+//Only the owning thread writes a slab, with relaxed atomic stores so
+//statsRender can read it at any time.
+struct cs1550_stats
+{
+	long epoch;	//statsEpoch when last cleared; a stale slab counts as empty
+	struct cs1550_op_stats ops[STAT_OPS];
+	unsigned long counters[STAT_COUNTERS];
+	struct cs1550_stats *next;	//all slabs
+	struct cs1550_stats *nextFree;	//slabs of threads that have exited
+};
+
+static pthread_mutex_t statsLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t statsOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t statsKey;
+static struct cs1550_stats *allStats = NULL;
+static struct cs1550_stats *freeStats = NULL;
+static long statsEpoch = 0;	//bumped by every reset
+static long statsSince = 0;	//statsNow() at the last reset
+static __thread struct cs1550_stats *myStats = NULL;
+
+static long statsNow() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
 }
 
-static void readFile(char *buf, long location, size_t size) {
-	FILE *fp = fopen(".disk", "rb");
-	fseek(fp, location, SEEK_SET);
-	fread(buf, size, 1, fp);
-	fclose(fp);
+//A thread's slab outlives it; the next new thread takes it over, counts
+//and all.
+static void statsDetach(void *slab) {
+	struct cs1550_stats *s = slab;
+	pthread_mutex_lock(&statsLock);
+	s->nextFree = freeStats;
+	freeStats = s;
+	pthread_mutex_unlock(&statsLock);
 }
 
-static int isContainDir(char *directory) {
-	cs1550_root_directory root = readDisk();
-	int i;
-	for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
-		if(strcmp(root.directories[i].dname, directory) == 0)
-			return 1;
-	}
-	return 0;
+static void statsKeyCreate() {
+	pthread_key_create(&statsKey, statsDetach);
 }
 
-static int isContainFile(char *directory, char *filename, char *extension) {
-	cs1550_root_directory root = readDisk();
-	int i;
-	int j;
-	if(strlen(filename) == 0) return 0;
-	for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) { //
-		if(strcmp(root.directories[i].dname, directory) == 0) {
-			struct cs1550_directory_entry currDir;
-			currDir = readDirectory(root.directories[i].nStartBlock);
-			for(j = 0 ; j < MAX_FILES_IN_DIR ; j++) { //
-				if(strlen(extension) == 0) {
-					if(strcmp(currDir.files[j].fname, filename) == 0)
-						return 1;
-					}
-					else if (strcmp(currDir.files[j].fname, filename) == 0 && strcmp(currDir.files[j].fext, extension) == 0)
-						return 1;
-			}
+static struct cs1550_stats *statsAttach() {
+	struct cs1550_stats *s;
+
+	pthread_once(&statsOnce, statsKeyCreate);
+	pthread_mutex_lock(&statsLock);
+	s = freeStats;
+	if(s != NULL) {
+		freeStats = s->nextFree;
+	} else {
+		s = calloc(1, sizeof(struct cs1550_stats));
+		if(s != NULL) {
+			s->next = allStats;
+			allStats = s;
 		}
 	}
-	return 0;
-}
-
-static void writeMultiBlock(const void *block, size_t size, size_t location) {
-	FILE *fp = fopen(".disk", "rb+");
-	fseek(fp, location, SEEK_SET);
-	fwrite(block, size, 1, fp);
-	fclose(fp);
+	pthread_mutex_unlock(&statsLock);
+	if(s != NULL) pthread_setspecific(statsKey, s);
+	myStats = s;
+	return s;
 }
 
-static void writeBlock(const void *block, size_t times, size_t location ) {
-	FILE *fp = fopen(".disk", "rb+");
-	fseek(fp, location, SEEK_SET);
-	fwrite(block, BLOCK_SIZE, times, fp);
-	fclose(fp);
+static void statsStore(unsigned long *counter, unsigned long value) {
+	__atomic_store_n(counter, value, __ATOMIC_RELAXED);
 }
 
-static void writeBitmap(const void *block) {
-	FILE *fp = fopen(".disk", "rb+");
-	fseek(fp, -BLOCK_SIZE, SEEK_END);
-	fwrite(block, BLOCK_SIZE, 1, fp);
-	fclose(fp);
-}
+//This thread's slab, cleared first if there was a reset since it was last
+//used. NULL when out of memory; nothing is counted then.
+static struct cs1550_stats *statsSlab() {
+	struct cs1550_stats *s = myStats;
+	long epoch = __atomic_load_n(&statsEpoch, __ATOMIC_ACQUIRE);
 
-static void printBitmap(unsigned char *bitmap) {
-	int i;
-	int j;
-	printf("output the bitmap ---------------------------\n");
-	for(i = 0 ; i < BLOCK_SIZE ; i++) {
-		for(j = 7 ; j >= 0 ; j--) {
-			printf("%d",(bitmap[i] & 1<<j)!=0);
+	if(s == NULL && (s = statsAttach()) == NULL) return NULL;
+	if(s->epoch != epoch) {
+		int i, k;
+		for(i = 0 ; i < STAT_OPS ; i++) {
+			struct cs1550_op_stats *o = &s->ops[i];
+			statsStore(&o->calls, 0);
+			statsStore(&o->errors, 0);
+			statsStore(&o->nanos, 0);
+			statsStore(&o->maxNanos, 0);
+			for(k = 0 ; k < STATS_BUCKETS ; k++)
+				statsStore(&o->hist[k], 0);
 		}
+		for(i = 0 ; i < STAT_COUNTERS ; i++)
+			statsStore(&s->counters[i], 0);
+		__atomic_store_n(&s->epoch, epoch, __ATOMIC_RELEASE);
 	}
-	printf("output the bitmap ---------------------------\n");
+	return s;
 }
 
-static void initializeDisk(unsigned char bitmap[BLOCK_SIZE]) {
-	cs1550_root_directory root;
-	root.nDirectories = 0;
-	memset(&root.directories, 0, MAX_DIRS_IN_ROOT*sizeof(struct cs1550_directory));
-	writeBlock(&root, 1, 0);
-	bitmap[0] = 128;
-	writeBitmap(bitmap);
+static void statsCount(int counter, unsigned long n) {
+	struct cs1550_stats *s = statsSlab();
+	if(s != NULL) statsStore(&s->counters[counter], s->counters[counter] + n);
 }
 
-static void setBit(unsigned char *bitmap, long location) {
-	int indexOfLocation = location/BLOCK_SIZE;
-	int bytes = indexOfLocation/8;
-	int index = 7 - indexOfLocation%8;
-	char currByte = bitmap[bytes] | 1<<index;
-	bitmap[bytes] = currByte;
+static long statsStart() {
+	return statsNow();
 }
 
-static void updateBitmap(long location) {
-	int startReading = 0 - BLOCK_SIZE;
-	FILE *fp = fopen(".disk", "rb");
-	fseek(fp, startReading, SEEK_END);
-	unsigned char bitmap[BLOCK_SIZE];
-	fread(&bitmap, sizeof(char), BLOCK_SIZE, fp);
-	fclose(fp);
+//Records one call of handler op that began at start and returned res.
+static void statsEnd(int op, long start, int res) {
+	struct cs1550_stats *s = statsSlab();
+	unsigned long nanos = statsNow() - start;
+	struct cs1550_op_stats *o;
+	int k = 63 - __builtin_clzl(nanos | 1);
 
-	setBit(bitmap, location);
-	writeBitmap(bitmap);
-	// printBitmap(bitmap);
+	if(s == NULL) return;
+	o = &s->ops[op];
+	if(k >= STATS_BUCKETS) k = STATS_BUCKETS - 1;
+	statsStore(&o->calls, o->calls + 1);
+	if(res < 0) statsStore(&o->errors, o->errors + 1);
+	statsStore(&o->nanos, o->nanos + nanos);
+	if(nanos > o->maxNanos) statsStore(&o->maxNanos, nanos);
+	statsStore(&o->hist[k], o->hist[k] + 1);
 }
 
-static int getBlockAddress() {
-	int j;
-	int i;
-	int startReading = 0 - BLOCK_SIZE;
-	FILE *fp = fopen(".disk", "rb");
-	fseek(fp, startReading, SEEK_END);
-	unsigned char bitmap[BLOCK_SIZE];
-	fread(&bitmap, sizeof(char), BLOCK_SIZE, fp);
+//Block checksums, on images formatted with -o checksum. sums holds the
+//CRC32C of each covered block while the image is mounted: every write that
+//reaches the image brings it up to date, and a block read into the cache,
+//or into a caller's buffer when there is no cache, is checked against it. A
+//block that does not match is read once more, in case a write to it was
+//under way, before the read fails with -EIO. The blocks covered are the
+//root and every block after the checksum region, so all directory, extent
+//and data blocks; the tables before are read whole at mount.
+//
+//A write that covers a whole block sets its checksum from the new bytes.
+//One that covers part of a block changes the checksum by the CRC of the
+//bits it flips, since a CRC is linear, so only the bytes it overwrites have
+//to be read first.
+//
+//The checksum region itself is only written at unmount. File data goes to
+//disk between commits, so after a crash the checksums of the last writes
+//could not be trusted even if they were logged. The journal header records
+//whether the region was stored, and a mount that finds it was not, after a
+//crash or the first time, computes all of them from the image again.
+//
+//CRC32C is the crc32 instruction of SSE4.2. It is run on three streams at
+//once to hide its latency, and the three CRCs are joined by moving the
+//first ones past the bytes of the later ones with tables. CPUs without it
+//use slicing-by-8 tables.
+#define CRC32C_POLY 0x82F63B78	//Castagnoli, bit-reversed
+#define CRC_STREAM 256	//bytes per stream
 
-	if((bitmap[0] & 128) == 0) {
-		initializeDisk(bitmap);
+static uint32_t crcTable[8][256];
+static uint32_t crcShift[4][256];	//a CRC moved past CRC_STREAM zero bytes, by byte of the CRC
+static int crcHardware = 0;
+static int crcReady = 0;
+
+static uint32_t crcSoft(uint32_t crc, const unsigned char *p, size_t size) {
+	while(size >= 8) {
+		uint64_t w;
+		memcpy(&w, p, sizeof(uint64_t));
+		w = le64toh(w) ^ crc;
+		crc = crcTable[7][w & 0xFF] ^ crcTable[6][(w >> 8) & 0xFF] ^ crcTable[5][(w >> 16) & 0xFF] ^
+			crcTable[4][(w >> 24) & 0xFF] ^ crcTable[3][(w >> 32) & 0xFF] ^ crcTable[2][(w >> 40) & 0xFF] ^
+			crcTable[1][(w >> 48) & 0xFF] ^ crcTable[0][w >> 56];
+		p += 8;
+		size -= 8;
 	}
-	int bit;
-	for(i = 0 ; i < BLOCK_SIZE ; i++) {
-		for(j = 7 ; j >= 0 ; j--) {
-			bit = ((bitmap[i] & 1<<j) != 0);
-			if(!bit) break;
+	while(size-- > 0)
+		crc = crcTable[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+	return crc;
+}
+
+static uint32_t crcAdvance(uint32_t crc) {
+	return crcShift[0][crc & 0xFF] ^ crcShift[1][(crc >> 8) & 0xFF] ^
+		crcShift[2][(crc >> 16) & 0xFF] ^ crcShift[3][crc >> 24];
+}
+
+#ifdef CS1550_CRC32
+__attribute__((target("sse4.2")))
+static uint32_t crcHard(uint32_t crc, const unsigned char *p, size_t size) {
+	while(size >= 3 * CRC_STREAM) {
+		uint64_t a = crc, b = 0, c = 0;
+		size_t i;
+		for(i = 0 ; i < CRC_STREAM ; i += 8) {
+			uint64_t x, y, z;
+			memcpy(&x, p + i, sizeof(uint64_t));
+			memcpy(&y, p + CRC_STREAM + i, sizeof(uint64_t));
+			memcpy(&z, p + 2 * CRC_STREAM + i, sizeof(uint64_t));
+			a = _mm_crc32_u64(a, x);
+			b = _mm_crc32_u64(b, y);
+			c = _mm_crc32_u64(c, z);
 		}
-		if(!bit) break;
+		crc = crcAdvance(crcAdvance(a) ^ b) ^ c;
+		p += 3 * CRC_STREAM;
+		size -= 3 * CRC_STREAM;
+	}
+	while(size >= 8) {
+		uint64_t x;
+		memcpy(&x, p, sizeof(uint64_t));
+		crc = _mm_crc32_u64(crc, x);
+		p += 8;
+		size -= 8;
 	}
-	fclose(fp);
-	return (i*8 + (7-j)) * BLOCK_SIZE;
+	while(size-- > 0)
+		crc = _mm_crc32_u8(crc, *p++);
+	return crc;
 }
+#endif
 
-static size_t getFileSize(char* directory, char* filename, char* extension) {
-	cs1550_root_directory root = readDisk();
-	cs1550_directory_entry currDir;
-	int i;
-	for(i = 0 ; i < root.nDirectories ; i++) {
-		if(strcmp(root.directories[i].dname, directory) == 0) {	// find the directory in root
-			currDir = readDirectory(root.directories[i].nStartBlock);
-			break;
-		}
+static void crcInit() {
+	uint32_t bits[32];
+	unsigned char zeros[CRC_STREAM];
+	int i, k;
+
+	if(crcReady) return;
+	for(i = 0 ; i < 256 ; i++) {
+		uint32_t c = i;
+		for(k = 0 ; k < 8 ; k++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		crcTable[0][i] = c;
 	}
-	for(i = 0 ; i < currDir.nFiles ; i++) {
-		if(strcmp(currDir.files[i].fname, filename) == 0) {
-			if(strlen(extension) != 0) {
-				if(strcmp(currDir.files[i].fext, extension) != 0)
-					return -EPERM;
-				}
-			return currDir.files[i].fsize;
+	for(k = 1 ; k < 8 ; k++) {
+		for(i = 0 ; i < 256 ; i++)
+			crcTable[k][i] = (crcTable[k - 1][i] >> 8) ^ crcTable[0][crcTable[k - 1][i] & 0xFF];
+	}
+	//moving a CRC past zeros is linear in it, so one bit at a time will do
+	memset(zeros, 0, sizeof(zeros));
+	for(k = 0 ; k < 32 ; k++)
+		bits[k] = crcSoft(1U << k, zeros, CRC_STREAM);
+	for(k = 0 ; k < 4 ; k++) {
+		for(i = 0 ; i < 256 ; i++) {
+			uint32_t c = 0;
+			int bit;
+			for(bit = 0 ; bit < 8 ; bit++)
+				if(i & (1 << bit)) c ^= bits[8 * k + bit];
+			crcShift[k][i] = c;
 		}
 	}
-	return 0;
+#ifdef CS1550_CRC32
+	crcHardware = __builtin_cpu_supports("sse4.2");
+#endif
+	crcReady = 1;
 }
-/*
- * Called whenever the system wants to know the file attributes, including
- * simply whether the file exists or not.
- *
- * man -s 2 stat will show the fields of a stat structure
- */
-static int cs1550_getattr(const char *path, struct stat *stbuf)
-{
 
-	// printf("---Call function getattr---\n");
+//Carries crc, a CRC32C before its final inversion, over size bytes at p.
+static uint32_t crcUpdate(uint32_t crc, const void *p, size_t size) {
+#ifdef CS1550_CRC32
+	if(crcHardware) return crcHard(crc, p, size);
+#endif
+	return crcSoft(crc, p, size);
+}
 
-	int res = 0;
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+static uint32_t crc32c(const void *p, size_t size) {
+	return ~crcUpdate(~0U, p, size);
+}
 
-	tokenPath(path, directory, filename, extension);
+static ssize_t devRead(void *buf, size_t size, off_t location);
 
-	// printf("---Dir: %s File: %s Ext: %s---\n", directory, filename, extension);
-	// printf("---Dir: %d File: %d Ext: %d---\n", (int)strlen(directory), (int)strlen(filename), (int)strlen(extension));
+static uint32_t *sums = NULL;	//NULL when the image has none
+static long sumRoot = 0;
+static long sumFirst = 0;	//first block after the checksum region
+static long sumEnd = 0;	//blocks in the image
+static uint32_t sumZero = 0;	//checksum of a block of zeros
+static int sumsStale = 0;	//the journal header said the region was not stored
+static int sumsStored = 0;	//stored for this unmount; nothing may be written after
 
-	memset(stbuf, 0, sizeof(struct stat));
+static int sumCovered(long block) {
+	return sums != NULL && (block == sumRoot || (block >= sumFirst && block < sumEnd));
+}
 
-	//is path the root dir?
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-	} else {
-		if(isContainDir(directory) == 1 && strlen(filename) == 0 && strlen(extension) == 0) {  //Check if name is subdirectory
-			//Might want to return a structure with these fields
-			stbuf->st_mode = S_IFDIR | 0755;
-			stbuf->st_nlink = 2;
-		} else if(isContainFile(directory, filename, extension))  {	//Check if name is a regular file
-			//regular file, probably want to be read and write
-			size_t size = getFileSize(directory, filename, extension);
-			stbuf->st_mode = S_IFREG | 0666;
-			stbuf->st_nlink = 1; //file links
-			stbuf->st_size = size; //file size - make sure you replace with real size!
-		} else {  //Else return that path doesn't exist
-			res = -ENOENT;
+static int sumMatches(long block, const void *data) {
+	return !sumCovered(block) || crc32c(data, BLOCK_SIZE) == __atomic_load_n(&sums[block], __ATOMIC_RELAXED);
+}
+
+//devRead of count whole blocks at block, checked. Returns the bytes read, or
+//-EIO when a block does not match its checksum.
+static ssize_t sumRead(void *buf, long block, long count) {
+	ssize_t n = devRead(buf, count * BLOCK_SIZE, block * BLOCK_SIZE);
+	long i;
+
+	if(n <= 0 || sums == NULL) return n;
+	for(i = 0 ; i < n / BLOCK_SIZE ; i++) {
+		char *data = (char *)buf + i * BLOCK_SIZE;
+		if(sumMatches(block + i, data)) continue;
+		if(devRead(data, BLOCK_SIZE, (block + i) * BLOCK_SIZE) == BLOCK_SIZE && sumMatches(block + i, data)) continue;
+		statsCount(STAT_CHECKSUM_ERRORS, 1);
+		fprintf(stderr, "cs1550: block %ld does not match its checksum\n", block + i);
+		return -EIO;
+	}
+	return n;
+}
+
+//cacheRead without a cache: the blocks holding the bytes are read whole so
+//they can be checked.
+static ssize_t sumReadBytes(void *buf, size_t size, off_t location) {
+	cs1550_disk_block block;
+	char *out = buf;
+	off_t end = location + size;
+
+	while(location < end) {
+		long b = location / BLOCK_SIZE;
+		size_t within = location % BLOCK_SIZE;
+		size_t piece = BLOCK_SIZE - within;
+		ssize_t n;
+
+		if(within == 0 && end - location >= BLOCK_SIZE) {
+			piece = (end - location) / BLOCK_SIZE * BLOCK_SIZE;
+			n = sumRead(out, b, piece / BLOCK_SIZE);
+			if(n < 0) return n;
+			memset(out + n, 0, piece - n);
+		} else {
+			if((off_t)piece > end - location) piece = end - location;
+			n = sumRead(block.data, b, 1);
+			if(n < 0) return n;
+			memset(block.data + n, 0, BLOCK_SIZE - n);
+			memcpy(out, block.data + within, piece);
 		}
+		out += piece;
+		location += piece;
 	}
-	return res;
+	return size;
 }
 
-/*
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
- */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
-			 off_t offset, struct fuse_file_info *fi)
-{
-	// printf("---Call function readdir---\n");
-	//Since we're building with -Wall (all warnings reported) we need
-	//to "use" every parameter, so let's just cast them to void to
-	//satisfy the compiler
-	(void) offset;
-	(void) fi;
+//Brings the checksums of the blocks that size bytes of buf are about to
+//overwrite at location up to date. Called before the write, since a block
+//it only partly covers needs the bytes it loses.
+static void sumWrite(const void *buf, size_t size, off_t location) {
+	const char *in = buf;
+	off_t end = location + size;
 
-	struct cs1550_root_directory root = readDisk();
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
-	tokenPath(path, directory, filename, extension);
+	if(sums == NULL) return;
+	while(location < end) {
+		long b = location / BLOCK_SIZE;
+		size_t within = location % BLOCK_SIZE;
+		size_t piece = BLOCK_SIZE - within;
 
-	//This line assumes we have no subdirectories, need to change
-	// if (strcmp(path, "/") != 0)
-	// 	return -ENOENT;
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
+		if((off_t)piece > end - location) piece = end - location;
+		if(sumCovered(b) && piece == BLOCK_SIZE) {
+			__atomic_store_n(&sums[b], crc32c(in, BLOCK_SIZE), __ATOMIC_RELAXED);
+		} else if(sumCovered(b)) {
+			cs1550_disk_block old;
+			ssize_t n = devRead(old.data, piece, location);
+			uint32_t flip;
+			size_t i;
 
-	if (strcmp(path, "/") == 0) {
-		int i;
-		for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
-			if(strcmp(root.directories[i].dname, "") != 0) {
-				filler(buf, root.directories[i].dname, NULL, 0);
-			}
+			if(n < 0) n = 0;
+			memset(old.data + n, 0, piece - n);
+			for(i = 0 ; i < piece ; i++)
+				old.data[i] ^= in[i];
+			//the bits flipped, with the zeros after them that the CRC passes
+			flip = crcUpdate(0, old.data, piece);
+			memset(old.data, 0, BLOCK_SIZE - within - piece);
+			flip = crcUpdate(flip, old.data, BLOCK_SIZE - within - piece);
+			__atomic_xor_fetch(&sums[b], flip, __ATOMIC_RELAXED);
 		}
-		return 0;
-	} else {
-		struct cs1550_directory dir;
-		struct cs1550_directory_entry currDir;
-		int i = 0;
-		int check = 0;
-		int j;
+		in += piece;
+		location += piece;
+	}
+}
 
-		for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
-			if(strcmp(directory, root.directories[i].dname) == 0) {
-				dir = root.directories[i];
-				check = 1;
-				break;
-			}
-		}
-		if(check) {
-			currDir = readDirectory(dir.nStartBlock);
-			for(j = 0 ; j < currDir.nFiles ; j++) {
-				char result[MAX_FILENAME+1];
-				strcpy(result, currDir.files[j].fname);
-				if(strcmp(currDir.files[j].fext, "") != 0) {
-					strcat(result, ".");
-					strcat(result, currDir.files[j].fext);
-				}
-				filler(buf, result, NULL, 0);
-			}
-		}
+//Sets the checksums of the blocks holding [location, location+size) from
+//what they hold now, after a write that could not go through sumWrite.
+static void sumRefresh(off_t location, size_t size) {
+	cs1550_disk_block block;
+	long b;
+
+	if(sums == NULL || size == 0) return;
+	for(b = location / BLOCK_SIZE ; b <= (long)((location + size - 1) / BLOCK_SIZE) ; b++) {
+		ssize_t n;
+		if(!sumCovered(b)) continue;
+		n = devRead(block.data, BLOCK_SIZE, b * BLOCK_SIZE);
+		if(n < 0) n = 0;
+		memset(block.data + n, 0, BLOCK_SIZE - n);
+		__atomic_store_n(&sums[b], crc32c(block.data, BLOCK_SIZE), __ATOMIC_RELAXED);
 	}
-	/*
-	//add the user stuff (subdirs or files)
-	//the +1 skips the leading '/' on the filenames
-	filler(buf, newpath + 1, NULL, 0);
-	*/
-	return 0;
 }
 
-/*
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
- */
-static int cs1550_mkdir(const char *path, mode_t mode)
-{
-	// printf("---Call function mkdir---\n");
-	(void) path;
-	(void) mode;
+//The blocks [block, block+count) now read as zeros.
+static void sumPunch(long block, long count) {
+	long b;
+	for(b = block ; sums != NULL && b < block + count ; b++) {
+		if(sumCovered(b)) __atomic_store_n(&sums[b], sumZero, __ATOMIC_RELAXED);
+	}
+}
 
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+//The block device: .disk is opened once at mount and every helper below goes
+//through positioned reads and writes on that one descriptor, or through a
+//shared mapping of the whole image when mounted with -o mmap.
+static char diskPath[PATH_MAX] = ".disk";
+static int diskFd = -1;
+static off_t diskSize = 0;
+static char *diskMap = NULL;
 
-	tokenPath(path, directory, filename, extension);
+static int devOpen(const char *path) {
+	struct stat st;
+	int fd = open(path, O_RDWR);
+	if(fd < 0) return -errno;
+	if(fstat(fd, &st) < 0) {
+		int err = -errno;
+		close(fd);
+		return err;
+	}
+	diskFd = fd;
+	diskSize = st.st_size;
 
-	if(strlen(directory) > MAX_FILENAME) {
-		return -ENAMETOOLONG;
-	}	else if (isContainDir(directory) == 1) {
-		return -EEXIST;
-	} else if (strlen(directory) == 0 || strlen(filename) != 0) {
-		return -EPERM;
-	} else {
-		cs1550_root_directory root = readDisk();
-		if(root.nDirectories < MAX_DIRS_IN_ROOT) {
-			long blockAddress = getBlockAddress();
-			if(blockAddress != -1) {
-				strcpy(root.directories[root.nDirectories].dname, directory);
-				root.directories[root.nDirectories].nStartBlock = (long)blockAddress;
-				root.nDirectories = root.nDirectories + 1;
-				cs1550_directory_entry newDirEntry;
-				newDirEntry.nFiles = 0;
-				updateBitmap(blockAddress);
-				writeBlock(&root, 1, 0);
-				writeBlock(&newDirEntry, 1, blockAddress);
-			}
-		} else {
-			return -ENOSPC;
-		}
+	if(options.useMmap) {
+		void *map = mmap(NULL, diskSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if(map == MAP_FAILED)
+			fprintf(stderr, "cs1550: mmap of %s failed, using pread/pwrite: %s\n", path, strerror(errno));
+		else
+			diskMap = map;
 	}
 	return 0;
 }
 
-/*
- * Removes a directory.
- */
-static int cs1550_rmdir(const char *path)
-{
-	(void) path;
-    return 0;
+//Pushes everything written so far down to the image file. With async set
+//this only starts writeback of the mapping.
+static int devSync(int async) {
+	if(!async) statsCount(STAT_DEV_SYNCS, 1);
+	if(diskMap != NULL) {
+		if(msync(diskMap, diskSize, async ? MS_ASYNC : MS_SYNC) < 0) return -errno;
+		return 0;
+	}
+	if(diskFd >= 0 && !async && fdatasync(diskFd) < 0) return -errno;
+	return 0;
 }
 
-/*
- * Does the actual creation of a file. Mode and dev can be ignored.
- *
- */
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
-{
-	// printf("---Call function mknod---\n");
-	(void) mode;
-	(void) dev;
+static void devClose() {
+	devSync(0);
+	if(diskMap != NULL) munmap(diskMap, diskSize);
+	diskMap = NULL;
+	if(diskFd >= 0) close(diskFd);
+	diskFd = -1;
+}
 
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+//Address of location inside the mapped image, or NULL when not mapped.
+static void *devPtr(off_t location) {
+	if(diskMap == NULL || location < 0 || location >= diskSize) return NULL;
+	return diskMap + location;
+}
 
-	tokenPath(path, directory, filename, extension);
+static ssize_t devRead(void *buf, size_t size, off_t location) {
+	size_t done = 0;
+	statsCount(STAT_DEV_READS, 1);
+	if(diskMap != NULL) {
+		if(location >= diskSize) return 0;
+		if(location + size > diskSize) size = diskSize - location;
+		memcpy(buf, diskMap + location, size);
+		statsCount(STAT_DEV_READ_BYTES, size);
+		return size;
+	}
+	if(diskFd < 0) return -EIO;
+	while(done < size) {
+		ssize_t n = pread(diskFd, (char *)buf + done, size - done, location + done);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return -errno;
+		}
+		if(n == 0) break;	//past the end of the image
+		done += n;
+	}
+	statsCount(STAT_DEV_READ_BYTES, done);
+	return done;
+}
 
-	if(strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) {
-		return -ENAMETOOLONG;
-	}	else if (isContainFile(directory, filename, extension) == 1) {
-		return -EEXIST;
-	} else if (strlen(directory) == 0) {
-		return -EPERM;
-	} else {
-		cs1550_root_directory root = readDisk();
+//Scatter read of consecutive bytes at location. One attempt only; the
+//caller copes with a short count.
+static ssize_t devReadv(const struct iovec *iov, int count, off_t location) {
+	ssize_t n;
+	if(diskMap != NULL) {
+		ssize_t done = 0;
 		int i;
-		cs1550_directory_entry currDir;
-		long dirNStartBlock = -1;
-		for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
-			if(strcmp(root.directories[i].dname, directory) == 0) {
-				currDir = readDirectory(root.directories[i].nStartBlock);
-				dirNStartBlock = root.directories[i].nStartBlock;
-				break;
-			}
+		for(i = 0 ; i < count ; i++) {
+			n = devRead(iov[i].iov_base, iov[i].iov_len, location + done);
+			if(n < 0) return n;
+			done += n;
+			if(n < (ssize_t)iov[i].iov_len) break;
 		}
-		long blockAddress = getBlockAddress();
-		if(blockAddress != -1) {
-			strcpy(currDir.files[currDir.nFiles].fname, filename);
-			if(strlen(extension) > 0) strcpy(currDir.files[currDir.nFiles].fext, extension);
-			currDir.files[currDir.nFiles].fsize = 0;
-			currDir.files[currDir.nFiles].nStartBlock = blockAddress;
-			currDir.nFiles = currDir.nFiles + 1;
-			cs1550_disk_block file;
-			strcpy(file.data, "");
-			updateBitmap(blockAddress);
-			writeBlock(&currDir, 1, dirNStartBlock);
-			writeBlock(&file, 1, blockAddress);
+		return done;
+	}
+	if(diskFd < 0) return -EIO;
+	n = preadv(diskFd, iov, count, location);
+	if(n < 0) return -errno;
+	statsCount(STAT_DEV_READS, 1);
+	statsCount(STAT_DEV_READ_BYTES, n);
+	return n;
+}
+
+//devWrite without the checksums, for writes sumWrite has seen already.
+static ssize_t devPwrite(const void *buf, size_t size, off_t location) {
+	size_t done = 0;
+	statsCount(STAT_DEV_WRITES, 1);
+	if(diskMap != NULL) {
+		if(location + size > diskSize) return -ENOSPC;
+		//callers that edited a block in place hand back the mapped address
+		if(buf != diskMap + location)
+			memmove(diskMap + location, buf, size);
+		statsCount(STAT_DEV_WRITE_BYTES, size);
+		return size;
+	}
+	if(diskFd < 0) return -EIO;
+	while(done < size) {
+		ssize_t n = pwrite(diskFd, (const char *)buf + done, size - done, location + done);
+		if(n < 0) {
+			if(errno == EINTR) continue;
+			return -errno;
 		}
+		done += n;
 	}
+	statsCount(STAT_DEV_WRITE_BYTES, done);
+	return done;
+}
 
-	return 0;
+static ssize_t devWrite(const void *buf, size_t size, off_t location) {
+	//the bytes of a block edited in place are gone already
+	int inPlace = diskMap != NULL && buf == diskMap + location;
+	ssize_t res;
+
+	if(!inPlace) sumWrite(buf, size, location);
+	res = devPwrite(buf, size, location);
+	if(inPlace) sumRefresh(location, size);
+	return res;
 }
 
-/*
- * Deletes a file
- */
-static int cs1550_unlink(const char *path)
+//Gives the image file's space for a freed range back to the host, which
+//reads it as zeros from then on. Best effort: where the host filesystem
+//cannot punch holes the range simply stays allocated.
+static void devPunch(off_t location, off_t size) {
+	statsCount(STAT_HOLE_PUNCHES, 1);
+#ifdef FALLOC_FL_PUNCH_HOLE
+	if(diskFd >= 0 && fallocate(diskFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, location, size) == 0)
+		sumPunch(location / BLOCK_SIZE, size / BLOCK_SIZE);
+#else
+	(void) location;
+	(void) size;
+#endif
+}
+
+//Optional io_uring engine (-o io_uring). Callers queue independent reads and
+//writes in a batch, and the whole batch goes to the kernel in one
+//io_uring_enter and completes in parallel, instead of one pread or pwrite
+//after another. The rings are driven through the raw system calls, so no
+//library is needed. Without kernel support, with -o mmap, or when built
+//without <linux/io_uring.h>, a batch runs as plain positioned reads and
+//writes.
+#define IO_BATCH 64	//requests per submission, also the ring size
+#define IO_RINGS 4	//rings shared by the handler threads
+
+struct cs1550_io_req
 {
-    (void) path;
+	int write;
+	const struct iovec *iov;
+	int count;
+	struct iovec one;	//iov of a request for a single buffer
+	off_t location;
+	long block;	//for done: first block of the request
+	void (*done)(struct cs1550_io_req *req, ssize_t res);
+};
+
+struct cs1550_io_batch
+{
+	int n;
+	int error;	//first failed write, -errno
+	struct cs1550_io_req reqs[IO_BATCH];
+};
+
+#ifdef CS1550_URING
+struct cs1550_ring
+{
+	pthread_mutex_t lock;	//one batch at a time owns the ring
+	int fd;
+	int broken;	//io_uring_enter failed; batches run synchronously
+	void *sq;
+	void *cq;
+	size_t sqSize;
+	size_t cqSize;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+	unsigned *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+};
+
+static struct cs1550_ring rings[IO_RINGS];
+static int nRings = 0;
+static unsigned int nextRing = 0;
 
-    return 0;
+static void ringClose(struct cs1550_ring *ring) {
+	if(ring->sqes != NULL) munmap(ring->sqes, ring->sqesSize);
+	if(ring->cq != NULL && ring->cq != ring->sq) munmap(ring->cq, ring->cqSize);
+	if(ring->sq != NULL) munmap(ring->sq, ring->sqSize);
+	if(ring->fd >= 0) close(ring->fd);
+	ring->sqes = NULL;
+	ring->sq = ring->cq = NULL;
+	ring->fd = -1;
 }
 
+static void *ringMap(int fd, size_t size, off_t offset) {
+	void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static int ringOpen(struct cs1550_ring *ring) {
+	struct io_uring_params params;
+
+	memset(ring, 0, sizeof(struct cs1550_ring));
+	memset(&params, 0, sizeof(params));
+	ring->fd = syscall(__NR_io_uring_setup, IO_BATCH, &params);
+	if(ring->fd < 0) return -errno;
+	ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if(params.features & IORING_FEAT_SINGLE_MMAP) {
+		if(ring->cqSize > ring->sqSize) ring->sqSize = ring->cqSize;
+		ring->cqSize = ring->sqSize;
+	}
+	ring->sq = ringMap(ring->fd, ring->sqSize, IORING_OFF_SQ_RING);
+	if(ring->sq != NULL)
+		ring->cq = params.features & IORING_FEAT_SINGLE_MMAP ? ring->sq : ringMap(ring->fd, ring->cqSize, IORING_OFF_CQ_RING);
+	ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	if(ring->cq != NULL)
+		ring->sqes = ringMap(ring->fd, ring->sqesSize, IORING_OFF_SQES);
+	if(ring->sqes == NULL) {
+		int err = -errno;
+		ringClose(ring);
+		return err;
+	}
+	ring->sqTail = (unsigned *)((char *)ring->sq + params.sq_off.tail);
+	ring->sqMask = (unsigned *)((char *)ring->sq + params.sq_off.ring_mask);
+	ring->sqArray = (unsigned *)((char *)ring->sq + params.sq_off.array);
+	ring->cqHead = (unsigned *)((char *)ring->cq + params.cq_off.head);
+	ring->cqTail = (unsigned *)((char *)ring->cq + params.cq_off.tail);
+	ring->cqMask = (unsigned *)((char *)ring->cq + params.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)((char *)ring->cq + params.cq_off.cqes);
+	pthread_mutex_init(&ring->lock, NULL);
+	return 0;
+}
+#endif
+
+//Sets up the rings for -o io_uring. Failing that, I/O stays synchronous.
+static void ioOpen() {
+#ifdef CS1550_URING
+	int res = 0;
+	if(!options.ioUring || diskMap != NULL) return;
+	for(nRings = 0 ; nRings < IO_RINGS ; nRings++) {
+		res = ringOpen(&rings[nRings]);
+		if(res != 0) break;
+	}
+	if(nRings == 0)
+		fprintf(stderr, "cs1550: io_uring unavailable, using pread/pwrite: %s\n", strerror(-res));
+#else
+	if(options.ioUring)
+		fprintf(stderr, "cs1550: built without io_uring, using pread/pwrite\n");
+#endif
+}
+
+static void ioClose() {
+#ifdef CS1550_URING
+	while(nRings > 0) {
+		nRings--;
+		ringClose(&rings[nRings]);
+		pthread_mutex_destroy(&rings[nRings].lock);
+	}
+#endif
+}
+
+static size_t ioLength(const struct cs1550_io_req *req) {
+	size_t total = 0;
+	int i;
+	for(i = 0 ; i < req->count ; i++)
+		total += req->iov[i].iov_len;
+	return total;
+}
+
+//Runs one request with positioned reads and writes. Reads make one attempt
+//like devReadv; writes are completed or fail.
+static ssize_t ioRunSync(const struct cs1550_io_req *req) {
+	ssize_t total = 0;
+	int i;
+
+	if(!req->write) return devReadv(req->iov, req->count, req->location);
+	for(i = 0 ; i < req->count ; i++) {
+		ssize_t n = devPwrite(req->iov[i].iov_base, req->iov[i].iov_len, req->location + total);
+		if(n != (ssize_t)req->iov[i].iov_len) return n < 0 ? n : -EIO;
+		total += n;
+	}
+	return total;
+}
+
+static void ioComplete(struct cs1550_io_batch *batch, struct cs1550_io_req *req, ssize_t res) {
+	if(req->write && res != (ssize_t)ioLength(req)) {
+		if(res >= 0) res = -EIO;
+		if(batch->error == 0) batch->error = res;
+	}
+	if(req->done != NULL) req->done(req, res);
+}
+
+#ifdef CS1550_URING
+//Takes a ring for one batch, preferring one nobody is using. Returns NULL
+//when the batch has to run synchronously.
+static struct cs1550_ring *ringAcquire() {
+	unsigned int start;
+	struct cs1550_ring *ring = NULL;
+	int i;
+
+	if(nRings == 0 || diskMap != NULL) return NULL;
+	start = __atomic_fetch_add(&nextRing, 1, __ATOMIC_RELAXED);
+	for(i = 0 ; i < nRings ; i++) {
+		ring = &rings[(start + i) % nRings];
+		if(pthread_mutex_trylock(&ring->lock) == 0) break;
+	}
+	if(i == nRings) {
+		ring = &rings[start % nRings];
+		pthread_mutex_lock(&ring->lock);
+	}
+	if(ring->broken) {
+		pthread_mutex_unlock(&ring->lock);
+		return NULL;
+	}
+	return ring;
+}
+
+//Submits the whole batch at once and waits for every completion. Requests
+//the kernel wrote short, or that never completed, are finished with plain
+//system calls; they are all idempotent.
+static void ringRun(struct cs1550_ring *ring, struct cs1550_io_batch *batch) {
+	ssize_t res[IO_BATCH];
+	char completed[IO_BATCH];
+	unsigned tail = *ring->sqTail;
+	int toSubmit = batch->n;
+	int done = 0;
+	int i;
+
+	for(i = 0 ; i < batch->n ; i++) {
+		struct cs1550_io_req *req = &batch->reqs[i];
+		unsigned index = tail & *ring->sqMask;
+		struct io_uring_sqe *sqe = &ring->sqes[index];
+		memset(sqe, 0, sizeof(struct io_uring_sqe));
+		sqe->opcode = req->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd = diskFd;
+		sqe->off = req->location;
+		sqe->addr = (unsigned long)req->iov;
+		sqe->len = req->count;
+		sqe->user_data = i;
+		ring->sqArray[index] = index;
+		tail++;
+		completed[i] = 0;
+	}
+	__atomic_store_n(ring->sqTail, tail, __ATOMIC_RELEASE);
+	while(done < batch->n) {
+		unsigned head = *ring->cqHead;
+		int n = syscall(__NR_io_uring_enter, ring->fd, toSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+		if(n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			ring->broken = 1;
+			fprintf(stderr, "cs1550: io_uring failed, using pread/pwrite: %s\n", strerror(errno));
+			break;
+		}
+		if(n > 0) toSubmit -= n;
+		while(head != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cqMask];
+			res[cqe->user_data] = cqe->res;
+			completed[cqe->user_data] = 1;
+			head++;
+			done++;
+		}
+		__atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+	}
+	statsCount(STAT_RING_SUBMITS, 1);
+	for(i = 0 ; i < batch->n ; i++) {
+		struct cs1550_io_req *req = &batch->reqs[i];
+		if(!completed[i] || (req->write && res[i] != (ssize_t)ioLength(req))) {
+			res[i] = ioRunSync(req);
+		} else if(res[i] >= 0) {
+			statsCount(req->write ? STAT_DEV_WRITES : STAT_DEV_READS, 1);
+			statsCount(req->write ? STAT_DEV_WRITE_BYTES : STAT_DEV_READ_BYTES, res[i]);
+		}
+		ioComplete(batch, req, res[i]);
+	}
+}
+#endif
+
+static void ioStart(struct cs1550_io_batch *batch) {
+	batch->n = 0;
+	batch->error = 0;
+}
+
+//Runs what is queued and empties the batch, keeping its error.
+static void ioRun(struct cs1550_io_batch *batch) {
+	int i;
+#ifdef CS1550_URING
+	struct cs1550_ring *ring = batch->n > 1 ? ringAcquire() : NULL;
+	if(ring != NULL) {
+		ringRun(ring, batch);
+		pthread_mutex_unlock(&ring->lock);
+		batch->n = 0;
+		return;
+	}
+#endif
+	for(i = 0 ; i < batch->n ; i++)
+		ioComplete(batch, &batch->reqs[i], ioRunSync(&batch->reqs[i]));
+	batch->n = 0;
+}
+
+//Runs everything queued and waits for it. Returns the first write error.
+static int ioSubmit(struct cs1550_io_batch *batch) {
+	ioRun(batch);
+	return batch->error;
+}
+
+//Queues a read or write of iov at location. The iovecs must stay valid
+//until the batch has run; done, if set, is called with the result.
+static struct cs1550_io_req *ioQueue(struct cs1550_io_batch *batch, int write, const struct iovec *iov, int count,
+			  off_t location, void (*done)(struct cs1550_io_req *req, ssize_t res)) {
+	struct cs1550_io_req *req;
+
+	if(batch->n == IO_BATCH) ioRun(batch);
+	req = &batch->reqs[batch->n++];
+	req->write = write;
+	req->iov = iov;
+	req->count = count;
+	req->location = location;
+	req->block = location / BLOCK_SIZE;
+	req->done = done;
+	return req;
+}
+
+//Queues a write of one buffer, which must stay valid until the batch has
+//run. The batch must not write another part of the same blocks.
+static void ioQueueWrite(struct cs1550_io_batch *batch, const void *buf, size_t size, off_t location) {
+	struct cs1550_io_req *req = ioQueue(batch, 1, NULL, 1, location, NULL);
+
+	sumWrite(buf, size, location);
+	req->one.iov_base = (void *)buf;
+	req->one.iov_len = size;
+	req->iov = &req->one;
+}
+
+//Block cache for file data and extent blocks, between the file code and the
+//device. It is split into shards by block number, each with its own lock and
+//its own ARC (adaptive replacement cache): T1 holds blocks used once, T2
+//blocks used again, and the ghost lists B1 and B2 remember what was recently
+//evicted from each so the split between T1 and T2 follows the workload. A
+//long scan only cycles through T1 and leaves the blocks in T2 alone.
+//
+//Writes go straight to the device and update any cached copy. Metadata
+//blocks bypass the cache since they are cached whole. With -o mmap the page
+//cache already does this job, so the cache is left off.
+#define CACHE_SHARDS 16
+#define CACHE_MAX_RUN ((1 << 20) / BLOCK_SIZE)	//blocks read in one go on a miss
+#define CACHE_MAX_IOV 1024	//Linux's limit on one preadv
+
+#define CACHE_T1 0
+#define CACHE_T2 1
+#define CACHE_B1 2
+#define CACHE_B2 3
+#define CACHE_FREE 4
+
+struct cs1550_cache_entry
+{
+	long block;
+	int list;	//while loading, the list it joins once the data is in
+	int loading;	//buffer reserved and being read, kept off the lists
+	int prefetched;	//read ahead and not used yet
+	struct cs1550_cache_entry *prev;
+	struct cs1550_cache_entry *next;
+	struct cs1550_cache_entry *hashNext;
+	char *data;	//NULL on the ghost lists
+};
+
+struct cs1550_cache_counters
+{
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long ghostHits;	//misses on a block ARC had just evicted
+	unsigned long prefetched;
+	unsigned long prefetchHits;
+};
+
+struct cs1550_cache_shard
+{
+	pthread_mutex_t lock;
+	long capacity;	//resident blocks
+	long target;	//how many of them T1 should hold
+	struct cs1550_cache_entry lists[5];	//circular list heads, T1 to CACHE_FREE
+	long counts[5];
+	struct cs1550_cache_entry **hash;
+	unsigned long hashMask;
+	struct cs1550_cache_entry *entries;	//2 * capacity, for T1, T2, B1 and B2
+	char *buffers;
+	char **freeBuffers;
+	long nFreeBuffers;
+	struct cs1550_cache_counters counters;
+};
+
+static struct cs1550_cache_shard *cacheShards = NULL;
+static int nCacheShards = 0;
+static long readAheadBlocks = 0;
+
+static struct cs1550_cache_shard *cacheShard(long block) {
+	return &cacheShards[block % nCacheShards];
+}
+
+static void cacheUnlink(struct cs1550_cache_shard *shard, struct cs1550_cache_entry *e) {
+	e->prev->next = e->next;
+	e->next->prev = e->prev;
+	shard->counts[e->list]--;
+}
+
+//Puts e at the most recently used end of list.
+static void cachePush(struct cs1550_cache_shard *shard, struct cs1550_cache_entry *e, int list) {
+	struct cs1550_cache_entry *head = &shard->lists[list];
+	e->list = list;
+	e->next = head;
+	e->prev = head->prev;
+	head->prev->next = e;
+	head->prev = e;
+	shard->counts[list]++;
+}
+
+//Least recently used entry of list, or NULL.
+static struct cs1550_cache_entry *cacheLru(struct cs1550_cache_shard *shard, int list) {
+	struct cs1550_cache_entry *head = &shard->lists[list];
+	return head->next == head ? NULL : head->next;
+}
+
+static struct cs1550_cache_entry **cacheBucket(struct cs1550_cache_shard *shard, long block) {
+	return &shard->hash[((unsigned long)block * 0x9E3779B97F4A7C15ULL >> 20) & shard->hashMask];
+}
+
+static struct cs1550_cache_entry *cacheFind(struct cs1550_cache_shard *shard, long block) {
+	struct cs1550_cache_entry *e;
+	for(e = *cacheBucket(shard, block) ; e != NULL ; e = e->hashNext) {
+		if(e->block == block) return e;
+	}
+	return NULL;
+}
+
+//Drops e from the cache altogether.
+static void cacheForget(struct cs1550_cache_shard *shard, struct cs1550_cache_entry *e) {
+	struct cs1550_cache_entry **p = cacheBucket(shard, e->block);
+	while(*p != e) p = &(*p)->hashNext;
+	*p = e->hashNext;
+	cacheUnlink(shard, e);
+	if(e->data != NULL) shard->freeBuffers[shard->nFreeBuffers++] = e->data;
+	e->data = NULL;
+	cachePush(shard, e, CACHE_FREE);
+}
+
+//Moves the least recently used block of T1 or T2 to its ghost list,
+//freeing its buffer. inB2 is set when the block being brought in was found
+//on B2.
+static void cacheReplace(struct cs1550_cache_shard *shard, int inB2) {
+	struct cs1550_cache_entry *e;
+	long t1 = shard->counts[CACHE_T1];
+
+	if(shard->nFreeBuffers > 0) return;
+	if(t1 > 0 && (t1 > shard->target || (inB2 && t1 == shard->target)))
+		e = cacheLru(shard, CACHE_T1);
+	else
+		e = cacheLru(shard, CACHE_T2);
+	if(e == NULL) e = cacheLru(shard, CACHE_T1);
+	if(e == NULL) return;	//everything is still loading
+	cacheUnlink(shard, e);
+	shard->freeBuffers[shard->nFreeBuffers++] = e->data;
+	e->data = NULL;
+	cachePush(shard, e, e->list == CACHE_T1 ? CACHE_B1 : CACHE_B2);
+}
+
+//Copies part of a cached block out. Returns 0 when the block is not cached.
+static int cacheLookup(long block, char *buf, size_t within, size_t size) {
+	struct cs1550_cache_shard *shard = cacheShard(block);
+	struct cs1550_cache_entry *e;
+	int hit = 0;
+
+	pthread_mutex_lock(&shard->lock);
+	e = cacheFind(shard, block);
+	if(e != NULL && e->data != NULL && !e->loading) {
+		memcpy(buf, e->data + within, size);
+		cacheUnlink(shard, e);
+		if(e->prefetched) {
+			//the first real use of a read-ahead block
+			e->prefetched = 0;
+			shard->counters.prefetchHits++;
+			cachePush(shard, e, CACHE_T1);
+		} else {
+			cachePush(shard, e, CACHE_T2);
+		}
+		shard->counters.hits++;
+		hit = 1;
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return hit;
+}
+
+static int cacheContains(long block) {
+	struct cs1550_cache_shard *shard = cacheShard(block);
+	struct cs1550_cache_entry *e;
+	int resident;
+
+	pthread_mutex_lock(&shard->lock);
+	e = cacheFind(shard, block);
+	resident = e != NULL && e->data != NULL;
+	pthread_mutex_unlock(&shard->lock);
+	return resident;
+}
+
+//Makes room for block and returns the buffer its data should be read into,
+//or NULL when it is already cached or every buffer is being loaded. The
+//entry stays invisible to lookups until cacheLoaded.
+static char *cacheReserve(long block, int prefetched) {
+	struct cs1550_cache_shard *shard = cacheShard(block);
+	struct cs1550_cache_entry *e;
+	int list = CACHE_T1;
+
+	pthread_mutex_lock(&shard->lock);
+	e = cacheFind(shard, block);
+	if(e != NULL && e->data != NULL) {
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
+	}
+	if(e != NULL && !prefetched) {
+		//evicted too early: grow the list it was evicted from
+		long b1 = shard->counts[CACHE_B1];
+		long b2 = shard->counts[CACHE_B2];
+		int inB2 = e->list == CACHE_B2;
+		if(inB2)
+			shard->target -= b2 >= b1 ? 1 : b1 / b2;
+		else
+			shard->target += b1 >= b2 ? 1 : b2 / b1;
+		if(shard->target < 0) shard->target = 0;
+		if(shard->target > shard->capacity) shard->target = shard->capacity;
+		shard->counters.ghostHits++;
+		cacheReplace(shard, inB2);
+		cacheUnlink(shard, e);
+		list = CACHE_T2;
+	} else {
+		long l1, total;
+		if(e != NULL) cacheForget(shard, e);
+		l1 = shard->counts[CACHE_T1] + shard->counts[CACHE_B1];
+		total = l1 + shard->counts[CACHE_T2] + shard->counts[CACHE_B2];
+		if(l1 >= shard->capacity && shard->counts[CACHE_B1] > 0) {
+			cacheForget(shard, cacheLru(shard, CACHE_B1));
+			cacheReplace(shard, 0);
+		} else if(l1 >= shard->capacity && shard->counts[CACHE_T1] > 0) {
+			cacheForget(shard, cacheLru(shard, CACHE_T1));
+		} else if(total >= shard->capacity) {
+			if(total >= 2 * shard->capacity && shard->counts[CACHE_B2] > 0)
+				cacheForget(shard, cacheLru(shard, CACHE_B2));
+			cacheReplace(shard, 0);
+		}
+		e = cacheLru(shard, CACHE_FREE);
+		if(e == NULL) {
+			//every entry is taken by loads in flight
+			pthread_mutex_unlock(&shard->lock);
+			return NULL;
+		}
+		cacheUnlink(shard, e);
+		e->block = block;
+		e->hashNext = *cacheBucket(shard, block);
+		*cacheBucket(shard, block) = e;
+	}
+	//loads in flight hold buffers the ARC counts do not see
+	if(shard->nFreeBuffers == 0) cacheReplace(shard, 0);
+	if(shard->nFreeBuffers == 0) {
+		cachePush(shard, e, CACHE_FREE);
+		cacheForget(shard, e);
+		pthread_mutex_unlock(&shard->lock);
+		return NULL;
+	}
+	e->data = shard->freeBuffers[--shard->nFreeBuffers];
+	e->prefetched = prefetched;
+	e->list = list;
+	e->loading = 1;
+	if(prefetched) shard->counters.prefetched++;
+	else shard->counters.misses++;
+	pthread_mutex_unlock(&shard->lock);
+	return e->data;
+}
+
+//Publishes a reserved block once its data is in, or drops it if the read
+//failed.
+static void cacheLoaded(long block, int ok) {
+	struct cs1550_cache_shard *shard = cacheShard(block);
+	struct cs1550_cache_entry *e;
+
+	pthread_mutex_lock(&shard->lock);
+	e = cacheFind(shard, block);
+	e->loading = 0;
+	if(ok) {
+		cachePush(shard, e, e->list);
+	} else {
+		//cacheForget expects it on a list
+		cachePush(shard, e, CACHE_FREE);
+		cacheForget(shard, e);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+//Adds a block just read from the device.
+static void cacheInsert(long block, const char *data, int prefetched) {
+	char *buf = cacheReserve(block, prefetched);
+	if(buf == NULL) return;
+	memcpy(buf, data, BLOCK_SIZE);
+	cacheLoaded(block, 1);
+}
+
+//Copies part of a block just written into its cached copy, if there is one.
+static void cacheUpdate(long block, const char *buf, size_t within, size_t size) {
+	struct cs1550_cache_shard *shard;
+	struct cs1550_cache_entry *e;
+
+	if(cacheShards == NULL) return;
+	shard = cacheShard(block);
+	pthread_mutex_lock(&shard->lock);
+	e = cacheFind(shard, block);
+	if(e != NULL && e->data != NULL && !e->loading)
+		memcpy(e->data + within, buf, size);
+	pthread_mutex_unlock(&shard->lock);
+}
+
+//Drops the cached copies of count blocks written without going through
+//cacheWrite.
+static void cacheDrop(long block, long count) {
+	long i;
+
+	if(cacheShards == NULL) return;
+	for(i = block ; i < block + count ; i++) {
+		struct cs1550_cache_shard *shard = cacheShard(i);
+		struct cs1550_cache_entry *e;
+		pthread_mutex_lock(&shard->lock);
+		e = cacheFind(shard, i);
+		if(e != NULL && e->data != NULL && !e->loading)
+			cacheForget(shard, e);
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
+
+//Reads count blocks from the device into buf and caches them. Returns the
+//number of whole blocks read or -errno.
+static long cacheFill(long block, long count, char *buf, int prefetched) {
+	ssize_t n = sumRead(buf, block, count);
+	long i;
+	if(n < 0) return n;
+	for(i = 0 ; i < n / BLOCK_SIZE ; i++)
+		cacheInsert(block + i, buf + i * BLOCK_SIZE, prefetched);
+	return n / BLOCK_SIZE;
+}
+
+//Bytes from location to the end of its block or to end, whichever is first.
+static size_t cachePiece(off_t location, off_t end) {
+	size_t piece = BLOCK_SIZE - location % BLOCK_SIZE;
+	return (off_t)piece < end - location ? piece : (size_t)(end - location);
+}
+
+static ssize_t cacheRead(void *buf, size_t size, off_t location) {
+	char *out = buf;
+	off_t end = location + size;
+
+	if(cacheShards == NULL) return sums != NULL ? sumReadBytes(buf, size, location) : devRead(buf, size, location);
+	while(location < end) {
+		long block = location / BLOCK_SIZE;
+		long last = (end - 1) / BLOCK_SIZE;
+		long count, got, i;
+		char *run;
+
+		if(cacheLookup(block, out, location % BLOCK_SIZE, cachePiece(location, end))) {
+			out += cachePiece(location, end);
+			location += cachePiece(location, end);
+			continue;
+		}
+		//read the whole run of missing blocks at once, straight into the
+		//caller's buffer when it covers them exactly
+		for(count = 1 ; block + count <= last && count < CACHE_MAX_RUN && !cacheContains(block + count) ; count++)
+			;
+		if(location % BLOCK_SIZE == 0 && (block + count) * BLOCK_SIZE <= end) {
+			got = cacheFill(block, count, out, 0);
+			if(got < 0) return got;
+			if(got < count) memset(out + got * BLOCK_SIZE, 0, (count - got) * BLOCK_SIZE);
+			out += count * BLOCK_SIZE;
+			location += count * BLOCK_SIZE;
+			continue;
+		}
+		run = malloc(count * BLOCK_SIZE);
+		if(run == NULL) return -ENOMEM;
+		got = cacheFill(block, count, run, 0);
+		if(got < 0) {
+			free(run);
+			return got;
+		}
+		if(got < count) memset(run + got * BLOCK_SIZE, 0, (count - got) * BLOCK_SIZE);
+		for(i = 0 ; i < count && location < end ; i++) {
+			size_t piece = cachePiece(location, end);
+			memcpy(out, run + i * BLOCK_SIZE + location % BLOCK_SIZE, piece);
+			out += piece;
+			location += piece;
+		}
+		free(run);
+	}
+	return size;
+}
+
+static ssize_t cacheWrite(const void *buf, size_t size, off_t location) {
+	const char *in = buf;
+	off_t end = location + size;
+	ssize_t res = devWrite(buf, size, location);
+
+	if(res < 0 || cacheShards == NULL) return res;
+	while(location < end) {
+		size_t piece = cachePiece(location, end);
+		cacheUpdate(location / BLOCK_SIZE, in, location % BLOCK_SIZE, piece);
+		in += piece;
+		location += piece;
+	}
+	return res;
+}
+
+static void cachePrefetchDone(struct cs1550_io_req *req, ssize_t got) {
+	long i;
+	for(i = 0 ; i < req->count ; i++)
+		cacheLoaded(req->block + i, got >= (i + 1) * BLOCK_SIZE && sumMatches(req->block + i, req->iov[i].iov_base));
+	free((void *)req->iov);
+}
+
+//Pulls blocks [block, block+count) into the cache ahead of use, reading
+//straight into the cache's buffers. The reads are queued on batch and the
+//blocks stay loading until it runs. Nothing is read while the first half of
+//the range is already cached, so a reader moving through a window triggers
+//one large read per half window.
+static void cachePrefetch(struct cs1550_io_batch *batch, long block, long count) {
+	struct iovec *iov;
+	long first, n;
+
+	if(cacheShards == NULL || count <= 0) return;
+	if(count > CACHE_MAX_RUN) count = CACHE_MAX_RUN;
+	if(count > CACHE_MAX_IOV) count = CACHE_MAX_IOV;
+	if(cacheContains(block + count / 2)) return;
+	for(first = block ; first < block + count && cacheContains(first) ; first++)
+		;
+	while(first < block + count) {
+		iov = malloc((block + count - first) * sizeof(struct iovec));
+		if(iov == NULL) return;
+		//reserve a run of blocks that are not cached yet
+		for(n = 0 ; first + n < block + count ; n++) {
+			iov[n].iov_base = cacheReserve(first + n, 1);
+			iov[n].iov_len = BLOCK_SIZE;
+			if(iov[n].iov_base == NULL) break;
+		}
+		if(n > 0)
+			ioQueue(batch, 0, iov, n, first * BLOCK_SIZE, cachePrefetchDone);
+		else
+			free(iov);
+		first += n + 1;
+	}
+}
+
+static void cacheFree() {
+	int i;
+	for(i = 0 ; i < nCacheShards ; i++) {
+		pthread_mutex_destroy(&cacheShards[i].lock);
+		free(cacheShards[i].hash);
+		free(cacheShards[i].entries);
+		free(cacheShards[i].buffers);
+		free(cacheShards[i].freeBuffers);
+	}
+	free(cacheShards);
+	cacheShards = NULL;
+	nCacheShards = 0;
+}
+
+static int cacheInit() {
+	long capacity = (long)options.cacheMiB * (1 << 20) / BLOCK_SIZE;
+	int shards = capacity >= CACHE_SHARDS * 16 ? CACHE_SHARDS : 1;
+	int i, k;
+
+	readAheadBlocks = (long)options.readAheadKiB * 1024 / BLOCK_SIZE;
+	if(diskMap != NULL || capacity == 0) return 0;
+	cacheShards = calloc(shards, sizeof(struct cs1550_cache_shard));
+	if(cacheShards == NULL) return -ENOMEM;
+	for(i = 0 ; i < shards ; i++) {
+		struct cs1550_cache_shard *shard = &cacheShards[i];
+		unsigned long buckets = 1;
+		pthread_mutex_init(&shard->lock, NULL);
+		shard->capacity = capacity / shards;
+		if(shard->capacity < 1) shard->capacity = 1;
+		while(buckets < 2 * (unsigned long)shard->capacity) buckets *= 2;
+		shard->hashMask = buckets - 1;
+		shard->hash = calloc(buckets, sizeof(struct cs1550_cache_entry *));
+		shard->entries = calloc(2 * shard->capacity, sizeof(struct cs1550_cache_entry));
+		shard->buffers = malloc(shard->capacity * BLOCK_SIZE);
+		shard->freeBuffers = malloc(shard->capacity * sizeof(char *));
+		nCacheShards = i + 1;	//so cacheFree only sees initialised shards
+		if(shard->hash == NULL || shard->entries == NULL || shard->buffers == NULL || shard->freeBuffers == NULL) {
+			cacheFree();
+			return -ENOMEM;
+		}
+		for(k = 0 ; k < 5 ; k++) {
+			shard->lists[k].next = &shard->lists[k];
+			shard->lists[k].prev = &shard->lists[k];
+		}
+		for(k = 0 ; k < 2 * shard->capacity ; k++)
+			cachePush(shard, &shard->entries[k], CACHE_FREE);
+		for(k = 0 ; k < shard->capacity ; k++)
+			shard->freeBuffers[shard->nFreeBuffers++] = shard->buffers + (long)k * BLOCK_SIZE;
+	}
+	return 0;
+}
+
+static void cacheCounters(struct cs1550_cache_counters *total) {
+	int i;
+	memset(total, 0, sizeof(struct cs1550_cache_counters));
+	for(i = 0 ; i < nCacheShards ; i++) {
+		struct cs1550_cache_counters *c = &cacheShards[i].counters;
+		pthread_mutex_lock(&cacheShards[i].lock);
+		total->hits += c->hits;
+		total->misses += c->misses;
+		total->ghostHits += c->ghostHits;
+		total->prefetched += c->prefetched;
+		total->prefetchHits += c->prefetchHits;
+		pthread_mutex_unlock(&cacheShards[i].lock);
+	}
+}
+
+static void cacheResetCounters() {
+	int i;
+	for(i = 0 ; i < nCacheShards ; i++) {
+		pthread_mutex_lock(&cacheShards[i].lock);
+		memset(&cacheShards[i].counters, 0, sizeof(struct cs1550_cache_counters));
+		pthread_mutex_unlock(&cacheShards[i].lock);
+	}
+}
+
+static void cacheReport(FILE *out) {
+	struct cs1550_cache_counters c;
+	cacheCounters(&c);
+	fprintf(out, "cs1550: cache hits=%lu misses=%lu ghost_hits=%lu prefetched=%lu prefetch_hits=%lu\n",
+		c.hits, c.misses, c.ghostHits, c.prefetched, c.prefetchHits);
+}
+
+static void writeMultiBlock(const void *block, size_t size, size_t location) {
+	cacheWrite(block, size, location);
+}
+
+static void writeBlock(const void *block, size_t times, size_t location ) {
+	devWrite(block, BLOCK_SIZE * times, location);
+}
+
+static int readFile(char *buf, long location, size_t size) {
+	return cacheRead(buf, size, location) < 0 ? -EIO : 0;
+}
+
+static cs1550_superblock super;
+
+//Metadata journal. Root, directory, extent and bitmap blocks are not
+//written in place as they change. Each new version is copied into the
+//running transaction instead. A commit writes the whole transaction to the
+//circular journal region in one go: a header, tag blocks naming where each
+//block belongs, then the blocks. Only after that is on disk are the blocks
+//written home, so a crash leaves either all of a transaction or none of it.
+//Mounting replays every complete transaction still in the journal.
+//
+//File data is written in place before the metadata that points at it. A
+//commit syncs the image before writing the journal, so no committed
+//metadata can point at data that is not on disk. That first sync also makes
+//the home copies of earlier transactions durable, so the journal never has
+//to hold more than the transaction being written.
+//
+//Handlers that change metadata bracket the change with journalBegin and
+//journalEnd, before taking any other lock. A commit waits until no handler
+//is inside a bracket, so a transaction never holds half an operation.
+//Concurrent operations share one commit: fsync, a full transaction, the
+//-o commit_ms timer and unmount all commit whatever has gathered.
+#define JOURNAL_MAGIC 0x4c4e524a	//"JRNL"
+#define TXN_MAGIC 0x4e585354	//"TSXN"
+#define JOURNAL_BYTES (4 << 20)
+#define JOURNAL_TAGS_PER_BLOCK (BLOCK_SIZE / sizeof(long))
+
+//First block of the journal region
+struct cs1550_journal_header
+{
+	unsigned int magic;
+	unsigned int sumsStale;	//the block checksums were not stored since the last mount
+	long nSequence;	//sequence number of the transaction at nTail
+	long nTail;	//where replay starts, relative to the journal start
+
+	char padding[BLOCK_SIZE - 2 * sizeof(int) - 2 * sizeof(long)];
+} ;
+
+//First block of a transaction in the journal. nTags tag blocks follow, each
+//an array of home block numbers, and then nBlocks blocks.
+struct cs1550_txn_header
+{
+	unsigned int magic;
+	unsigned int unused;
+	long nSequence;
+	long nBlocks;
+	long nTags;
+	uint64_t checksum;	//CRC32C over the sequence number, tags and blocks
+
+	char padding[BLOCK_SIZE - 2 * sizeof(int) - 3 * sizeof(long) - sizeof(uint64_t)];
+} ;
+
+typedef char cs1550_journal_layout_check[(sizeof(struct cs1550_journal_header) == BLOCK_SIZE &&
+	sizeof(struct cs1550_txn_header) == BLOCK_SIZE) ? 1 : -1];
+
+//A transaction in memory: the latest copy of each block it touched.
+struct cs1550_txn
+{
+	long nBlocks;
+	long capacity;
+	long *targets;	//home block numbers
+	char *data;	//nBlocks blocks, in the order of targets
+	long *slots;	//hash of target to index + 1, 0 for empty
+	unsigned long slotMask;
+};
+
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t journalCond = PTHREAD_COND_INITIALIZER;
+static int journalOn = 0;
+static struct cs1550_txn txns[2];
+static struct cs1550_txn *running = &txns[0];
+static struct cs1550_txn *committing = NULL;	//being written, still readable
+static long runningSeq = 0;	//commit that will take the running transaction
+static long committedSeq = 0;	//last commit fully written
+static long journalSeq = 1;	//sequence number of the next transaction in the journal
+static int activeHandles = 0;
+static int commitWaiting = 0;
+static long journalHead = 1;	//where the next transaction goes
+static long journalResetSeq = 0;	//last commit that left no older transaction to replay
+static pthread_t commitThread;
+static int commitThreadRunning = 0;
+static int commitThreadStop = 0;
+
+static void bitmapStore();
+static void dedupStore();
+static long dedupDirtyBlocks = 0;	//dedup table and share count blocks the next commit logs; read with atomics
+static void freeRelease(long commit);
+
+static unsigned long txnHash(long block, unsigned long mask) {
+	return ((unsigned long)block * 0x9E3779B97F4A7C15ULL >> 17) & mask;
+}
+
+//Index of block in txn, or -1.
+static long txnFind(const struct cs1550_txn *txn, long block) {
+	unsigned long i;
+	if(txn->slots == NULL) return -1;
+	for(i = txnHash(block, txn->slotMask) ; txn->slots[i] != 0 ; i = (i + 1) & txn->slotMask) {
+		if(txn->targets[txn->slots[i] - 1] == block) return txn->slots[i] - 1;
+	}
+	return -1;
+}
+
+//Sizes txn for capacity blocks. The journal sizes both transactions once, at
+//mount, so adding a block never has to allocate.
+static int txnReserve(struct cs1550_txn *txn, long capacity) {
+	unsigned long mask = 1;
+	long *targets = realloc(txn->targets, capacity * sizeof(long));
+	char *data;
+	long *slots;
+	long k;
+
+	//a power of two at least twice the capacity, so probes stay short
+	while(mask < 2 * (unsigned long)capacity)
+		mask <<= 1;
+	mask--;
+	if(targets == NULL) return -ENOMEM;
+	txn->targets = targets;
+	data = realloc(txn->data, capacity * BLOCK_SIZE);
+	if(data == NULL) return -ENOMEM;
+	txn->data = data;
+	slots = calloc(mask + 1, sizeof(long));
+	if(slots == NULL) return -ENOMEM;
+	free(txn->slots);
+	txn->slots = slots;
+	txn->slotMask = mask;
+	txn->capacity = capacity;
+	for(k = 0 ; k < txn->nBlocks ; k++) {
+		unsigned long i = txnHash(txn->targets[k], mask);
+		while(slots[i] != 0) i = (i + 1) & mask;
+		slots[i] = k + 1;
+	}
+	return 0;
+}
+
+//Copies a block into txn, replacing an older copy of the same block. Fails
+//when txn is full.
+static int txnAdd(struct cs1550_txn *txn, long block, const void *data) {
+	long k = txnFind(txn, block);
+	if(k < 0) {
+		unsigned long i;
+		if(txn->nBlocks == txn->capacity) return -ENOSPC;
+		k = txn->nBlocks++;
+		txn->targets[k] = block;
+		for(i = txnHash(block, txn->slotMask) ; txn->slots[i] != 0 ; i = (i + 1) & txn->slotMask)
+			;
+		txn->slots[i] = k + 1;
+	}
+	memcpy(txn->data + k * BLOCK_SIZE, data, BLOCK_SIZE);
+	return 0;
+}
+
+static void txnClear(struct cs1550_txn *txn) {
+	if(txn->nBlocks > 0) memset(txn->slots, 0, (txn->slotMask + 1) * sizeof(long));
+	txn->nBlocks = 0;
+}
+
+static void txnFree(struct cs1550_txn *txn) {
+	free(txn->targets);
+	free(txn->data);
+	free(txn->slots);
+	memset(txn, 0, sizeof(struct cs1550_txn));
+}
+
+//Checksum over the parts of a transaction: CRC32C, or FNV-1a on images from
+//before version 7.
+static uint64_t txnChecksum(long seq, const long *targets, long nTagBytes, const char *data, long nBlocks) {
+	uint64_t h = 14695981039346656037ULL;
+	const unsigned char *p;
+	long i;
+
+	if(super.version >= 7) {
+		uint32_t crc = crcUpdate(~0U, &seq, sizeof(long));
+		crc = crcUpdate(crc, targets, nTagBytes);
+		return ~crcUpdate(crc, data, nBlocks * BLOCK_SIZE);
+	}
+	p = (const unsigned char *)&seq;
+	for(i = 0 ; i < (long)sizeof(long) ; i++) h = (h ^ p[i]) * 1099511628211ULL;
+	p = (const unsigned char *)targets;
+	for(i = 0 ; i < nTagBytes ; i++) h = (h ^ p[i]) * 1099511628211ULL;
+	p = (const unsigned char *)data;
+	for(i = 0 ; i < nBlocks * BLOCK_SIZE ; i++) h = (h ^ p[i]) * 1099511628211ULL;
+	return h;
+}
+
+static int journalWriteHeader(long seq, long tail) {
+	struct cs1550_journal_header header;
+	memset(&header, 0, sizeof(header));
+	header.magic = JOURNAL_MAGIC;
+	header.sumsStale = super.nSumBlocks > 0 && !sumsStored;
+	header.nSequence = seq;
+	header.nTail = tail;
+	if(devWrite(&header, BLOCK_SIZE, super.nJournalStart * BLOCK_SIZE) != BLOCK_SIZE) return -EIO;
+	return 0;
+}
+
+//Writes the full running transaction home, since it holds as many blocks as
+//the journal can log and could never be committed as one. The transaction
+//being committed goes first, so none of its blocks lands over a newer one,
+//and the blocks stay readable from committing until they are home. The
+//journal is started over before, so that replay cannot bring back older
+//copies of them either. Called and returns with journalLock held.
+static void txnSpill() {
+	struct cs1550_txn *txn;
+	long reset;
+	long k;
+
+	while(committing != NULL)
+		pthread_cond_wait(&journalCond, &journalLock);
+	//another thread may have spilled it meanwhile
+	if(running->nBlocks < running->capacity) return;
+	txn = running;
+	running = txn == &txns[0] ? &txns[1] : &txns[0];
+	committing = txn;
+	reset = committedSeq;
+	pthread_mutex_unlock(&journalLock);
+	fprintf(stderr, "cs1550: transaction of %ld blocks does not fit the journal\n", txn->nBlocks);
+	//no commit runs while committing is set, so the journal is ours
+	if(devSync(0) == 0 && journalWriteHeader(journalSeq, journalHead) == 0) devSync(0);
+	for(k = 0 ; k < txn->nBlocks ; k++)
+		writeBlock(txn->data + k * BLOCK_SIZE, 1, txn->targets[k] * BLOCK_SIZE);
+	pthread_mutex_lock(&journalLock);
+	txnClear(txn);
+	journalResetSeq = reset;
+	committing = NULL;
+	pthread_cond_broadcast(&journalCond);
+}
+
+//Writes a metadata block: into the running transaction when the journal is
+//on, in place otherwise.
+static void metaWrite(const void *block, long location) {
+	if(journalOn) {
+		pthread_mutex_lock(&journalLock);
+		while(txnAdd(running, location / BLOCK_SIZE, block) != 0)
+			txnSpill();
+		pthread_mutex_unlock(&journalLock);
+	} else {
+		writeBlock(block, 1, location);
+	}
+}
+
+//Copies the newest unwritten version of the metadata block at location into
+//buf. Returns 0 when there is none and the home copy is current.
+static int journalRead(void *buf, long location) {
+	long k;
+	int found = 0;
+
+	if(!journalOn) return 0;
+	pthread_mutex_lock(&journalLock);
+	k = txnFind(running, location / BLOCK_SIZE);
+	if(k >= 0) {
+		memcpy(buf, running->data + k * BLOCK_SIZE, BLOCK_SIZE);
+		found = 1;
+	} else if(committing != NULL && (k = txnFind(committing, location / BLOCK_SIZE)) >= 0) {
+		memcpy(buf, committing->data + k * BLOCK_SIZE, BLOCK_SIZE);
+		found = 1;
+	}
+	pthread_mutex_unlock(&journalLock);
+	return found;
+}
+
+static void journalBegin() {
+	if(!journalOn) return;
+	pthread_mutex_lock(&journalLock);
+	while(commitWaiting)
+		pthread_cond_wait(&journalCond, &journalLock);
+	activeHandles++;
+	pthread_mutex_unlock(&journalLock);
+}
+
+//Writes txn, which commit takes, to the journal and then home. Called
+//without journalLock, by one thread at a time.
+static int journalWrite(struct cs1550_txn *txn, long commit) {
+	long seq = journalSeq;
+	struct cs1550_txn_header header;
+	struct cs1550_io_batch batch;
+	long nTags = (txn->nBlocks + JOURNAL_TAGS_PER_BLOCK - 1) / JOURNAL_TAGS_PER_BLOCK;
+	long length = 1 + nTags + txn->nBlocks;
+	long *tags;
+	long k;
+	int res;
+
+	statsCount(STAT_COMMITS, 1);
+	//data and the home copies of the last transaction first
+	if((res = devSync(0)) != 0) return res;
+	if(length > super.nJournalBlocks - 1) {
+		//too big for the journal: the best we can do is write it in place
+		fprintf(stderr, "cs1550: transaction of %ld blocks does not fit the journal\n", txn->nBlocks);
+		nTags = 0;
+	} else {
+		if(journalHead + length > super.nJournalBlocks) {
+			//wrap; everything before is already home
+			journalHead = 1;
+			if((res = journalWriteHeader(seq, 1)) != 0 || (res = devSync(0)) != 0) return res;
+			journalResetSeq = commit;
+		}
+		tags = calloc(nTags, BLOCK_SIZE);
+		if(tags == NULL) return -ENOMEM;
+		memcpy(tags, txn->targets, txn->nBlocks * sizeof(long));
+		memset(&header, 0, sizeof(header));
+		header.magic = TXN_MAGIC;
+		header.nSequence = seq;
+		header.nBlocks = txn->nBlocks;
+		header.nTags = nTags;
+		header.checksum = txnChecksum(seq, tags, nTags * BLOCK_SIZE, txn->data, txn->nBlocks);
+		k = (super.nJournalStart + journalHead) * BLOCK_SIZE;
+		ioStart(&batch);
+		ioQueueWrite(&batch, &header, BLOCK_SIZE, k);
+		ioQueueWrite(&batch, tags, nTags * BLOCK_SIZE, k + BLOCK_SIZE);
+		ioQueueWrite(&batch, txn->data, txn->nBlocks * BLOCK_SIZE, k + (1 + nTags) * BLOCK_SIZE);
+		res = ioSubmit(&batch);
+		free(tags);
+		if(res == 0) res = devSync(0);
+		if(res != 0) return res;
+		journalHead += length;
+		journalSeq++;
+		statsCount(STAT_LOGGED_BLOCKS, length);
+	}
+	//checkpoint: durable at the next commit's first sync
+	ioStart(&batch);
+	for(k = 0 ; k < txn->nBlocks ; k++)
+		ioQueueWrite(&batch, txn->data + k * BLOCK_SIZE, BLOCK_SIZE, txn->targets[k] * BLOCK_SIZE);
+	res = ioSubmit(&batch);
+	statsCount(STAT_CHECKPOINT_BLOCKS, txn->nBlocks);
+	if(nTags == 0 && res == 0) {
+		//replaying older transactions would now undo the in-place writes
+		res = devSync(0);
+		if(res == 0) res = journalWriteHeader(journalSeq, journalHead);
+		if(res == 0) res = devSync(0);
+		if(res == 0) journalResetSeq = commit;
+	}
+	return res;
+}
+
+//Commits the running transaction and every one before it. Concurrent
+//callers share the work: whoever finds no commit in progress writes
+//everything gathered so far, the rest wait for it. Must not be called
+//inside a journalBegin/journalEnd bracket.
+static int journalCommit() {
+	long target;
+	int res = 0;
+
+	if(!journalOn) return 0;
+	pthread_mutex_lock(&journalLock);
+	target = runningSeq;
+	while(committedSeq < target) {
+		struct cs1550_txn *txn;
+		long commit;
+		if(committing != NULL || commitWaiting) {
+			pthread_cond_wait(&journalCond, &journalLock);
+			continue;
+		}
+		//stop new brackets and wait for the open ones to close
+		commitWaiting = 1;
+		while(activeHandles > 0)
+			pthread_cond_wait(&journalCond, &journalLock);
+		pthread_mutex_unlock(&journalLock);
+		bitmapStore();	//logs the bitmap blocks these operations changed
+		dedupStore();
+		pthread_mutex_lock(&journalLock);
+		txn = running;
+		commit = runningSeq++;
+		running = txn == &txns[0] ? &txns[1] : &txns[0];
+		committing = txn;
+		commitWaiting = 0;
+		pthread_cond_broadcast(&journalCond);
+		pthread_mutex_unlock(&journalLock);
+
+		if(txn->nBlocks > 0) res = journalWrite(txn, commit);
+		if(res == 0) freeRelease(commit);
+
+		pthread_mutex_lock(&journalLock);
+		txnClear(txn);
+		committing = NULL;
+		committedSeq = commit;
+		pthread_cond_broadcast(&journalCond);
+	}
+	pthread_mutex_unlock(&journalLock);
+	return res;
+}
+
+static void journalEnd() {
+	int full;
+	if(!journalOn) return;
+	pthread_mutex_lock(&journalLock);
+	activeHandles--;
+	if(activeHandles == 0) pthread_cond_broadcast(&journalCond);
+	//the next commit also logs the table blocks that changed
+	full = running->nBlocks + __atomic_load_n(&dedupDirtyBlocks, __ATOMIC_RELAXED) >= (super.nJournalBlocks - 1) / 4;
+	pthread_mutex_unlock(&journalLock);
+	if(full) journalCommit();
+}
+
+static void *journalCommitLoop(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&journalLock);
+	while(!commitThreadStop) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += options.commitMs / 1000;
+		until.tv_nsec += (long)(options.commitMs % 1000) * 1000000;
+		if(until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&journalCond, &journalLock, &until);
+		if(commitThreadStop) break;
+		pthread_mutex_unlock(&journalLock);
+		journalCommit();
+		pthread_mutex_lock(&journalLock);
+	}
+	pthread_mutex_unlock(&journalLock);
+	return NULL;
+}
+
+//Replays the journal and turns journaling on. Runs at mount before anything
+//reads metadata.
+static int journalOpen() {
+	struct cs1550_journal_header header;
+	struct cs1550_txn_header txn;
+	long pos, seq, capacity, replayed = 0;
+	int wrapped = 0;
+
+	if(super.nJournalBlocks == 0) return 0;
+	if(devRead(&header, BLOCK_SIZE, super.nJournalStart * BLOCK_SIZE) != BLOCK_SIZE) return -EIO;
+	if(header.magic != JOURNAL_MAGIC || header.nTail < 1 || header.nTail > super.nJournalBlocks) return -EINVAL;
+	sumsStale = header.sumsStale;
+	pos = header.nTail;
+	seq = header.nSequence;
+	for(;;) {
+		long nTags, k;
+		long *tags;
+		char *data;
+		int valid;
+
+		valid = pos < super.nJournalBlocks &&
+			devRead(&txn, BLOCK_SIZE, (super.nJournalStart + pos) * BLOCK_SIZE) == BLOCK_SIZE &&
+			txn.magic == TXN_MAGIC && txn.nSequence == seq && txn.nBlocks > 0 &&
+			txn.nTags == (txn.nBlocks + (long)JOURNAL_TAGS_PER_BLOCK - 1) / (long)JOURNAL_TAGS_PER_BLOCK &&
+			pos + 1 + txn.nTags + txn.nBlocks <= super.nJournalBlocks;
+		if(!valid) {
+			//the writer starts over at the top when a transaction does not fit
+			if(wrapped || pos == 1) break;
+			pos = 1;
+			wrapped = 1;
+			continue;
+		}
+		nTags = txn.nTags;
+		tags = malloc(nTags * BLOCK_SIZE);
+		data = malloc(txn.nBlocks * BLOCK_SIZE);
+		valid = tags != NULL && data != NULL &&
+			devRead(tags, nTags * BLOCK_SIZE, (super.nJournalStart + pos + 1) * BLOCK_SIZE) == nTags * BLOCK_SIZE &&
+			devRead(data, txn.nBlocks * BLOCK_SIZE, (super.nJournalStart + pos + 1 + nTags) * BLOCK_SIZE) == txn.nBlocks * BLOCK_SIZE &&
+			txnChecksum(seq, tags, nTags * BLOCK_SIZE, data, txn.nBlocks) == txn.checksum;
+		for(k = 0 ; valid && k < txn.nBlocks ; k++) {
+			//never let a damaged tag write over the superblock or the journal
+			if(tags[k] <= 0 || tags[k] >= super.nBlocks ||
+				(tags[k] >= super.nJournalStart && tags[k] < super.nJournalStart + super.nJournalBlocks)) continue;
+			devWrite(data + k * BLOCK_SIZE, BLOCK_SIZE, tags[k] * BLOCK_SIZE);
+		}
+		free(tags);
+		free(data);
+		if(!valid) break;
+		replayed++;
+		pos += 1 + nTags + txn.nBlocks;
+		seq++;
+		wrapped = 0;
+	}
+	if(replayed > 0) fprintf(stderr, "cs1550: replayed %ld journal transactions\n", replayed);
+	//start the next transaction at the top with a fresh tail
+	if(devSync(0) != 0 || journalWriteHeader(seq, 1) != 0 || devSync(0) != 0) return -EIO;
+	//the most blocks one transaction can log with its header and tags
+	for(capacity = super.nJournalBlocks - 2 ; capacity > 1 &&
+		2 + (capacity + (long)JOURNAL_TAGS_PER_BLOCK - 1) / (long)JOURNAL_TAGS_PER_BLOCK + capacity > super.nJournalBlocks ; capacity--)
+		;
+	if(txnReserve(&txns[0], capacity) != 0 || txnReserve(&txns[1], capacity) != 0) {
+		txnFree(&txns[0]);
+		txnFree(&txns[1]);
+		return -ENOMEM;
+	}
+	journalHead = 1;
+	journalSeq = seq;
+	runningSeq = 1;
+	committedSeq = 0;
+	journalOn = 1;
+	if(options.commitMs > 0) {
+		commitThreadStop = 0;
+		if(pthread_create(&commitThread, NULL, journalCommitLoop, NULL) == 0)
+			commitThreadRunning = 1;
+	}
+	return 0;
+}
+
+//Commits what is left and turns journaling off, for unmount.
+static void journalClose() {
+	if(!journalOn) return;
+	if(commitThreadRunning) {
+		pthread_mutex_lock(&journalLock);
+		commitThreadStop = 1;
+		pthread_cond_broadcast(&journalCond);
+		pthread_mutex_unlock(&journalLock);
+		pthread_join(commitThread, NULL);
+		commitThreadRunning = 0;
+	}
+	journalCommit();
+	//everything is home: leave nothing to replay
+	if(devSync(0) == 0 && journalWriteHeader(journalSeq, journalHead) == 0)
+		devSync(0);
+	journalOn = 0;
+	txnFree(&txns[0]);
+	txnFree(&txns[1]);
+	running = &txns[0];
+}
+
+//Free-space allocator. The bitmap blocks are held in memory as 64-bit words
+//in the on-disk bit order, so the most significant bit of a word is the
+//lowest-numbered block and a count-leading-zeros finds the first free or
+//used block in one step. Changed bitmap blocks are written back only at
+//flush and sync points.
+//
+//The image is split into allocation groups of GROUP_BLOCKS blocks, each
+//with its own free count, search hint and lock. Allocations start in the
+//group they are asked for, so a directory's files stay next to it and
+//allocations for different directories rarely wait on each other.
+#define BITMAP_WORDS_PER_BLOCK (BLOCK_SIZE / sizeof(uint64_t))
+
+struct cs1550_group
+{
+	pthread_mutex_t lock;	//guards this group's bits and the fields below
+	long nFree;
+	long nextFree;	//where the next search in this group starts
+};
+
+static uint64_t *bitmapWords = NULL;
+static uint64_t *bitmapFreed = NULL;	//freed but held back, still set in bitmapWords
+static long bitmapBlocks = 0;	//number of blocks the bitmap describes
+static unsigned char *bitmapDirty = NULL;	//one flag per bitmap block
+static struct cs1550_group *groups = NULL;
+
+static long blockGroup(long block) {
+	return block / super.nGroupBlocks;
+}
+
+static int bitmapLoad() {
+	long nWords = super.nBitmapBlocks * BITMAP_WORDS_PER_BLOCK;
+	long i;
+
+	bitmapBlocks = super.nBlocks;
+	bitmapWords = malloc(nWords * sizeof(uint64_t));
+	bitmapFreed = calloc(nWords, sizeof(uint64_t));
+	bitmapDirty = calloc(super.nBitmapBlocks, 1);
+	groups = calloc(super.nGroups, sizeof(struct cs1550_group));
+	if(bitmapWords == NULL || bitmapFreed == NULL || bitmapDirty == NULL || groups == NULL) return -ENOMEM;
+	if(devRead(bitmapWords, nWords * sizeof(uint64_t), super.nBitmapStart * BLOCK_SIZE) != nWords * (long)sizeof(uint64_t))
+		return -EIO;
+
+	for(i = 0 ; i < nWords ; i++) {
+		bitmapWords[i] = be64toh(bitmapWords[i]);
+	}
+	//bits past the end of the image read as used so nothing hands them out
+	for(i = bitmapBlocks ; i < nWords * 64 && i % 64 != 0 ; i++)
+		bitmapWords[i / 64] |= 1ULL << (63 - i % 64);
+	for(i = (bitmapBlocks + 63) / 64 ; i < nWords ; i++)
+		bitmapWords[i] = ~0ULL;
+
+	for(i = 0 ; i < super.nGroups ; i++) {
+		long lo = i * super.nGroupBlocks / 64;
+		long hi = ((i + 1) * super.nGroupBlocks + 63) / 64;
+		long w;
+		if(hi > nWords) hi = nWords;
+		groups[i].nFree = 0;
+		for(w = lo ; w < hi ; w++)
+			groups[i].nFree += 64 - __builtin_popcountll(bitmapWords[w]);
+		groups[i].nextFree = i * super.nGroupBlocks;
+		pthread_mutex_init(&groups[i].lock, NULL);
+	}
+	return 0;
+}
+
+//Writes every bitmap block that changed since the last call. Blocks held
+//back after a free already go out as free.
+static void bitmapStore() {
+	uint64_t words[BITMAP_WORDS_PER_BLOCK];
+	long b, i;
+
+	if(bitmapDirty == NULL) return;
+	for(i = 0 ; i < super.nGroups ; i++)
+		pthread_mutex_lock(&groups[i].lock);
+	for(b = 0 ; b < super.nBitmapBlocks ; b++) {
+		if(!bitmapDirty[b]) continue;
+		for(i = 0 ; i < (long)BITMAP_WORDS_PER_BLOCK ; i++)
+			words[i] = htobe64(bitmapWords[b * BITMAP_WORDS_PER_BLOCK + i] & ~bitmapFreed[b * BITMAP_WORDS_PER_BLOCK + i]);
+		metaWrite(words, (super.nBitmapStart + b) * BLOCK_SIZE);
+		bitmapDirty[b] = 0;
+	}
+	for(i = super.nGroups - 1 ; i >= 0 ; i--)
+		pthread_mutex_unlock(&groups[i].lock);
+}
+
+static void bitmapFree() {
+	long i;
+	for(i = 0 ; i < super.nGroups && groups != NULL ; i++)
+		pthread_mutex_destroy(&groups[i].lock);
+	free(bitmapWords);
+	free(bitmapFreed);
+	free(bitmapDirty);
+	free(groups);
+	bitmapWords = NULL;
+	bitmapFreed = NULL;
+	bitmapDirty = NULL;
+	groups = NULL;
+	bitmapBlocks = 0;
+}
+
+//First block in [from, to) whose bit equals used, or to.
+static long bitmapScan(long from, long to, int used) {
+	long i = from / 64;
+	uint64_t word;
+
+	if(to > bitmapBlocks) to = bitmapBlocks;
+	if(from >= to) return to;
+	word = used ? bitmapWords[i] : ~bitmapWords[i];
+	word &= ~0ULL >> (from % 64);
+	while(word == 0) {
+		if(++i * 64 >= to) return to;
+		word = used ? bitmapWords[i] : ~bitmapWords[i];
+	}
+	from = i * 64 + __builtin_clzll(word);
+	return from < to ? from : to;
+}
+
+//Marks a run inside one group as used. The caller holds the group's lock.
+static void bitmapMark(long block, long count) {
+	for( ; count > 0 ; block++, count--) {
+		bitmapWords[block / 64] |= 1ULL << (63 - block % 64);
+		//a bitmap block can be shared by several groups
+		__atomic_store_n(&bitmapDirty[block / (BLOCK_SIZE * 8)], 1, __ATOMIC_RELAXED);
+		//emptiestGroup reads the free counts without the locks
+		__atomic_sub_fetch(&groups[blockGroup(block)].nFree, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static long allocScan(long from, long to, long count) {
+	long start = bitmapScan(from, to, 0);
+	statsCount(STAT_ALLOC_SCANS, 1);
+	while(start + count <= to) {
+		long end = bitmapScan(start, start + count, 1);
+		if(end - start >= count) return start;
+		start = bitmapScan(end, to, 0);
+	}
+	return -1;
+}
+
+//Allocates count contiguous blocks, trying group first and then the groups
+//after it, and returns the first block, or -1 when there is no free run that
+//long. A run never crosses a group boundary.
+static long allocBlocks(long count, long group) {
+	long i;
+
+	statsCount(STAT_ALLOCS, 1);
+	if(count <= 0 || count > super.nGroupBlocks) return -1;
+	if(group < 0 || group >= super.nGroups) group = 0;
+	for(i = 0 ; i < super.nGroups ; i++) {
+		long g = (group + i) % super.nGroups;
+		long lo = g * super.nGroupBlocks;
+		long hi = lo + super.nGroupBlocks;
+		long start = -1;
+		if(hi > bitmapBlocks) hi = bitmapBlocks;
+		pthread_mutex_lock(&groups[g].lock);
+		if(groups[g].nFree >= count) {
+			start = allocScan(groups[g].nextFree, hi, count);
+			if(start < 0)
+				start = allocScan(lo, hi, count);
+			if(start >= 0) {
+				bitmapMark(start, count);
+				groups[g].nextFree = start + count;
+			}
+		}
+		pthread_mutex_unlock(&groups[g].lock);
+		if(start >= 0) return start;
+	}
+	statsCount(STAT_ALLOC_FAILURES, 1);
+	return -1;
+}
+
+//Takes up to count free blocks starting exactly at block, without leaving
+//its group, and returns how many it got.
+static long allocAt(long block, long count) {
+	long g = blockGroup(block);
+	long hi = (g + 1) * super.nGroupBlocks;
+	long got;
+
+	statsCount(STAT_ALLOCS, 1);
+	if(block < 0 || block >= bitmapBlocks) return 0;
+	if(block + count > hi) count = hi - block;
+	pthread_mutex_lock(&groups[g].lock);
+	got = bitmapScan(block, block + count, 1) - block;
+	if(got > 0) bitmapMark(block, got);
+	pthread_mutex_unlock(&groups[g].lock);
+	return got;
+}
+
+//The group with the most free blocks, where new directories go.
+static long emptiestGroup() {
+	long best = 0;
+	long i;
+	long bestFree = __atomic_load_n(&groups[0].nFree, __ATOMIC_RELAXED);
+	for(i = 1 ; i < super.nGroups ; i++) {
+		long nFree = __atomic_load_n(&groups[i].nFree, __ATOMIC_RELAXED);
+		if(nFree > bestFree) {
+			best = i;
+			bestFree = nFree;
+		}
+	}
+	return best;
+}
+
+//Deduplication. With -o dedup, a whole block that a write would store is
+//looked up in the dedup table first, and when an indexed block holds the
+//same bytes the file points at that block instead of writing its own. A
+//match is always compared byte for byte, so the fingerprint only needs to
+//be fast. A block others point at too is never written in place: the
+//writer gets a copy. The table and the share counts are loaded at mount,
+//and the blocks of them that change are logged by the next commit, like the
+//bitmap's. Share counts are kept by block number, so copying a file only
+//changes the few blocks of counts that describe its extents.
+//
+//An entry is looked for among the DEDUP_PROBES entries from the one its
+//fingerprint picks; a block that finds them all in use is left out of the
+//table. dedupSlots maps block numbers back to their entries, for frees and
+//in-place writes.
+#define DEDUP_PROBES 16
+
+static pthread_mutex_t dedupLock = PTHREAD_MUTEX_INITIALIZER;	//guards everything below
+static struct cs1550_dedup_entry *dedupTable = NULL;	//NULL when the image has none
+static long dedupEntries = 0;
+static uint16_t *dedupShares = NULL;	//share count of each block
+static unsigned char *dedupDirty = NULL;	//one flag per table block, then one per share count block
+static long *dedupSlots = NULL;	//entry number + 1 of each indexed block, 0 for an empty slot
+static unsigned long dedupMask = 0;
+
+//Bytes queued for location by a writer but not written yet.
+struct cs1550_dedup_run
+{
+	off_t location;
+	size_t size;
+	const char *data;
+};
+
+//Marks block b of the table, or past its end of the share counts, for the
+//next commit.
+static void dedupTouch(long b) {
+	if(dedupDirty[b]) return;
+	dedupDirty[b] = 1;
+	__atomic_add_fetch(&dedupDirtyBlocks, 1, __ATOMIC_RELAXED);
+}
+
+static void dedupShare(long block, int delta) {
+	dedupShares[block] += delta;
+	dedupTouch(super.nDedupBlocks + block / SHARES_PER_BLOCK);
+}
+
+//Position of block in dedupSlots, or of the empty slot where it would go.
+static unsigned long dedupSlot(long block) {
+	unsigned long i = txnHash(block, dedupMask);
+	while(dedupSlots[i] != 0 && dedupTable[dedupSlots[i] - 1].block != block)
+		i = (i + 1) & dedupMask;
+	return i;
+}
+
+//Entry number of an indexed block, or -1.
+static long dedupFindBlock(long block) {
+	return dedupSlots[dedupSlot(block)] - 1;
+}
+
+static void dedupSet(long k, uint64_t hash, long block) {
+	dedupTable[k].hash = hash;
+	dedupTable[k].block = block;
+	dedupSlots[dedupSlot(block)] = k + 1;
+	dedupTouch(k / DEDUP_ENTRIES_PER_BLOCK);
+}
+
+//Empties entry k.
+static void dedupDrop(long k) {
+	unsigned long i = dedupSlot(dedupTable[k].block);
+	unsigned long j = i;
+
+	//pull the slots after the gap back over it when their search passes it
+	for(;;) {
+		unsigned long home;
+		j = (j + 1) & dedupMask;
+		if(dedupSlots[j] == 0) break;
+		home = txnHash(dedupTable[dedupSlots[j] - 1].block, dedupMask);
+		if(((j - home) & dedupMask) >= ((j - i) & dedupMask)) {
+			dedupSlots[i] = dedupSlots[j];
+			i = j;
+		}
+	}
+	dedupSlots[i] = 0;
+	memset(&dedupTable[k], 0, sizeof(struct cs1550_dedup_entry));
+	dedupTouch(k / DEDUP_ENTRIES_PER_BLOCK);
+}
+
+static int dedupLoad() {
+	unsigned long capacity = 64;
+	long k;
+
+	if(super.nDedupBlocks == 0) {
+		if(options.dedup) fprintf(stderr, "cs1550: %s has no dedup table, so -o dedup is off\n", diskPath);
+		return 0;
+	}
+	dedupEntries = super.nDedupBlocks * DEDUP_ENTRIES_PER_BLOCK;
+	while(capacity < 2 * (unsigned long)dedupEntries) capacity *= 2;
+	dedupMask = capacity - 1;
+	dedupTable = malloc(super.nDedupBlocks * BLOCK_SIZE);
+	dedupShares = malloc(super.nShareBlocks * BLOCK_SIZE);
+	dedupDirty = calloc(super.nDedupBlocks + super.nShareBlocks, 1);
+	dedupSlots = calloc(capacity, sizeof(long));
+	if(dedupTable == NULL || dedupShares == NULL || dedupDirty == NULL || dedupSlots == NULL) return -ENOMEM;
+	if(devRead(dedupTable, super.nDedupBlocks * BLOCK_SIZE, super.nDedupStart * BLOCK_SIZE) != super.nDedupBlocks * BLOCK_SIZE ||
+		devRead(dedupShares, super.nShareBlocks * BLOCK_SIZE, super.nShareStart * BLOCK_SIZE) != super.nShareBlocks * BLOCK_SIZE)
+		return -EIO;
+	for(k = 0 ; k < dedupEntries ; k++) {
+		if(dedupTable[k].block != 0) dedupSlots[dedupSlot(dedupTable[k].block)] = k + 1;
+	}
+	return 0;
+}
+
+//Writes every block of the table and the share counts that changed since
+//the last call.
+static void dedupStore() {
+	long b;
+
+	if(dedupTable == NULL) return;
+	pthread_mutex_lock(&dedupLock);
+	for(b = 0 ; b < super.nDedupBlocks + super.nShareBlocks ; b++) {
+		if(!dedupDirty[b]) continue;
+		if(b < super.nDedupBlocks)
+			metaWrite((char *)dedupTable + b * BLOCK_SIZE, (super.nDedupStart + b) * BLOCK_SIZE);
+		else
+			metaWrite((char *)dedupShares + (b - super.nDedupBlocks) * BLOCK_SIZE, (super.nShareStart + b - super.nDedupBlocks) * BLOCK_SIZE);
+		dedupDirty[b] = 0;
+	}
+	__atomic_store_n(&dedupDirtyBlocks, 0, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&dedupLock);
+}
+
+static void dedupFree() {
+	free(dedupTable);
+	free(dedupShares);
+	free(dedupDirty);
+	free(dedupSlots);
+	dedupTable = NULL;
+	dedupShares = NULL;
+	dedupDirty = NULL;
+	dedupSlots = NULL;
+	dedupEntries = 0;
+}
+
+//Fingerprint of a block's bytes, never 0.
+static uint64_t blockHash(const char *data) {
+	uint64_t h = 0x9E3779B97F4A7C15ULL;
+	size_t i;
+
+	for(i = 0 ; i < BLOCK_SIZE ; i += sizeof(uint64_t)) {
+		uint64_t w;
+		memcpy(&w, data + i, sizeof(uint64_t));
+		h = (h ^ w) * 0xFF51AFD7ED558CCDULL;
+		h ^= h >> 32;
+	}
+	return h != 0 ? h : 1;
+}
+
+//A block that holds the same bytes as data: self when it does, or else an
+//indexed block, with a share of it taken for the caller. -1 when there is
+//none. Blocks in run are compared with the bytes queued for them.
+static long dedupFind(uint64_t hash, const char *data, long self, const struct cs1550_dedup_run *run) {
+	cs1550_disk_block bytes;
+	long first = hash % dedupEntries;
+	long probes = dedupEntries < DEDUP_PROBES ? dedupEntries : DEDUP_PROBES;
+	long k = 0;
+
+	while(k < probes) {
+		const char *have = bytes.data;
+		struct cs1550_dedup_entry *e = NULL;
+		long block = 0;
+		off_t location;
+
+		pthread_mutex_lock(&dedupLock);
+		for( ; k < probes && block == 0 ; k++) {
+			e = &dedupTable[(first + k) % dedupEntries];
+			if(e->block != 0 && e->hash == hash) block = e->block;
+		}
+		pthread_mutex_unlock(&dedupLock);
+		if(block == 0) break;
+
+		location = (off_t)block * BLOCK_SIZE;
+		if(location >= run->location && location + BLOCK_SIZE <= run->location + (off_t)run->size)
+			have = run->data + (location - run->location);
+		else if(readFile(bytes.data, location, BLOCK_SIZE) != 0)
+			continue;
+		if(memcmp(have, data, BLOCK_SIZE) != 0) continue;
+		if(block == self) return self;
+
+		//unless it was freed or written since, or its count is full
+		pthread_mutex_lock(&dedupLock);
+		if(e->block == block && e->hash == hash && dedupShares[block] < UINT16_MAX) dedupShare(block, 1);
+		else block = 0;
+		pthread_mutex_unlock(&dedupLock);
+		if(block != 0) return block;
+	}
+	return -1;
+}
+
+//Indexes a block just written whole.
+static void dedupInsert(uint64_t hash, long block) {
+	long first = hash % dedupEntries;
+	long k;
+
+	pthread_mutex_lock(&dedupLock);
+	for(k = 0 ; k < DEDUP_PROBES && k < dedupEntries && dedupFindBlock(block) < 0 ; k++) {
+		if(dedupTable[(first + k) % dedupEntries].block == 0) {
+			dedupSet((first + k) % dedupEntries, hash, block);
+			break;
+		}
+	}
+	pthread_mutex_unlock(&dedupLock);
+}
+
+//Makes a block one of the caller's extents points at ready to be written in
+//place: unless others point at it too, it leaves the table. Returns 0 when
+//they do.
+static int dedupPrivate(long block) {
+	long k;
+	int res = 1;
+
+	if(dedupTable == NULL) return 1;
+	pthread_mutex_lock(&dedupLock);
+	if(dedupShares[block] > 0) res = 0;
+	else if((k = dedupFindBlock(block)) >= 0) dedupDrop(k);
+	pthread_mutex_unlock(&dedupLock);
+	return res;
+}
+
+//Drops the share of an extent that no longer points at block. Returns 1
+//when others still point at it. The caller holds dedupLock.
+static int dedupRelease(long block) {
+	long k;
+
+	if(dedupShares[block] > 0) {
+		dedupShare(block, -1);
+		return 1;
+	}
+	if((k = dedupFindBlock(block)) >= 0) dedupDrop(k);
+	return 0;
+}
+
+//Computes every checksum from the image, a run at a time. Holes in the
+//image file read as zeros, so they are skipped.
+static int sumRebuild() {
+	cs1550_disk_block zero;
+	long run = (1 << 20) / BLOCK_SIZE;
+	char *buf = malloc(run * BLOCK_SIZE);
+	long b, i;
+
+	if(buf == NULL) return -ENOMEM;
+	memset(zero.data, 0, BLOCK_SIZE);
+	for(b = 0 ; b < sumEnd ; b++)
+		sums[b] = sumZero;
+	if(devRead(zero.data, BLOCK_SIZE, sumRoot * BLOCK_SIZE) != BLOCK_SIZE) {
+		free(buf);
+		return -EIO;
+	}
+	sums[sumRoot] = crc32c(zero.data, BLOCK_SIZE);
+	b = sumFirst;
+	while(b < sumEnd) {
+		off_t data = lseek(diskFd, (off_t)b * BLOCK_SIZE, SEEK_DATA);
+		off_t hole;
+		long last;
+
+		if(data < 0 && errno == ENXIO) break;
+		//without SEEK_DATA everything is read
+		hole = data < 0 ? -1 : lseek(diskFd, data, SEEK_HOLE);
+		if(data < 0) data = (off_t)b * BLOCK_SIZE;
+		if(hole < 0) hole = (off_t)sumEnd * BLOCK_SIZE;
+		if(data / BLOCK_SIZE > b) b = data / BLOCK_SIZE;
+		last = (hole + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		if(last > sumEnd) last = sumEnd;
+		while(b < last) {
+			long n = last - b < run ? last - b : run;
+			ssize_t got = devRead(buf, n * BLOCK_SIZE, (off_t)b * BLOCK_SIZE);
+			if(got < 0) {
+				free(buf);
+				return -EIO;
+			}
+			memset(buf + got, 0, n * BLOCK_SIZE - got);
+			for(i = 0 ; i < n ; i++)
+				sums[b + i] = crc32c(buf + i * BLOCK_SIZE, BLOCK_SIZE);
+			b += n;
+		}
+	}
+	free(buf);
+	return 0;
+}
+
+//Loads the checksums at mount, or computes them when the last mount did not
+//store them.
+static int sumLoad() {
+	cs1550_disk_block zero;
+
+	if(super.nSumBlocks == 0) {
+		if(options.checksum) fprintf(stderr, "cs1550: %s has no checksums, so -o checksum is off\n", diskPath);
+		return 0;
+	}
+	sums = calloc(super.nSumBlocks, BLOCK_SIZE);
+	if(sums == NULL) return -ENOMEM;
+	memset(zero.data, 0, BLOCK_SIZE);
+	sumZero = crc32c(zero.data, BLOCK_SIZE);
+	sumRoot = super.nRootBlock;
+	sumFirst = super.nSumStart + super.nSumBlocks;
+	sumEnd = super.nBlocks;
+	if(sumsStale) {
+		fprintf(stderr, "cs1550: computing the block checksums of %s\n", diskPath);
+		return sumRebuild();
+	}
+	if(devRead(sums, super.nSumBlocks * BLOCK_SIZE, super.nSumStart * BLOCK_SIZE) != super.nSumBlocks * BLOCK_SIZE)
+		return -EIO;
+	return 0;
+}
+
+//Writes the checksums back at unmount, after everything else, and then
+//marks them stored in the journal header.
+static void sumStore() {
+	if(sums == NULL) return;
+	if(devSync(0) != 0 ||
+		devWrite(sums, super.nSumBlocks * BLOCK_SIZE, super.nSumStart * BLOCK_SIZE) != super.nSumBlocks * BLOCK_SIZE ||
+		devSync(0) != 0) return;
+	sumsStored = 1;
+	if(journalWriteHeader(journalSeq, journalHead) == 0) devSync(0);
+}
+
+static void sumFree() {
+	free(sums);
+	sums = NULL;
+	sumsStale = 0;
+	sumsStored = 0;
+}
+
+//Freeing. Without the journal a freed run is free at once. With it, the run
+//is marked free in the bitmap the next commit logs, but held back from
+//allocation until reusing it is safe: data blocks until that commit is
+//written, since a crash before then brings back the file that owns them,
+//and blocks that held metadata until the journal has also started over,
+//since replaying an older transaction would write the old metadata over
+//whatever they hold next. A run that is handed out again is dropped from
+//the block cache and punched out of the image file first.
+struct cs1550_free_run
+{
+	long block;
+	long count;
+	long seq;	//the commit that frees it
+	int meta;
+};
+
+static pthread_mutex_t freeLock = PTHREAD_MUTEX_INITIALIZER;	//guards the runs below
+static struct cs1550_free_run *freeRuns = NULL;
+static long nFreeRuns = 0;
+static long freeRunsCapacity = 0;
+//Reads whose reply names pieces of the image file and has not been sent. A
+//run freed meanwhile may be among them, so none is handed out until they
+//are done.
+static int nSplicing = 0;	//changed with atomics
+
+//Sets or clears the held-back bits of a run inside one group. The caller
+//holds the group's lock.
+static void bitmapHold(long block, long count, int hold) {
+	for( ; count > 0 ; block++, count--) {
+		if(hold) bitmapFreed[block / 64] |= 1ULL << (63 - block % 64);
+		else bitmapFreed[block / 64] &= ~(1ULL << (63 - block % 64));
+		__atomic_store_n(&bitmapDirty[block / (BLOCK_SIZE * 8)], 1, __ATOMIC_RELAXED);
+	}
+}
+
+//Makes a run allocatable.
+static void freeRun(long block, long count) {
+	long end = block + count;
+
+	cacheDrop(block, count);
+	devPunch((off_t)block * BLOCK_SIZE, (off_t)count * BLOCK_SIZE);
+	while(block < end) {
+		long g = blockGroup(block);
+		long stop = (g + 1) * super.nGroupBlocks < end ? (g + 1) * super.nGroupBlocks : end;
+		long b;
+		pthread_mutex_lock(&groups[g].lock);
+		bitmapHold(block, stop - block, 0);
+		for(b = block ; b < stop ; b++)
+			bitmapWords[b / 64] &= ~(1ULL << (63 - b % 64));
+		__atomic_add_fetch(&groups[g].nFree, stop - block, __ATOMIC_RELAXED);
+		//fill holes before fresh space, so the image stays compact
+		if(block < groups[g].nextFree) groups[g].nextFree = block;
+		pthread_mutex_unlock(&groups[g].lock);
+		block = stop;
+	}
+}
+
+//Frees a run nothing points at any more; meta says it held metadata.
+static void releaseBlocks(long block, long count, int meta) {
+	long end = block + count;
+	long seq;
+
+	if(count <= 0) return;
+	statsCount(STAT_FREED_BLOCKS, count);
+	if(!journalOn) {
+		freeRun(block, count);
+		return;
+	}
+	while(block < end) {
+		long g = blockGroup(block);
+		long stop = (g + 1) * super.nGroupBlocks < end ? (g + 1) * super.nGroupBlocks : end;
+		pthread_mutex_lock(&groups[g].lock);
+		bitmapHold(block, stop - block, 1);
+		pthread_mutex_unlock(&groups[g].lock);
+		block = stop;
+	}
+	block = end - count;
+	pthread_mutex_lock(&journalLock);
+	seq = runningSeq;
+	pthread_mutex_unlock(&journalLock);
+	pthread_mutex_lock(&freeLock);
+	if(nFreeRuns == freeRunsCapacity) {
+		long capacity = freeRunsCapacity ? freeRunsCapacity * 2 : 64;
+		struct cs1550_free_run *runs = realloc(freeRuns, capacity * sizeof(struct cs1550_free_run));
+		if(runs == NULL) {
+			//out of memory: the run stays in use until the next mount
+			pthread_mutex_unlock(&freeLock);
+			return;
+		}
+		freeRuns = runs;
+		freeRunsCapacity = capacity;
+	}
+	freeRuns[nFreeRuns].block = block;
+	freeRuns[nFreeRuns].count = count;
+	freeRuns[nFreeRuns].seq = seq;
+	freeRuns[nFreeRuns].meta = meta;
+	nFreeRuns++;
+	pthread_mutex_unlock(&freeLock);
+}
+
+//Frees count blocks starting at block; meta says they held metadata. Data
+//blocks that other extents still point at only lose a share.
+static void freeBlocks(long block, long count, int meta) {
+	long end = block + count;
+
+	if(meta || dedupTable == NULL) {
+		releaseBlocks(block, count, meta);
+		return;
+	}
+	while(block < end) {
+		long b;
+		pthread_mutex_lock(&dedupLock);
+		for(b = block ; b < end && !dedupRelease(b) ; b++)
+			;
+		pthread_mutex_unlock(&dedupLock);
+		releaseBlocks(block, b - block, meta);
+		block = b + 1;
+	}
+}
+
+//Hands out the held-back runs that commit, now written, made safe. With
+//commit -1, once the journal is closed, all of them.
+static void freeRelease(long commit) {
+	long i, kept = 0;
+
+	pthread_mutex_lock(&freeLock);
+	if(commit >= 0 && __atomic_load_n(&nSplicing, __ATOMIC_RELAXED) > 0) {
+		pthread_mutex_unlock(&freeLock);
+		return;
+	}
+	for(i = 0 ; i < nFreeRuns ; i++) {
+		struct cs1550_free_run *run = &freeRuns[i];
+		if(commit < 0 || (run->seq <= commit && (!run->meta || journalResetSeq > run->seq)))
+			freeRun(run->block, run->count);
+		else
+			freeRuns[kept++] = *run;
+	}
+	nFreeRuns = kept;
+	if(commit < 0) {
+		free(freeRuns);
+		freeRuns = NULL;
+		freeRunsCapacity = 0;
+	}
+	pthread_mutex_unlock(&freeLock);
+}
+
+//Writes a fresh superblock, an empty root and a bitmap with only the
+//metadata blocks marked onto a blank image.
+static int formatDisk() {
+	cs1550_root_directory root;
+	unsigned char bitmap[BLOCK_SIZE];
+	long nBlocks = diskSize / BLOCK_SIZE;
+	long used;
+	long b;
+
+	memset(&super, 0, sizeof(cs1550_superblock));
+	super.magic = CS1550_MAGIC;
+	super.version = CS1550_VERSION;
+	super.blockSize = BLOCK_SIZE;
+	super.nBlocks = nBlocks;
+	super.nRootBlock = 1;
+	super.nBitmapStart = 2;
+	super.nBitmapBlocks = (nBlocks + BLOCK_SIZE * 8 - 1) / (BLOCK_SIZE * 8);
+	super.nGroupBlocks = GROUP_BLOCKS;
+	super.nGroups = (nBlocks + GROUP_BLOCKS - 1) / GROUP_BLOCKS;
+	super.nJournalStart = super.nBitmapStart + super.nBitmapBlocks;
+	//up to JOURNAL_BYTES, but never more than an eighth of a small image
+	super.nJournalBlocks = JOURNAL_BYTES / BLOCK_SIZE;
+	if(super.nJournalBlocks > nBlocks / 8) super.nJournalBlocks = nBlocks / 8;
+	if(super.nJournalBlocks < 8) super.nJournalBlocks = 0;
+
+	used = super.nJournalStart + super.nJournalBlocks;
+	//room in the dedup table for a quarter of the blocks
+	if(options.dedup) {
+		super.nDedupStart = used;
+		super.nDedupBlocks = (nBlocks / 4 + DEDUP_ENTRIES_PER_BLOCK - 1) / DEDUP_ENTRIES_PER_BLOCK;
+		super.nShareStart = super.nDedupStart + super.nDedupBlocks;
+		super.nShareBlocks = (nBlocks + SHARES_PER_BLOCK - 1) / SHARES_PER_BLOCK;
+		used = super.nShareStart + super.nShareBlocks;
+	}
+	//the first mount computes them, as after a crash
+	if(options.checksum && super.nJournalBlocks > 0) {
+		super.nSumStart = used;
+		super.nSumBlocks = (nBlocks + SUMS_PER_BLOCK - 1) / SUMS_PER_BLOCK;
+		used = super.nSumStart + super.nSumBlocks;
+	}
+	if(nBlocks <= used) return -ENOSPC;
+
+	root.nDirectories = 0;
+	memset(&root.directories, 0, MAX_DIRS_IN_ROOT*sizeof(struct cs1550_directory));
+	memset(root.padding, 0, sizeof(root.padding));
+	writeBlock(&root, 1, super.nRootBlock * BLOCK_SIZE);
+
+	memset(bitmap, 0, BLOCK_SIZE);
+	for(b = 0 ; b < super.nDedupBlocks + super.nShareBlocks ; b++)
+		writeBlock(bitmap, 1, (super.nDedupStart + b) * BLOCK_SIZE);
+	for(b = 0 ; b < super.nBitmapBlocks ; b++) {
+		long first = b * BLOCK_SIZE * 8;
+		long i;
+		memset(bitmap, 0, BLOCK_SIZE);
+		for(i = first ; i < used && i < first + BLOCK_SIZE * 8 ; i++)
+			bitmap[(i - first) / 8] |= 1 << (7 - (i - first) % 8);
+		writeBlock(bitmap, 1, (super.nBitmapStart + b) * BLOCK_SIZE);
+	}
+	if(super.nJournalBlocks > 0 && journalWriteHeader(1, 1) != 0) return -EIO;
+	writeBlock(&super, 1, 0);
+	return 0;
+}
+
+//Reads the superblock, formatting the image first if it has none.
+static int loadSuperblock() {
+	const unsigned char *header = (const unsigned char *)&super;
+	int i;
+
+	if(devRead(&super, BLOCK_SIZE, 0) != BLOCK_SIZE) return -EIO;
+	if(super.magic != CS1550_MAGIC) {
+		//only a blank image is formatted; anything else may hold data
+		for(i = 0 ; i < BLOCK_SIZE && header[i] == 0 ; i++)
+			;
+		if(i < BLOCK_SIZE) {
+			fprintf(stderr, "cs1550: %s is not a cs1550 image\n", diskPath);
+			return -EINVAL;
+		}
+		fprintf(stderr, "cs1550: formatting %s\n", diskPath);
+		return formatDisk();
+	}
+	if(super.version < 1 || super.version > CS1550_VERSION || super.blockSize != BLOCK_SIZE) {
+		fprintf(stderr, "cs1550: %s has format version %u with %u-byte blocks, expected version %u with %d-byte blocks\n",
+			diskPath, super.version, super.blockSize, CS1550_VERSION, BLOCK_SIZE);
+		return -EINVAL;
+	}
+	if(super.nBlocks * BLOCK_SIZE > diskSize || super.nGroupBlocks % 64 != 0) return -EINVAL;
+	if(super.version == 1) super.nJournalBlocks = 0;
+	if(super.version < 6) super.nDedupBlocks = 0;
+	if(super.version < 7) super.nSumBlocks = 0;
+	if(super.nJournalBlocks > 0 && (super.nJournalBlocks < 8 ||
+		super.nJournalStart != super.nBitmapStart + super.nBitmapBlocks ||
+		super.nJournalStart + super.nJournalBlocks > super.nBlocks)) return -EINVAL;
+	if(super.nDedupBlocks > 0 && (super.nDedupStart < super.nBitmapStart + super.nBitmapBlocks + super.nJournalBlocks ||
+		super.nShareStart != super.nDedupStart + super.nDedupBlocks ||
+		super.nShareBlocks < (super.nBlocks + (long)SHARES_PER_BLOCK - 1) / (long)SHARES_PER_BLOCK ||
+		super.nShareStart + super.nShareBlocks > super.nBlocks)) return -EINVAL;
+	if(super.nSumBlocks > 0 && (super.nJournalBlocks == 0 ||
+		super.nSumStart < super.nJournalStart + super.nJournalBlocks + super.nDedupBlocks + super.nShareBlocks ||
+		super.nSumBlocks < (super.nBlocks + (long)SUMS_PER_BLOCK - 1) / (long)SUMS_PER_BLOCK ||
+		super.nSumStart + super.nSumBlocks > super.nBlocks)) return -EINVAL;
+	return 0;
+}
+
+//Metadata cache: the root block and every directory block are loaded once at
+//mount and stay in memory. Changes are made here and written straight
+//through to disk. With -o mmap the cache simply points into the mapping.
+//
+//FUSE runs the handlers on several threads, so the cache is guarded by
+//locks that are always taken in this order: rootLock, then a directory's
+//lock, then a file's lock, then the allocator's group locks. The name
+//index lock is taken last and never held across another lock.
+//
+//rootLock guards the root block, dirCache and dirNodes. A directory's lock
+//is held for reading while its entries are looked up or their data is used,
+//and for writing while entries are added or removed or it grows a block.
+//Each file's lock is held for reading by readers and for writing by the one
+//writer, so readers of different files never wait on each other. Writers of
+//different files in one directory only serialise on blockLock while they
+//write the shared block.
+struct cs1550_file_node
+{
+	pthread_rwlock_t lock;
+	//read-ahead state, updated by concurrent readers with atomics
+	off_t nextRead;	//where a sequential read would continue
+	long readAhead;	//current window in blocks, 0 after a random read
+	//buffered writes not on disk yet, changed under the write lock
+	char *dirty;
+	off_t dirtyStart;
+	size_t dirtyLength;
+	size_t dirtyCapacity;
+	//open handles, and the extents kept loaded while there are any; both
+	//change under the write lock
+	int nOpen;
+	struct cs1550_extent_map *map;
+	int unlinked;	//its name is gone but it is still open; read with atomics
+	unsigned long generation;	//of the file in the slot, set under the directory's write lock
+};
+
+//File nodes come in one array per directory block, so they never move when
+//the directory grows.
+struct cs1550_dir_node
+{
+	pthread_rwlock_t lock;
+	pthread_mutex_t blockLock;	//held while a directory block is written
+	int nChunks;
+	struct cs1550_file_node **files;	//MAX_FILES_IN_DIR per directory block
+};
+
+//The runs in use in one tail block.
+struct cs1550_tail_block
+{
+	long block;
+	int nUsed;	//units
+	uint64_t used[(TAIL_UNITS + 63) / 64];
+};
+
+//A directory's blocks in slot order: file slot s is entry s % MAX_FILES_IN_DIR
+//of block s / MAX_FILES_IN_DIR. Since version 3 the blocks are listed by an
+//extent map, like a file's data. A block's nFiles counts the slots it has
+//ever handed out; the ones freed since have an empty name and are reused
+//before the last block takes more.
+struct cs1550_dir_cache
+{
+	int nFiles;	//slots handed out in all of its blocks
+	int nBlocks;
+	cs1550_directory_entry **blocks;
+	long *locations;	//byte address of each block
+	int *freeSlots;	//emptied slots, taken from the end
+	int nFree;
+	int freeCapacity;
+	struct cs1550_tail_block *tails;	//by block number, under blockLock
+	int nTails;
+	int tailCapacity;
+};
+
+static pthread_rwlock_t rootLock = PTHREAD_RWLOCK_INITIALIZER;
+static cs1550_root_directory rootCache;
+static cs1550_root_directory *rootDir = &rootCache;
+static struct cs1550_dir_cache *dirCache[MAX_DIRS_IN_ROOT];	//same slots as rootDir->directories
+static struct cs1550_dir_node *dirNodes[MAX_DIRS_IN_ROOT];
+//A slot's inode number comes back when the slot is reused, so every file and
+//directory made gets the next generation, for the kernel to tell them apart
+//from what the slot held before. Those found at mount have generation 0.
+static unsigned long inoGeneration = 0;	//taken with atomics
+static unsigned long dirGenerations[MAX_DIRS_IN_ROOT];	//changed under rootLock
+
+static void extentMapFree(struct cs1550_extent_map *map);
+static int extentMapLoad(long location, struct cs1550_extent_map *map);
+
+static struct cs1550_dir_node *newDirNode() {
+	struct cs1550_dir_node *node = malloc(sizeof(struct cs1550_dir_node));
+	if(node == NULL) return NULL;
+	pthread_rwlock_init(&node->lock, NULL);
+	pthread_mutex_init(&node->blockLock, NULL);
+	node->nChunks = 0;
+	node->files = NULL;
+	return node;
+}
+
+//Adds the file nodes for one more directory block.
+static int addFileNodes(struct cs1550_dir_node *node) {
+	struct cs1550_file_node **files = realloc(node->files, (node->nChunks + 1) * sizeof(struct cs1550_file_node *));
+	struct cs1550_file_node *chunk;
+	int i;
+	if(files == NULL) return -ENOMEM;
+	node->files = files;
+	chunk = malloc(MAX_FILES_IN_DIR * sizeof(struct cs1550_file_node));
+	if(chunk == NULL) return -ENOMEM;
+	for(i = 0 ; i < MAX_FILES_IN_DIR ; i++) {
+		pthread_rwlock_init(&chunk[i].lock, NULL);
+		chunk[i].nextRead = 0;
+		chunk[i].readAhead = 0;
+		chunk[i].dirty = NULL;
+		chunk[i].dirtyLength = 0;
+		chunk[i].dirtyCapacity = 0;
+		chunk[i].nOpen = 0;
+		chunk[i].map = NULL;
+		chunk[i].unlinked = 0;
+	}
+	node->files[node->nChunks++] = chunk;
+	return 0;
+}
+
+static void freeDirNode(struct cs1550_dir_node *node) {
+	int c, i;
+	if(node == NULL) return;
+	for(c = 0 ; c < node->nChunks ; c++) {
+		struct cs1550_file_node *chunk = node->files[c];
+		for(i = 0 ; i < MAX_FILES_IN_DIR ; i++) {
+			pthread_rwlock_destroy(&chunk[i].lock);
+			free(chunk[i].dirty);
+			if(chunk[i].map != NULL) extentMapFree(chunk[i].map);
+			free(chunk[i].map);
+		}
+		free(chunk);
+	}
+	free(node->files);
+	pthread_mutex_destroy(&node->blockLock);
+	pthread_rwlock_destroy(&node->lock);
+	free(node);
+}
+
+//Where a metadata block can be edited in place: inside the mapping with
+//-o mmap, unless the journal has to see every change first.
+static void *metaPtr(off_t location) {
+	return super.nJournalBlocks > 0 ? NULL : devPtr(location);
+}
+
+static cs1550_directory_entry *loadDirectory(long location, int fresh) {
+	cs1550_directory_entry *currDir = metaPtr(location);
+	if(currDir == NULL) {
+		currDir = malloc(sizeof(cs1550_directory_entry));
+		if(currDir == NULL) return NULL;
+		if(!fresh && sumRead(currDir, location / BLOCK_SIZE, 1) != BLOCK_SIZE) {
+			free(currDir);
+			return NULL;
+		}
+	}
+	if(fresh) memset(currDir, 0, sizeof(cs1550_directory_entry));
+	return currDir;
+}
+
+static void unloadDirectory(cs1550_directory_entry *currDir) {
+	if(metaPtr(0) == NULL) free(currDir);
+}
+
+static void freeDirCache(struct cs1550_dir_cache *dir) {
+	int k;
+	if(dir == NULL) return;
+	for(k = 0 ; k < dir->nBlocks ; k++)
+		unloadDirectory(dir->blocks[k]);
+	free(dir->blocks);
+	free(dir->locations);
+	free(dir->freeSlots);
+	free(dir->tails);
+	free(dir);
+}
+
+//Remembers an emptied slot for the next file made in the directory.
+static int pushFreeSlot(struct cs1550_dir_cache *dir, int fileSlot) {
+	if(dir->nFree == dir->freeCapacity) {
+		int capacity = dir->freeCapacity ? dir->freeCapacity * 2 : 16;
+		int *slots = realloc(dir->freeSlots, capacity * sizeof(int));
+		if(slots == NULL) return -ENOMEM;
+		dir->freeSlots = slots;
+		dir->freeCapacity = capacity;
+	}
+	dir->freeSlots[dir->nFree++] = fileSlot;
+	return 0;
+}
+
+//Units a small file of size bytes takes in a tail block.
+static long tailUnits(size_t size) {
+	return (size + TAIL_UNIT - 1) / TAIL_UNIT;
+}
+
+//Index of the tail block in the directory's list, or where it would go.
+static int tailFind(struct cs1550_dir_cache *dir, long block) {
+	int lo = 0, hi = dir->nTails;
+	while(lo < hi) {
+		int mid = (lo + hi) / 2;
+		if(dir->tails[mid].block < block) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo;
+}
+
+//Marks count units from first of a tail block used or free.
+static void tailMark(struct cs1550_tail_block *tail, long first, long count, int used) {
+	long u;
+	for(u = first ; u < first + count ; u++) {
+		if(used) tail->used[u / 64] |= 1ULL << (u % 64);
+		else tail->used[u / 64] &= ~(1ULL << (u % 64));
+	}
+	tail->nUsed += used ? count : -count;
+}
+
+//The directory's entry for a tail block, added empty if it has none.
+static struct cs1550_tail_block *tailAdd(struct cs1550_dir_cache *dir, long block) {
+	int i = tailFind(dir, block);
+	if(i < dir->nTails && dir->tails[i].block == block) return &dir->tails[i];
+	if(dir->nTails == dir->tailCapacity) {
+		int capacity = dir->tailCapacity ? dir->tailCapacity * 2 : 8;
+		struct cs1550_tail_block *tails = realloc(dir->tails, capacity * sizeof(struct cs1550_tail_block));
+		if(tails == NULL) return NULL;
+		dir->tails = tails;
+		dir->tailCapacity = capacity;
+	}
+	memmove(&dir->tails[i + 1], &dir->tails[i], (dir->nTails - i) * sizeof(struct cs1550_tail_block));
+	memset(&dir->tails[i], 0, sizeof(struct cs1550_tail_block));
+	dir->tails[i].block = block;
+	dir->nTails++;
+	return &dir->tails[i];
+}
+
+//Appends the directory block at location, and file nodes for its slots, to
+//a directory in memory. fresh: the block is new, so it starts out empty.
+static int addDirBlock(struct cs1550_dir_cache *dir, struct cs1550_dir_node *node, long location, int fresh) {
+	cs1550_directory_entry **blocks = realloc(dir->blocks, (dir->nBlocks + 1) * sizeof(cs1550_directory_entry *));
+	long *locations;
+	if(blocks == NULL) return -ENOMEM;
+	dir->blocks = blocks;
+	locations = realloc(dir->locations, (dir->nBlocks + 1) * sizeof(long));
+	if(locations == NULL) return -ENOMEM;
+	dir->locations = locations;
+	if(node->nChunks == dir->nBlocks && addFileNodes(node) != 0) return -ENOMEM;
+	dir->blocks[dir->nBlocks] = loadDirectory(location, fresh);
+	if(dir->blocks[dir->nBlocks] == NULL) return fresh ? -ENOMEM : -EIO;
+	dir->locations[dir->nBlocks] = location;
+	dir->nFiles += dir->blocks[dir->nBlocks]->nFiles;
+	dir->nBlocks++;
+	return 0;
+}
+
+//Loads the blocks of the directory in root slot i.
+static int loadDir(int i) {
+	long location = rootDir->directories[i].nStartBlock;
+	int res = 0;
+	int j;
+
+	dirCache[i] = calloc(1, sizeof(struct cs1550_dir_cache));
+	dirNodes[i] = newDirNode();
+	if(dirCache[i] == NULL || dirNodes[i] == NULL) return -ENOMEM;
+	if(super.version >= 3) {
+		struct cs1550_extent_map map;
+		int e;
+		long b;
+		res = extentMapLoad(location, &map);
+		for(e = 0 ; res == 0 && e < map.nExtents ; e++) {
+			for(b = 0 ; res == 0 && b < map.extents[e].nBlocks ; b++)
+				res = addDirBlock(dirCache[i], dirNodes[i], (map.extents[e].nStartBlock + b) * BLOCK_SIZE, 0);
+		}
+		extentMapFree(&map);
+	} else {
+		res = addDirBlock(dirCache[i], dirNodes[i], location, 0);
+	}
+	//slots of files removed before; the ones that still hold blocks belong
+	//to files that were open at the time, and reclaimOrphans frees them
+	for(j = dirCache[i]->nFiles - 1 ; res == 0 && j >= 0 ; j--) {
+		struct cs1550_file_directory *file = &dirCache[i]->blocks[j / MAX_FILES_IN_DIR]->files[j % MAX_FILES_IN_DIR];
+		if(file->fname[0] == '\0' && file->nStartBlock == 0)
+			res = pushFreeSlot(dirCache[i], j);
+		if(file->nStartBlock < 0) {
+			//the runs its small files use
+			struct cs1550_tail_block *tail = tailAdd(dirCache[i], -file->nStartBlock / BLOCK_SIZE);
+			if(tail == NULL) res = -ENOMEM;
+			else tailMark(tail, -file->nStartBlock % BLOCK_SIZE / TAIL_UNIT, tailUnits(file->fsize), 1);
+		}
+	}
+	return res;
+}
+
+//Reads in the root and all directories.
+static int loadMetadata() {
+	int i;
+	int res;
+
+	rootDir = metaPtr(super.nRootBlock * BLOCK_SIZE);
+	if(rootDir == NULL) {
+		rootDir = &rootCache;
+		memset(rootDir, 0, sizeof(cs1550_root_directory));
+		if(sumRead(rootDir, super.nRootBlock, 1) != BLOCK_SIZE) return -EIO;
+	}
+	for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
+		dirCache[i] = NULL;
+		if(strcmp(rootDir->directories[i].dname, "") == 0) continue;
+		if((res = loadDir(i)) != 0) return res;
+	}
+	return 0;
+}
+
+static void unloadMetadata() {
+	int i;
+	for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
+		freeDirCache(dirCache[i]);
+		dirCache[i] = NULL;
+		freeDirNode(dirNodes[i]);
+		dirNodes[i] = NULL;
+	}
+	rootDir = &rootCache;
+}
+
+static struct cs1550_root_directory *readDisk() {
+	return rootDir;
+}
+
+//Entry and node of a file slot. The caller holds the directory's lock.
+static struct cs1550_file_directory *dirFile(int dirSlot, int fileSlot) {
+	return &dirCache[dirSlot]->blocks[fileSlot / MAX_FILES_IN_DIR]->files[fileSlot % MAX_FILES_IN_DIR];
+}
+
+static struct cs1550_file_node *fileNode(int dirSlot, int fileSlot) {
+	return &dirNodes[dirSlot]->files[fileSlot / MAX_FILES_IN_DIR][fileSlot % MAX_FILES_IN_DIR];
+}
+
+//How many slots of the directory hold files.
+static int dirFiles(int dirSlot) {
+	return dirCache[dirSlot]->nFiles;
+}
+
+static void writeRoot() {
+	metaWrite(rootDir, super.nRootBlock * BLOCK_SIZE);
+}
+
+//Writes the directory block that holds fileSlot.
+static void writeDirectory(int dirSlot, int fileSlot) {
+	struct cs1550_dir_cache *dir = dirCache[dirSlot];
+	metaWrite(dir->blocks[fileSlot / MAX_FILES_IN_DIR], dir->locations[fileSlot / MAX_FILES_IN_DIR]);
+}
+
+//Name index: one open-addressed hash table that maps a directory name to its
+//root slot and (directory slot, filename, extension) to a file slot. Entries
+//only hold slots; names are compared against the metadata cache, so a lookup
+//needs the lock that guards the names it can match: rootLock for a
+//directory, the directory's lock for a file. It is built at mount and
+//updated whenever an entry is created or removed.
+#define INDEX_EMPTY 0
+#define INDEX_LIVE 1
+#define INDEX_DELETED 2
+
+struct cs1550_index_slot
+{
+	unsigned int hash;
+	unsigned char state;
+	int dirSlot;
+	int fileSlot;	//-1 for a directory
+};
+
+static pthread_rwlock_t indexLock = PTHREAD_RWLOCK_INITIALIZER;
+static struct cs1550_index_slot *nameIndex = NULL;
+static unsigned int indexCapacity = 0;	//always a power of two
+static unsigned int indexUsed = 0;	//live plus deleted slots
+static unsigned int indexLive = 0;
+
+//FNV-1a over the directory slot (-1 for root entries), name and extension
+static unsigned int hashName(int dirSlot, const char *name, const char *extension) {
+	unsigned int h = 2166136261u;
+	int k;
+	for(k = 0 ; k < (int)sizeof(int) ; k++) {
+		h ^= (unsigned char)(dirSlot >> (8 * k));
+		h *= 16777619u;
+	}
+	for( ; *name ; name++) {
+		h ^= (unsigned char)*name;
+		h *= 16777619u;
+	}
+	h ^= '.';
+	h *= 16777619u;
+	for( ; *extension ; extension++) {
+		h ^= (unsigned char)*extension;
+		h *= 16777619u;
+	}
+	return h;
+}
+
+static int indexMatches(const struct cs1550_index_slot *slot, int dirSlot, const char *name, const char *extension) {
+	if(slot->fileSlot < 0) {
+		return dirSlot < 0 && strcmp(rootDir->directories[slot->dirSlot].dname, name) == 0;
+	} else {
+		struct cs1550_file_directory *file;
+		//only touch names in the directory the caller has locked
+		if(slot->dirSlot != dirSlot) return 0;
+		file = dirFile(slot->dirSlot, slot->fileSlot);
+		return strcmp(file->fname, name) == 0 && strcmp(file->fext, extension) == 0;
+	}
+}
+
+//Returns the live table slot for the key, or -1.
+static int indexLookup(int dirSlot, const char *name, const char *extension) {
+	unsigned int h, i;
+	if(indexCapacity == 0) return -1;
+	h = hashName(dirSlot, name, extension);
+	for(i = h & (indexCapacity - 1) ; nameIndex[i].state != INDEX_EMPTY ; i = (i + 1) & (indexCapacity - 1)) {
+		if(nameIndex[i].state == INDEX_LIVE && nameIndex[i].hash == h && indexMatches(&nameIndex[i], dirSlot, name, extension))
+			return i;
+	}
+	return -1;
+}
+
+static void indexPut(unsigned int h, int dirSlot, int fileSlot) {
+	unsigned int i = h & (indexCapacity - 1);
+	while(nameIndex[i].state == INDEX_LIVE)
+		i = (i + 1) & (indexCapacity - 1);
+	if(nameIndex[i].state == INDEX_EMPTY) indexUsed++;
+	indexLive++;
+	nameIndex[i].hash = h;
+	nameIndex[i].state = INDEX_LIVE;
+	nameIndex[i].dirSlot = dirSlot;
+	nameIndex[i].fileSlot = fileSlot;
+}
+
+//Rehashes into a table of newCapacity slots, dropping deleted markers.
+static int indexResize(unsigned int newCapacity) {
+	struct cs1550_index_slot *old = nameIndex;
+	unsigned int oldCapacity = indexCapacity;
+	unsigned int i;
+
+	nameIndex = calloc(newCapacity, sizeof(struct cs1550_index_slot));
+	if(nameIndex == NULL) {
+		nameIndex = old;
+		return -ENOMEM;
+	}
+	indexCapacity = newCapacity;
+	indexUsed = 0;
+	indexLive = 0;
+	for(i = 0 ; i < oldCapacity ; i++) {
+		if(old[i].state == INDEX_LIVE)
+			indexPut(old[i].hash, old[i].dirSlot, old[i].fileSlot);
+	}
+	free(old);
+	return 0;
+}
+
+//Adds a directory (fileSlot -1) or a file that is already in the cache.
+static int indexInsert(int dirSlot, int fileSlot) {
+	unsigned int h;
+	if(fileSlot < 0) {
+		h = hashName(-1, rootDir->directories[dirSlot].dname, "");
+	} else {
+		struct cs1550_file_directory *file = dirFile(dirSlot, fileSlot);
+		h = hashName(dirSlot, file->fname, file->fext);
+	}
+	pthread_rwlock_wrlock(&indexLock);
+	if((indexUsed + 1) * 4 > indexCapacity * 3) {
+		//when it is mostly deleted markers, sweeping them out is enough
+		int res = indexResize(indexLive * 2 < indexCapacity ? indexCapacity : indexCapacity ? indexCapacity * 2 : 64);
+		if(res != 0) {
+			pthread_rwlock_unlock(&indexLock);
+			return res;
+		}
+	}
+	indexPut(h, dirSlot, fileSlot);
+	pthread_rwlock_unlock(&indexLock);
+	return 0;
+}
+
+//Removes a directory (fileSlot -1) or a file while its name is still in the
+//cache.
+static void indexRemove(int dirSlot, int fileSlot) {
+	int i;
+	pthread_rwlock_wrlock(&indexLock);
+	if(fileSlot < 0) {
+		i = indexLookup(-1, rootDir->directories[dirSlot].dname, "");
+	} else {
+		struct cs1550_file_directory *file = dirFile(dirSlot, fileSlot);
+		i = indexLookup(dirSlot, file->fname, file->fext);
+	}
+	if(i >= 0) {
+		nameIndex[i].state = INDEX_DELETED;
+		indexLive--;
+	}
+	pthread_rwlock_unlock(&indexLock);
+}
+
+static int indexBuild() {
+	int i, j;
+	int res;
+	for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
+		if(dirCache[i] == NULL) continue;
+		if((res = indexInsert(i, -1)) != 0) return res;
+		for(j = 0 ; j < dirFiles(i) ; j++) {
+			if(dirFile(i, j)->fname[0] == '\0') continue;
+			if((res = indexInsert(i, j)) != 0) return res;
+		}
+	}
+	return 0;
+}
+
+static void indexFree() {
+	free(nameIndex);
+	nameIndex = NULL;
+	indexCapacity = 0;
+	indexUsed = 0;
+	indexLive = 0;
+}
+
+//Root slot of the named directory, or -1. The caller holds rootLock.
+static int findDir(const char *directory) {
+	int i, res;
+	if(strlen(directory) == 0) return -1;
+	pthread_rwlock_rdlock(&indexLock);
+	i = indexLookup(-1, directory, "");
+	res = i < 0 ? -1 : nameIndex[i].dirSlot;
+	pthread_rwlock_unlock(&indexLock);
+	return res;
+}
+
+//Slot of filename.extension inside directory dirSlot, or -1. The caller
+//holds the directory's lock.
+static int findFile(int dirSlot, const char *filename, const char *extension) {
+	int i, res;
+	if(strlen(filename) == 0) return -1;
+	pthread_rwlock_rdlock(&indexLock);
+	i = indexLookup(dirSlot, filename, extension);
+	res = i < 0 ? -1 : nameIndex[i].fileSlot;
+	pthread_rwlock_unlock(&indexLock);
+	return res;
+}
+
+//Finds a directory and returns its slot with its lock held for reading
+//(write set: for writing), or -1. A locked directory cannot go away, so
+//rootLock is dropped before returning.
+static int lockDir(const char *directory, int write) {
+	int dirSlot;
+	pthread_rwlock_rdlock(&rootLock);
+	dirSlot = findDir(directory);
+	if(dirSlot >= 0) {
+		if(write) pthread_rwlock_wrlock(&dirNodes[dirSlot]->lock);
+		else pthread_rwlock_rdlock(&dirNodes[dirSlot]->lock);
+	}
+	pthread_rwlock_unlock(&rootLock);
+	return dirSlot;
+}
+
+//Same as lockDir for a directory already known by its slot. Returns -1 if
+//the slot holds no directory.
+static int lockDirSlot(int dirSlot, int write) {
+	int res = -1;
+	if(dirSlot < 0 || dirSlot >= MAX_DIRS_IN_ROOT) return -1;
+	pthread_rwlock_rdlock(&rootLock);
+	if(dirNodes[dirSlot] != NULL) {
+		if(write) pthread_rwlock_wrlock(&dirNodes[dirSlot]->lock);
+		else pthread_rwlock_rdlock(&dirNodes[dirSlot]->lock);
+		res = dirSlot;
+	}
+	pthread_rwlock_unlock(&rootLock);
+	return res;
+}
+
+static void unlockDir(int dirSlot) {
+	pthread_rwlock_unlock(&dirNodes[dirSlot]->lock);
+}
+
+//Compression. The codec is a small LZ77 in the spirit of LZ4: a sequence is
+//a token byte, literals and then a match copied from up to 64 KiB back. The
+//token's high nibble counts the literals and its low one the match length
+//past LZ_MIN_MATCH; 15 means bytes follow that add to it, up to one below
+//255. The last sequence has literals only.
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+
+//Appends the bytes that carry a length of 15 or more. Returns NULL when out
+//runs into end.
+static unsigned char *lzPutLength(unsigned char *out, const unsigned char *end, size_t n) {
+	for( ; n >= 255 ; n -= 255) {
+		if(out == end) return NULL;
+		*out++ = 255;
+	}
+	if(out == end) return NULL;
+	*out++ = n;
+	return out;
+}
+
+//Appends a sequence: nLiterals bytes at literals, then a match of length
+//bytes offset back, or none when length is 0.
+static unsigned char *lzPutSequence(unsigned char *out, const unsigned char *end, const unsigned char *literals,
+	size_t nLiterals, size_t offset, size_t length) {
+	unsigned char *token = out;
+
+	if(out == end) return NULL;
+	out++;
+	*token = (nLiterals < 15 ? nLiterals : 15) << 4;
+	if(nLiterals >= 15 && (out = lzPutLength(out, end, nLiterals - 15)) == NULL) return NULL;
+	if((size_t)(end - out) < nLiterals) return NULL;
+	memcpy(out, literals, nLiterals);
+	out += nLiterals;
+	if(length == 0) return out;
+	length -= LZ_MIN_MATCH;
+	*token |= length < 15 ? length : 15;
+	if(end - out < 2) return NULL;
+	*out++ = offset & 0xff;
+	*out++ = offset >> 8;
+	if(length >= 15) out = lzPutLength(out, end, length - 15);
+	return out;
+}
+
+//Compresses size bytes of src into dst. Returns the compressed length, or 0
+//when it does not fit in capacity.
+static size_t lzCompress(const char *src, size_t size, char *dst, size_t capacity) {
+	const unsigned char *in = (const unsigned char *)src;
+	unsigned char *out = (unsigned char *)dst;
+	const unsigned char *end = out + capacity;
+	uint32_t table[1 << LZ_HASH_BITS];	//last position of each hashed 4 bytes
+	size_t anchor = 0, pos = 0;
+
+	memset(table, 0, sizeof(table));
+	while(pos + LZ_MIN_MATCH <= size) {
+		uint32_t word, h;
+		size_t candidate, length;
+
+		memcpy(&word, in + pos, sizeof(word));
+		h = word * 2654435761U >> (32 - LZ_HASH_BITS);
+		candidate = table[h];
+		table[h] = pos;
+		if(candidate >= pos || pos - candidate > LZ_MAX_OFFSET || memcmp(in + candidate, in + pos, LZ_MIN_MATCH) != 0) {
+			//step faster through data that keeps not matching
+			pos += 1 + ((pos - anchor) >> 6);
+			continue;
+		}
+		//compare eight bytes at a time, then find the first that differs
+		for(length = LZ_MIN_MATCH ; pos + length + 8 <= size ; length += 8) {
+			uint64_t x, y;
+			memcpy(&x, in + candidate + length, 8);
+			memcpy(&y, in + pos + length, 8);
+			if(x != y) break;
+		}
+		for( ; pos + length < size && in[candidate + length] == in[pos + length] ; length++)
+			;
+		out = lzPutSequence(out, end, in + anchor, pos - anchor, pos - candidate, length);
+		if(out == NULL) return 0;
+		pos += length;
+		anchor = pos;
+	}
+	if(anchor < size && (out = lzPutSequence(out, end, in + anchor, size - anchor, 0, 0)) == NULL) return 0;
+	return out - (unsigned char *)dst;
+}
+
+//Reads the bytes that carry a length of 15 or more and adds them to n.
+static int lzGetLength(const unsigned char **in, const unsigned char *end, size_t *n) {
+	unsigned char b;
+	do {
+		if(*in == end) return -1;
+		b = *(*in)++;
+		*n += b;
+	} while(b == 255);
+	return 0;
+}
+
+//Copies n bytes eight at a time, writing up to seven past them. Faster than
+//memcpy for the short runs sequences have, and right for a match that
+//overlaps its source as long as that is at least eight bytes back.
+static void lzCopy(unsigned char *out, const unsigned char *from, size_t n) {
+	unsigned char *stop = out + n;
+	do {
+		memcpy(out, from, 8);
+		out += 8;
+		from += 8;
+	} while(out < stop);
+}
+
+//Decompresses size bytes of src into dst. Returns the decompressed length,
+//or -1 when src is not valid or does not fit in capacity.
+static long lzDecompress(const char *src, size_t size, char *dst, size_t capacity) {
+	const unsigned char *in = (const unsigned char *)src;
+	const unsigned char *inEnd = in + size;
+	unsigned char *out = (unsigned char *)dst;
+	unsigned char *outEnd = out + capacity;
+
+	while(in < inEnd) {
+		unsigned int token = *in++;
+		size_t n = token >> 4;
+		size_t offset;
+
+		if(n == 15 && lzGetLength(&in, inEnd, &n) != 0) return -1;
+		if((size_t)(inEnd - in) < n || (size_t)(outEnd - out) < n) return -1;
+		if((size_t)(inEnd - in) >= n + 8 && (size_t)(outEnd - out) >= n + 8)
+			lzCopy(out, in, n);
+		else
+			memcpy(out, in, n);
+		in += n;
+		out += n;
+		if(in == inEnd) break;
+		if(inEnd - in < 2) return -1;
+		offset = in[0] | in[1] << 8;
+		in += 2;
+		n = token & 15;
+		if(n == 15 && lzGetLength(&in, inEnd, &n) != 0) return -1;
+		n += LZ_MIN_MATCH;
+		if(offset == 0 || offset > (size_t)(out - (unsigned char *)dst) || (size_t)(outEnd - out) < n) return -1;
+		if(offset >= 8 && (size_t)(outEnd - out) >= n + 8) {
+			lzCopy(out, out - offset, n);
+			out += n;
+		} else if(offset >= n) {
+			memcpy(out, out - offset, n);
+			out += n;
+		} else {
+			//the match overlaps the bytes it produces
+			for( ; n > 0 ; n--, out++)
+				*out = out[-offset];
+		}
+	}
+	return out - (unsigned char *)dst;
+}
+
+//Decompressed blocks are cached under their own keys, well above any block
+//number: the chunk stored at block b has CHUNK_BLOCKS of them from
+//chunkKey(b). They are dropped when the chunk's blocks are freed.
+#define CHUNK_KEYS (1L << 56)
+
+static long chunkKey(long block) {
+	return CHUNK_KEYS + block * CHUNK_BLOCKS;
+}
+
+//Blocks a compressed extent takes on disk.
+static long packedBlocks(const struct cs1550_extent *e) {
+	return (-e->nBlocks + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+//Blocks of the file an extent stands for.
+static long extentLength(const struct cs1550_extent *e) {
+	return e->nBlocks < 0 ? CHUNK_BLOCKS : e->nBlocks;
+}
+
+//Blocks an extent takes on disk.
+static long extentBlocks(const struct cs1550_extent *e) {
+	return e->nBlocks < 0 ? packedBlocks(e) : e->nBlocks;
+}
+
+//Decompresses the chunk of compressed extent e into chunk, CHUNK_BYTES long.
+static int chunkLoad(const struct cs1550_extent *e, char *chunk) {
+	long length = -e->nBlocks;
+	char *packed = malloc(length);
+	long got;
+
+	if(packed == NULL) return -ENOMEM;
+	got = readFile(packed, e->nStartBlock * BLOCK_SIZE, length);
+	if(got == 0) got = lzDecompress(packed, length, chunk, CHUNK_BYTES);
+	free(packed);
+	if(got < 0) return -EIO;
+	memset(chunk + got, 0, CHUNK_BYTES - got);
+	statsCount(STAT_CHUNK_LOADS, 1);
+	return 0;
+}
+
+//Copies size bytes at within from the chunk of compressed extent e. Blocks
+//the cache holds decompressed are copied from there; a miss decompresses the
+//whole chunk and caches all of its blocks, the ones not asked for as if read
+//ahead.
+static int chunkRead(const struct cs1550_extent *e, char *buf, size_t within, size_t size) {
+	long key = chunkKey(e->nStartBlock);
+	size_t done = 0;
+	char *chunk;
+	long k;
+	int res;
+
+	while(cacheShards != NULL && done < size) {
+		size_t piece = cachePiece(within + done, within + size);
+		if(!cacheLookup(key + (within + done) / BLOCK_SIZE, buf + done, (within + done) % BLOCK_SIZE, piece)) break;
+		done += piece;
+	}
+	if(done == size) return 0;
+	chunk = malloc(CHUNK_BYTES);
+	if(chunk == NULL) return -ENOMEM;
+	res = chunkLoad(e, chunk);
+	if(res == 0) {
+		memcpy(buf + done, chunk + within + done, size - done);
+		for(k = 0 ; cacheShards != NULL && k < CHUNK_BLOCKS ; k++) {
+			int wanted = k >= (long)(within + done) / BLOCK_SIZE && k <= (long)(within + size - 1) / BLOCK_SIZE;
+			cacheInsert(key + k, chunk + k * BLOCK_SIZE, !wanted);
+		}
+	}
+	free(chunk);
+	return res;
+}
+
+//File data. A file's nStartBlock is the byte address of its first extent
+//block, or 0 while it has no data. Its extents are loaded into an
+//in-memory map for each operation. Growing a file takes the free blocks right
+//after its last extent when there are any, and a new extent otherwise, so
+//data that is already written never moves. Compressed chunks are the
+//exception: each write stores them afresh.
+
+static void extentMapFree(struct cs1550_extent_map *map) {
+	free(map->extents);
+	free(map->chain);
+	memset(map, 0, sizeof(struct cs1550_extent_map));
+}
+
+//Adds a run to the end of the map, merging it with the last extent when the
+//two are contiguous on disk. A compressed extent (count < 0) stands alone.
+static int extentMapAppend(struct cs1550_extent_map *map, long start, long count) {
+	if(map->nExtents > 0 && count > 0) {
+		struct cs1550_extent *last = &map->extents[map->nExtents - 1];
+		if(last->nBlocks > 0 && last->nStartBlock + last->nBlocks == start) {
+			last->nBlocks += count;
+			return 0;
+		}
+	}
+	if(map->nExtents == map->capacity) {
+		int capacity = map->capacity ? map->capacity * 2 : 8;
+		struct cs1550_extent *extents = realloc(map->extents, capacity * sizeof(struct cs1550_extent));
+		if(extents == NULL) return -ENOMEM;
+		map->extents = extents;
+		map->capacity = capacity;
+	}
+	map->extents[map->nExtents].nStartBlock = start;
+	map->extents[map->nExtents].nBlocks = count;
+	map->nExtents++;
+	return 0;
+}
+
+static int extentMapAddChain(struct cs1550_extent_map *map, long block) {
+	if(map->nChain == map->chainCapacity) {
+		int capacity = map->chainCapacity ? map->chainCapacity * 2 : 4;
+		long *chain = realloc(map->chain, capacity * sizeof(long));
+		if(chain == NULL) return -ENOMEM;
+		map->chain = chain;
+		map->chainCapacity = capacity;
+	}
+	map->chain[map->nChain++] = block;
+	return 0;
+}
+
+static int extentMapLoad(long location, struct cs1550_extent_map *map) {
+	cs1550_extent_block block;
+	int k;
+
+	memset(map, 0, sizeof(struct cs1550_extent_map));
+	while(location != 0) {
+		if(!journalRead(&block, location) && cacheRead(&block, BLOCK_SIZE, location) != BLOCK_SIZE) return -EIO;
+		if(extentMapAddChain(map, location / BLOCK_SIZE) != 0) return -ENOMEM;
+		for(k = 0 ; k < block.nExtents && k < (int)MAX_EXTENTS_IN_BLOCK ; k++) {
+			if(extentMapAppend(map, block.extents[k].nStartBlock, block.extents[k].nBlocks) != 0)
+				return -ENOMEM;
+		}
+		location = block.nNextBlock * BLOCK_SIZE;
+	}
+	return 0;
+}
+
+//Writes the map back to its extent blocks, allocating more of them in group
+//when it has outgrown the chain, and returns the address of the first one.
+static long extentMapStore(struct cs1550_extent_map *map, long group) {
+	int needed = (map->nExtents + MAX_EXTENTS_IN_BLOCK - 1) / MAX_EXTENTS_IN_BLOCK;
+	int i, k;
+
+	while(map->nChain < needed) {
+		long block = allocBlocks(1, group);
+		if(block == -1) return -ENOSPC;
+		if(extentMapAddChain(map, block) != 0) return -ENOMEM;
+	}
+	for(i = 0 ; i < map->nChain ; i++) {
+		cs1550_extent_block block;
+		memset(&block, 0, sizeof(cs1550_extent_block));
+		block.nNextBlock = i + 1 < map->nChain ? map->chain[i + 1] : 0;
+		for(k = 0 ; k < (int)MAX_EXTENTS_IN_BLOCK && i * (int)MAX_EXTENTS_IN_BLOCK + k < map->nExtents ; k++)
+			block.extents[k] = map->extents[i * MAX_EXTENTS_IN_BLOCK + k];
+		block.nExtents = k;
+		metaWrite(&block, map->chain[i] * BLOCK_SIZE);
+		cacheUpdate(map->chain[i], (const char *)&block, 0, BLOCK_SIZE);
+	}
+	return map->nChain > 0 ? map->chain[0] * BLOCK_SIZE : 0;
+}
+
+static long extentMapBlocks(const struct cs1550_extent_map *map) {
+	long total = 0;
+	int i;
+	for(i = 0 ; i < map->nExtents ; i++)
+		total += extentLength(&map->extents[i]);
+	return total;
+}
+
+//Adds count blocks to the end of the file, preferring group for new extents.
+static int extentMapGrow(struct cs1550_extent_map *map, long count, long group) {
+	while(count > 0) {
+		long start = -1;
+		long got = 0;
+		if(map->nExtents > 0) {
+			struct cs1550_extent *last = &map->extents[map->nExtents - 1];
+			long next = last->nStartBlock + extentBlocks(last);
+			got = allocAt(next, count);
+			if(got > 0) start = next;
+		}
+		if(start < 0) {
+			//otherwise take the longest free run we can get, down to one block
+			for(got = count ; got > 0 ; got /= 2) {
+				start = allocBlocks(got, group);
+				if(start >= 0) break;
+			}
+			if(start < 0) return -ENOSPC;
+		}
+		if(extentMapAppend(map, start, got) != 0) return -ENOMEM;
+		count -= got;
+	}
+	return 0;
+}
+
+//Cuts the map down to its first keep blocks and frees the rest, along with
+//the extent blocks it no longer needs; meta says the blocks hold metadata.
+//extentMapStore writes the shorter map back. A compressed chunk is kept or
+//freed whole, so keep should not end inside one.
+static void extentMapTrim(struct cs1550_extent_map *map, long keep, int meta) {
+	int needed;
+	int i;
+
+	for(i = 0 ; i < map->nExtents ; i++) {
+		struct cs1550_extent *e = &map->extents[i];
+		if(keep >= extentLength(e)) {
+			keep -= extentLength(e);
+			continue;
+		}
+		if(e->nBlocks < 0) {
+			if(keep == 0) {
+				cacheDrop(chunkKey(e->nStartBlock), CHUNK_BLOCKS);
+				freeBlocks(e->nStartBlock, packedBlocks(e), meta);
+				e->nBlocks = 0;
+			}
+			keep = 0;
+			continue;
+		}
+		freeBlocks(e->nStartBlock + keep, e->nBlocks - keep, meta);
+		e->nBlocks = keep;
+		keep = 0;
+	}
+	while(map->nExtents > 0 && map->extents[map->nExtents - 1].nBlocks == 0)
+		map->nExtents--;
+	needed = (map->nExtents + MAX_EXTENTS_IN_BLOCK - 1) / MAX_EXTENTS_IN_BLOCK;
+	for(i = needed ; i < map->nChain ; i++)
+		freeBlocks(map->chain[i], 1, 1);
+	if(map->nChain > needed) map->nChain = needed;
+}
+
+//Copies between buf and the byte range [offset, offset+size) of the file,
+//one contiguous piece of disk at a time. Compressed chunks can be read this
+//way but not written.
+static int extentMapIO(const struct cs1550_extent_map *map, char *buf, size_t size, off_t offset, int write) {
+	off_t logical = 0;
+	int i, res = 0;
+
+	for(i = 0 ; i < map->nExtents && size > 0 && res == 0 ; i++) {
+		off_t length = extentLength(&map->extents[i]) * BLOCK_SIZE;
+		if(offset < logical + length) {
+			off_t within = offset - logical;
+			size_t piece = length - within;
+			if(piece > size) piece = size;
+			if(map->extents[i].nBlocks < 0)
+				res = write ? -EIO : chunkRead(&map->extents[i], buf, within, piece);
+			else if(write)
+				writeMultiBlock(buf, piece, map->extents[i].nStartBlock * BLOCK_SIZE + within);
+			else
+				res = readFile(buf, map->extents[i].nStartBlock * BLOCK_SIZE + within, piece);
+			buf += piece;
+			size -= piece;
+			offset += piece;
+		}
+		logical += length;
+	}
+	return res;
+}
+
+//Whether any of the file's bytes [offset, offset+size) are in a compressed
+//chunk.
+static int extentMapPacked(const struct cs1550_extent_map *map, off_t offset, size_t size) {
+	off_t logical = 0;
+	int i;
+
+	for(i = 0 ; i < map->nExtents && logical < (off_t)(offset + size) ; i++) {
+		off_t length = extentLength(&map->extents[i]) * BLOCK_SIZE;
+		if(map->extents[i].nBlocks < 0 && offset < logical + length) return 1;
+		logical += length;
+	}
+	return 0;
+}
+
+//Copies size bytes from the FUSE buffers in src to the file's bytes at
+//offset. A pipe in src is spliced straight into the image file; with -o mmap
+//the bytes land in the mapping. Cached copies of the blocks are dropped.
+static int extentMapSplice(const struct cs1550_extent_map *map, struct fuse_bufvec *src, size_t size, off_t offset) {
+	off_t logical = 0;
+	int i;
+
+	for(i = 0 ; i < map->nExtents && size > 0 ; i++) {
+		off_t length = extentLength(&map->extents[i]) * BLOCK_SIZE;
+		if(offset < logical + length) {
+			off_t within = offset - logical;
+			off_t location = map->extents[i].nStartBlock * BLOCK_SIZE + within;
+			size_t piece = length - within;
+			struct fuse_bufvec dst;
+			ssize_t n;
+
+			if(piece > size) piece = size;
+			dst = (struct fuse_bufvec)FUSE_BUFVEC_INIT(piece);
+			if(diskMap != NULL) {
+				if(location + piece > diskSize) return -ENOSPC;
+				dst.buf[0].mem = diskMap + location;
+			} else {
+				dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+				dst.buf[0].fd = diskFd;
+				dst.buf[0].pos = location;
+			}
+			n = fuse_buf_copy(&dst, src, 0);
+			cacheDrop(location / BLOCK_SIZE, (location % BLOCK_SIZE + piece + BLOCK_SIZE - 1) / BLOCK_SIZE);
+			if(n < 0) return n;
+			sumRefresh(location, n);
+			statsCount(STAT_DEV_WRITES, 1);
+			statsCount(STAT_DEV_WRITE_BYTES, n);
+			if((size_t)n != piece) return -EIO;
+			size -= piece;
+			offset += piece;
+		}
+		logical += length;
+	}
+	return 0;
+}
+
+//Describes the file's bytes [offset, offset+size) as pieces of the image
+//file, one per extent they cross, for FUSE to copy or splice from. Returns
+//NULL when out of memory.
+static struct fuse_bufvec *extentMapBufs(const struct cs1550_extent_map *map, size_t size, off_t offset) {
+	struct fuse_bufvec *bufv;
+	off_t logical = 0;
+	int i, n = 0;
+
+	for(i = 0 ; i < map->nExtents ; i++) {
+		off_t length = extentLength(&map->extents[i]) * BLOCK_SIZE;
+		if(offset < logical + length && (off_t)(offset + size) > logical) n++;
+		logical += length;
+	}
+	bufv = malloc(sizeof(struct fuse_bufvec) + (n > 0 ? n - 1 : 0) * sizeof(struct fuse_buf));
+	if(bufv == NULL) return NULL;
+	*bufv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(0);
+	bufv->count = 0;
+	logical = 0;
+	for(i = 0 ; i < map->nExtents && size > 0 ; i++) {
+		off_t length = extentLength(&map->extents[i]) * BLOCK_SIZE;
+		if(offset < logical + length) {
+			off_t within = offset - logical;
+			size_t piece = length - within;
+			struct fuse_buf *buf = &bufv->buf[bufv->count++];
+			if(piece > size) piece = size;
+			buf->size = piece;
+			buf->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK | FUSE_BUF_FD_RETRY;
+			buf->mem = NULL;
+			buf->fd = diskFd;
+			buf->pos = map->extents[i].nStartBlock * BLOCK_SIZE + within;
+			//FUSE does the reading
+			statsCount(STAT_DEV_READS, 1);
+			statsCount(STAT_DEV_READ_BYTES, piece);
+			size -= piece;
+			offset += piece;
+		}
+		logical += length;
+	}
+	return bufv;
+}
+
+//Prefetches the blocks holding the file's bytes [offset, offset+size). The
+//reads for all the extents go out together. A compressed chunk is fetched
+//whole, as it is stored.
+static void extentMapPrefetch(const struct cs1550_extent_map *map, off_t offset, size_t size) {
+	struct cs1550_io_batch batch;
+	long first = offset / BLOCK_SIZE;
+	long count = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE - first;
+	long logical = 0;
+	int i;
+
+	ioStart(&batch);
+	for(i = 0 ; i < map->nExtents && count > 0 ; i++) {
+		long length = extentLength(&map->extents[i]);
+		if(first < logical + length) {
+			long within = first - logical;
+			long piece = length - within < count ? length - within : count;
+			if(map->extents[i].nBlocks < 0)
+				cachePrefetch(&batch, map->extents[i].nStartBlock, packedBlocks(&map->extents[i]));
+			else
+				cachePrefetch(&batch, map->extents[i].nStartBlock + within, piece);
+			first += piece;
+			count -= piece;
+		}
+		logical += length;
+	}
+	ioSubmit(&batch);
+}
+
+//Makes room for count extents at index of the map.
+static int extentMapInsert(struct cs1550_extent_map *map, int index, int count) {
+	if(map->nExtents + count > map->capacity) {
+		int capacity = map->capacity ? map->capacity : 8;
+		struct cs1550_extent *extents;
+		while(capacity < map->nExtents + count) capacity *= 2;
+		extents = realloc(map->extents, capacity * sizeof(struct cs1550_extent));
+		if(extents == NULL) return -ENOMEM;
+		map->extents = extents;
+		map->capacity = capacity;
+	}
+	memmove(map->extents + index + count, map->extents + index, (map->nExtents - index) * sizeof(struct cs1550_extent));
+	map->nExtents += count;
+	return 0;
+}
+
+//Makes an extent of the map start at block of the file, splitting the plain
+//extent it falls in, and returns its index; nExtents when block is where the
+//map ends.
+static int extentMapSplit(struct cs1550_extent_map *map, long block) {
+	long logical = 0;
+	int i;
+
+	for(i = 0 ; i < map->nExtents ; i++) {
+		struct cs1550_extent *e = &map->extents[i];
+		long length = extentLength(e);
+		if(block == logical) return i;
+		if(block < logical + length) {
+			//compressed chunks start and end on chunk boundaries
+			if(e->nBlocks < 0) return -EIO;
+			if(extentMapInsert(map, i + 1, 1) != 0) return -ENOMEM;
+			e = &map->extents[i];
+			map->extents[i + 1].nStartBlock = e->nStartBlock + (block - logical);
+			map->extents[i + 1].nBlocks = e->nBlocks - (block - logical);
+			e->nBlocks = block - logical;
+			return i + 1;
+		}
+		logical += length;
+	}
+	return map->nExtents;
+}
+
+//Block of the image holding block b of the file, or -1 when the map ends
+//first or b is in a compressed chunk. The search starts at extent *i, which
+//begins at block *logical of the file, and leaves both at the extent found,
+//so a caller going forward through the file walks the map once.
+static long extentMapAt(const struct cs1550_extent_map *map, long b, int *i, long *logical) {
+	while(*i < map->nExtents && b >= *logical + extentLength(&map->extents[*i])) {
+		*logical += extentLength(&map->extents[*i]);
+		(*i)++;
+	}
+	if(*i == map->nExtents || map->extents[*i].nBlocks < 0) return -1;
+	return map->extents[*i].nStartBlock + (b - *logical);
+}
+
+//Points block b of the file at block of the image instead, joining the
+//extents on either side when they go on from it on disk. b is in extent *i
+//of the map, which starts at block *logical of the file, as extentMapAt
+//leaves them, and both are left at the extent that holds b afterwards. The
+//block it leaves goes to dead.
+static int extentMapRemap(struct cs1550_extent_map *map, long b, long block, struct cs1550_extent_map *dead, int *i, long *logical) {
+	int x = *i;
+	long start = map->extents[x].nStartBlock;
+	long length = map->extents[x].nBlocks;
+	long at = b - *logical;
+	int pieces = (at > 0) + (at + 1 < length);
+	struct cs1550_extent *e;
+
+	if(length < 0) return -EIO;
+	//cut it into the blocks before b, b and the blocks after b
+	if(pieces > 0 && extentMapInsert(map, x + 1, pieces) != 0) return -ENOMEM;
+	e = map->extents;
+	if(at > 0) {
+		e[x].nBlocks = at;
+		x++;
+	}
+	e[x].nStartBlock = start + at;
+	e[x].nBlocks = 1;
+	if(at + 1 < length) {
+		e[x + 1].nStartBlock = start + at + 1;
+		e[x + 1].nBlocks = length - at - 1;
+	}
+	if(extentMapAppend(dead, start + at, 1) != 0) return -ENOMEM;
+	e[x].nStartBlock = block;
+	*i = x;
+	*logical = b;
+	if(x + 1 < map->nExtents && e[x + 1].nBlocks > 0 && e[x + 1].nStartBlock == block + 1) {
+		e[x].nBlocks += e[x + 1].nBlocks;
+		memmove(e + x + 1, e + x + 2, (map->nExtents - x - 2) * sizeof(struct cs1550_extent));
+		map->nExtents--;
+	}
+	if(x > 0 && e[x - 1].nBlocks > 0 && e[x - 1].nStartBlock + e[x - 1].nBlocks == block) {
+		*i = x - 1;
+		*logical = b - e[x - 1].nBlocks;
+		e[x - 1].nBlocks += e[x].nBlocks;
+		memmove(e + x, e + x + 1, (map->nExtents - x - 1) * sizeof(struct cs1550_extent));
+		map->nExtents--;
+	}
+	return 0;
+}
+
+//Moves block b of the file, at from on disk and shared with other files, to
+//a new block of its own from group. Its bytes are copied along unless copy
+//is 0 because the caller writes all of them. *i and *logical are as for
+//extentMapRemap.
+static int dedupCopy(struct cs1550_extent_map *map, long b, long from, int copy, long group, struct cs1550_extent_map *dead, int *i, long *logical) {
+	cs1550_disk_block data;
+	long block = allocBlocks(1, group);
+	int res;
+
+	if(block < 0) return -ENOSPC;
+	res = copy ? readFile(data.data, from * BLOCK_SIZE, BLOCK_SIZE) : 0;
+	if(res == 0 && copy) writeMultiBlock(data.data, BLOCK_SIZE, block * BLOCK_SIZE);
+	if(res == 0) res = extentMapRemap(map, b, block, dead, i, logical);
+	if(res != 0) freeBlocks(block, 1, 0);
+	else statsCount(STAT_DEDUP_COPIES, 1);
+	return res;
+}
+
+//Readies the blocks holding the file's bytes [offset, offset+size) to be
+//written in place, on an image with a dedup table: shared ones are moved to
+//copies and the rest leave the table. Returns 1 when the map changed, 0 when
+//it did not, or -errno.
+static int dedupUnshare(struct cs1550_extent_map *map, off_t offset, size_t size, long group, struct cs1550_extent_map *dead) {
+	long end = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long logical = 0;
+	long b;
+	int i = 0, changed = 0;
+
+	if(dedupTable == NULL) return 0;
+	for(b = offset / BLOCK_SIZE ; b < end ; b++) {
+		long block = extentMapAt(map, b, &i, &logical);
+		int whole = offset <= b * BLOCK_SIZE && (off_t)(offset + size) >= (b + 1) * BLOCK_SIZE;
+		int res;
+
+		if(block < 0 || dedupPrivate(block)) continue;
+		res = dedupCopy(map, b, block, !whole, group, dead, &i, &logical);
+		if(res != 0) return res;
+		changed = 1;
+	}
+	return changed;
+}
+
+//Swaps the extents holding chunk c of the file, as far as the map reaches
+//into it, for the n extents in with. The old ones go to dead, to be freed by
+//chunkFree once the new map is stored.
+static int chunkReplace(struct cs1550_extent_map *map, long c, const struct cs1550_extent *with, int n, struct cs1550_extent_map *dead) {
+	long end = extentMapBlocks(map);
+	int from = extentMapSplit(map, c * CHUNK_BLOCKS);
+	int to = from < 0 ? from : extentMapSplit(map, (c + 1) * CHUNK_BLOCKS < end ? (c + 1) * CHUNK_BLOCKS : end);
+	int k;
+
+	if(to < 0) return to;
+	for(k = from ; k < to ; k++) {
+		if(extentMapAppend(dead, map->extents[k].nStartBlock, map->extents[k].nBlocks) != 0) return -ENOMEM;
+	}
+	if(n > to - from) {
+		if(extentMapInsert(map, to, n - (to - from)) != 0) return -ENOMEM;
+	} else if(n < to - from) {
+		memmove(map->extents + from + n, map->extents + to, (map->nExtents - to) * sizeof(struct cs1550_extent));
+		map->nExtents -= to - from - n;
+	}
+	memcpy(map->extents + from, with, n * sizeof(struct cs1550_extent));
+	return 0;
+}
+
+//Frees the blocks chunkReplace took out of a map that is now on disk.
+static void chunkFree(struct cs1550_extent_map *dead) {
+	extentMapTrim(dead, 0, 0);
+	extentMapFree(dead);
+}
+
+//Stores image, CHUNK_BYTES long, as chunk c of the file on new blocks from
+//group. With pack set it is compressed, or left alone when that saves no
+//block. Returns 1 once stored, 0 when left alone, or -errno.
+static int chunkStore(struct cs1550_extent_map *map, long c, const char *image, int pack, long group, struct cs1550_extent_map *dead) {
+	struct cs1550_extent_map fresh;
+	int res = 0;
+
+	memset(&fresh, 0, sizeof(struct cs1550_extent_map));
+	if(pack) {
+		char *packed = malloc(CHUNK_BYTES - BLOCK_SIZE);
+		size_t length = packed != NULL ? lzCompress(image, CHUNK_BYTES, packed, CHUNK_BYTES - BLOCK_SIZE) : 0;
+		long start = length > 0 ? allocBlocks((length + BLOCK_SIZE - 1) / BLOCK_SIZE, group) : -1;
+
+		if(start >= 0) {
+			writeMultiBlock(packed, length, start * BLOCK_SIZE);
+			res = extentMapAppend(&fresh, start, -(long)length);
+			statsCount(STAT_CHUNKS_PACKED, 1);
+			statsCount(STAT_PACKED_BYTES, length);
+		}
+		free(packed);
+		if(start < 0) return 0;
+	} else {
+		res = extentMapGrow(&fresh, CHUNK_BLOCKS, group);
+		if(res == 0) res = extentMapIO(&fresh, (char *)image, CHUNK_BYTES, 0, 1);
+	}
+	if(res == 0) res = chunkReplace(map, c, fresh.extents, fresh.nExtents, dead);
+	//nothing points at the new blocks unless it went through
+	if(res != 0) extentMapTrim(&fresh, 0, 0);
+	extentMapFree(&fresh);
+	return res < 0 ? res : 1;
+}
+
+//fileWrite for a file written with -o compress, or with compressed chunks,
+//one chunk at a time. A chunk that is whole after the write is compressed
+//when compression is on. A compressed chunk the write touches is rebuilt
+//with it laid over, and stored plain when it no longer compresses or
+//compression is off. Everything else is written in place. The blocks of
+//replaced extents go to dead. Returns 1 when the map changed, 0 when it did
+//not, or -errno.
+static int chunkWrite(struct cs1550_file_directory *file, struct cs1550_extent_map *map, const char *buf, struct fuse_bufvec *src,
+	size_t size, off_t offset, long group, struct cs1550_extent_map *dead) {
+	int pack = options.compress && super.version >= 5;
+	off_t end = offset + size;
+	off_t fsize = end > (off_t)file->fsize ? end : (off_t)file->fsize;
+	long have = extentMapBlocks(map);
+	long c = (offset < have * BLOCK_SIZE ? offset : have * BLOCK_SIZE) / CHUNK_BYTES;
+	char *image = NULL;
+	int changed = 0;
+	int res = 0;
+
+	//chunks between the end of the map and offset are filled in on the way
+	for( ; res == 0 && c * CHUNK_BYTES < end ; c++) {
+		off_t start = c * CHUNK_BYTES;
+		off_t hi = end < start + CHUNK_BYTES ? end : start + CHUNK_BYTES;
+		off_t lo = offset > start ? (offset < hi ? offset : hi) : start;
+		off_t used = fsize < start + CHUNK_BYTES ? fsize - start : CHUNK_BYTES;
+		int packed = have > c * CHUNK_BLOCKS && extentMapPacked(map, start, CHUNK_BYTES);
+		long need = (hi + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		const char *data = NULL;
+
+		if((pack && used == CHUNK_BYTES) || packed) {
+			if(image == NULL && (image = malloc(CHUNK_BYTES)) == NULL) {
+				res = -ENOMEM;
+				break;
+			}
+			memset(image, 0, CHUNK_BYTES);
+			//the chunk as it is, unless the write covers all of it
+			if(have > c * CHUNK_BLOCKS && (lo > start || hi - start < used)) {
+				long n = have - c * CHUNK_BLOCKS < CHUNK_BLOCKS ? have - c * CHUNK_BLOCKS : CHUNK_BLOCKS;
+				res = extentMapIO(map, image, n * BLOCK_SIZE, start, 0);
+			}
+			if(res == 0 && hi > lo && src != NULL) {
+				struct fuse_bufvec dst = FUSE_BUFVEC_INIT(hi - lo);
+				dst.buf[0].mem = image + (lo - start);
+				if(fuse_buf_copy(&dst, src, 0) != hi - lo) res = -EIO;
+			} else if(res == 0 && hi > lo) {
+				memcpy(image + (lo - start), buf + (lo - offset), hi - lo);
+			}
+			if(res == 0) res = chunkStore(map, c, image, pack && used == CHUNK_BYTES, group, dead);
+			if(res == 0 && packed) res = chunkStore(map, c, image, 0, group, dead);
+			if(res == 1) {
+				changed = 1;
+				if(have < (c + 1) * CHUNK_BLOCKS) have = (c + 1) * CHUNK_BLOCKS;
+				res = 0;
+				continue;
+			}
+			//does not compress: written in place like the rest
+			data = image + (lo - start);
+		}
+		if(res == 0 && have < need) {
+			changed = 1;
+			res = extentMapGrow(map, need - have, group);
+			have = extentMapBlocks(map);
+		}
+		if(res == 0 && hi > lo) {
+			res = dedupUnshare(map, lo, hi - lo, group, dead);
+			if(res > 0) changed = 1;
+		}
+		if(res >= 0 && hi > lo) {
+			if(data != NULL)
+				res = extentMapIO(map, (char *)data, hi - lo, lo, 1);
+			else if(src != NULL)
+				res = extentMapSplice(map, src, hi - lo, lo);
+			else
+				res = extentMapIO(map, (char *)buf + (lo - offset), hi - lo, lo, 1);
+		}
+	}
+	free(image);
+	return res < 0 ? res : changed;
+}
+
+//fileWrite with -o dedup, for a file without compressed chunks, from
+//memory. A whole block of the write that an indexed block already holds
+//points at that block instead. Every other block is written in place,
+//or to a copy when it is shared, and indexed when written whole. Writes to
+//blocks that follow each other on disk go out together. The blocks the map
+//no longer points at go to dead. Returns 1 when the map changed, 0 when it
+//did not, or -errno.
+static int dedupWrite(struct cs1550_extent_map *map, const char *buf, size_t size, off_t offset, long group, struct cs1550_extent_map *dead) {
+	struct cs1550_dedup_run run = { 0, 0, NULL };
+	long first = offset / BLOCK_SIZE;
+	long last = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long have = extentMapBlocks(map);
+	long logical = 0;
+	long b;
+	int i = 0, changed = 0;
+	int res = 0;
+
+	//the blocks between the end of the file and the write are left as holes
+	if(have < first) {
+		res = extentMapGrow(map, first - have, group);
+		have = first;
+		changed = 1;
+	}
+	for(b = first ; b < last && res == 0 ; b++) {
+		off_t lo = offset > b * BLOCK_SIZE ? offset : b * BLOCK_SIZE;
+		off_t hi = (off_t)(offset + size) < (b + 1) * BLOCK_SIZE ? (off_t)(offset + size) : (b + 1) * BLOCK_SIZE;
+		const char *data = buf + (lo - offset);
+		uint64_t hash = hi - lo == BLOCK_SIZE ? blockHash(data) : 0;
+		long block = b < have ? extentMapAt(map, b, &i, &logical) : -1;
+		long found = hash != 0 ? dedupFind(hash, data, block, &run) : -1;
+		off_t location;
+
+		//it holds these bytes already
+		if(found >= 0 && found == block) continue;
+		if(found >= 0) {
+			statsCount(STAT_DEDUP_HITS, 1);
+			changed = 1;
+			if(b < have) {
+				res = extentMapRemap(map, b, found, dead, &i, &logical);
+			} else {
+				res = extentMapAppend(map, found, 1);
+				have++;
+			}
+			//give the share back
+			if(res != 0) freeBlocks(found, 1, 0);
+			continue;
+		}
+		if(b >= have) {
+			res = extentMapGrow(map, 1, group);
+			have++;
+			changed = 1;
+		} else if(!dedupPrivate(block)) {
+			res = dedupCopy(map, b, block, hi - lo < BLOCK_SIZE, group, dead, &i, &logical);
+			changed = 1;
+		}
+		if(res != 0) break;
+		block = extentMapAt(map, b, &i, &logical);
+		location = block * BLOCK_SIZE + (lo - b * BLOCK_SIZE);
+		if(run.size > 0 && run.location + (off_t)run.size == location && run.data + run.size == data) {
+			run.size += hi - lo;
+		} else {
+			if(run.size > 0) writeMultiBlock(run.data, run.size, run.location);
+			run.location = location;
+			run.size = hi - lo;
+			run.data = data;
+		}
+		if(hash != 0) dedupInsert(hash, block);
+	}
+	if(run.size > 0) writeMultiBlock(run.data, run.size, run.location);
+	return res < 0 ? res : changed;
+}
+
+//Copies between buf and size bytes at offset into the tail run at address.
+//Writers hold the directory's blockLock.
+static int tailIO(long address, char *buf, size_t size, off_t offset, int write) {
+	cs1550_disk_block block;
+	long location = address - address % BLOCK_SIZE;
+
+	if(!journalRead(&block, location) && cacheRead(&block, BLOCK_SIZE, location) != BLOCK_SIZE) return -EIO;
+	if(!write) {
+		memcpy(buf, block.data + address % BLOCK_SIZE + offset, size);
+		return 0;
+	}
+	memcpy(block.data + address % BLOCK_SIZE + offset, buf, size);
+	metaWrite(&block, location);
+	cacheUpdate(location / BLOCK_SIZE, (const char *)&block, 0, BLOCK_SIZE);
+	return 0;
+}
+
+//First of units free units in a row in a tail block, or -1.
+static long tailScan(const struct cs1550_tail_block *tail, long units) {
+	long u, run = 0;
+	for(u = 0 ; u < TAIL_UNITS ; u++) {
+		if(tail->used[u / 64] >> (u % 64) & 1) run = 0;
+		else if(++run == units) return u - units + 1;
+	}
+	return -1;
+}
+
+//Takes a run of units in one of the directory's tail blocks, or in a new
+//one from group when none has room. Returns its byte address or -errno.
+//The caller holds blockLock.
+static long tailAlloc(struct cs1550_dir_cache *dir, long units, long group) {
+	struct cs1550_tail_block *tail;
+	long block, first;
+	int i;
+
+	for(i = 0 ; i < dir->nTails ; i++) {
+		tail = &dir->tails[i];
+		if(TAIL_UNITS - tail->nUsed < units || (first = tailScan(tail, units)) < 0) continue;
+		tailMark(tail, first, units, 1);
+		return tail->block * BLOCK_SIZE + first * TAIL_UNIT;
+	}
+	block = allocBlocks(1, group);
+	if(block == -1) return -ENOSPC;
+	tail = tailAdd(dir, block);
+	if(tail == NULL) {
+		freeBlocks(block, 1, 1);
+		return -ENOMEM;
+	}
+	tailMark(tail, 0, units, 1);
+	return block * BLOCK_SIZE;
+}
+
+//Grows the run at address from have to need units when the units after it
+//are free. Returns whether it did. The caller holds blockLock.
+static int tailExtend(struct cs1550_dir_cache *dir, long address, long have, long need) {
+	int i = tailFind(dir, address / BLOCK_SIZE);
+	long first = address % BLOCK_SIZE / TAIL_UNIT;
+	long u;
+
+	if(i >= dir->nTails || dir->tails[i].block != address / BLOCK_SIZE || first + need > TAIL_UNITS) return 0;
+	for(u = first + have ; u < first + need ; u++) {
+		if(dir->tails[i].used[u / 64] >> (u % 64) & 1) return 0;
+	}
+	tailMark(&dir->tails[i], first + have, need - have, 1);
+	return 1;
+}
+
+//Gives back units of the run at address, and the tail block once nothing
+//is left in it. The caller holds blockLock.
+static void tailFree(struct cs1550_dir_cache *dir, long address, long units) {
+	int i = tailFind(dir, address / BLOCK_SIZE);
+	struct cs1550_tail_block *tail;
+
+	if(i >= dir->nTails || dir->tails[i].block != address / BLOCK_SIZE) return;
+	tail = &dir->tails[i];
+	tailMark(tail, address % BLOCK_SIZE / TAIL_UNIT, units, 0);
+	if(tail->nUsed == 0) {
+		freeBlocks(tail->block, 1, 1);
+		memmove(&dir->tails[i], &dir->tails[i + 1], (dir->nTails - i - 1) * sizeof(struct cs1550_tail_block));
+		dir->nTails--;
+	}
+}
+
+//Detects sequential reads of a file. Each one doubles the file's read-ahead
+//window, up to -o readahead_kb, and prefetches that much past the read; any
+//other read closes the window again.
+static void readAhead(struct cs1550_file_node *node, const struct cs1550_extent_map *map, off_t offset, size_t size, size_t fsize) {
+	off_t expected = __atomic_exchange_n(&node->nextRead, offset + size, __ATOMIC_RELAXED);
+	long window = __atomic_load_n(&node->readAhead, __ATOMIC_RELAXED);
+	off_t start = offset + size;
+
+	if(readAheadBlocks == 0) return;
+	if(offset != expected) {
+		__atomic_store_n(&node->readAhead, 0, __ATOMIC_RELAXED);
+		return;
+	}
+	window = window == 0 ? (readAheadBlocks + 3) / 4 : window * 2;
+	if(window > readAheadBlocks) window = readAheadBlocks;
+	__atomic_store_n(&node->readAhead, window, __ATOMIC_RELAXED);
+	if(start >= (off_t)fsize) return;
+	extentMapPrefetch(map, start, fsize - start < (size_t)window * BLOCK_SIZE ? fsize - start : (size_t)window * BLOCK_SIZE);
+}
+
+//Reads up to size bytes at offset. Returns the byte count or -errno. node
+//carries the file's read-ahead state and loaded extents, or is NULL for
+//none.
+static int fileRead(struct cs1550_file_directory *file, struct cs1550_file_node *node, char *buf, size_t size, off_t offset) {
+	struct cs1550_extent_map loaded;
+	struct cs1550_extent_map *map = node != NULL ? node->map : NULL;
+	int res = 0;
+
+	if(offset >= (off_t)file->fsize) return 0;
+	if(offset + size > file->fsize) size = file->fsize - offset;
+	if(file->nStartBlock < 0) {
+		res = tailIO(-file->nStartBlock, buf, size, offset, 0);
+		return res < 0 ? res : (int)size;
+	}
+	if(map == NULL) {
+		map = &loaded;
+		res = extentMapLoad(file->nStartBlock, map);
+	}
+	if(res == 0) res = extentMapIO(map, buf, size, offset, 0);
+	if(res == 0) {
+		if(node != NULL) readAhead(node, map, offset, size, file->fsize);
+		res = size;
+	}
+	if(map == &loaded) extentMapFree(&loaded);
+	return res;
+}
+
+//Writes size bytes at offset, growing the file as needed with blocks from
+//group, and updates the entry's fsize and nStartBlock. The caller writes the
+//directory block. Extents node keeps loaded are updated too. The bytes come
+//from buf, or from the FUSE buffers in src when it is set.
+static int fileWrite(struct cs1550_file_directory *file, struct cs1550_file_node *node, const char *buf, struct fuse_bufvec *src, size_t size, off_t offset, long group) {
+	struct cs1550_extent_map loaded;
+	struct cs1550_extent_map *map = node != NULL ? node->map : NULL;
+	struct cs1550_extent_map dead;
+	long blocks = (offset + size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	long have;
+	long location;
+	int dedup = options.dedup && dedupTable != NULL;
+	int chunked, changed = 0;
+	int res = 0;
+
+	if(map == NULL) {
+		map = &loaded;
+		res = extentMapLoad(file->nStartBlock, map);
+		if(res != 0) {
+			extentMapFree(map);
+			return res;
+		}
+	}
+	memset(&dead, 0, sizeof(struct cs1550_extent_map));
+	have = extentMapBlocks(map);
+	chunked = (options.compress && super.version >= 5) || extentMapPacked(map, 0, have * BLOCK_SIZE);
+	if(chunked) {
+		res = chunkWrite(file, map, buf, src, size, offset, group, &dead);
+		changed = res > 0;
+		if(res > 0) res = 0;
+	} else if(dedup) {
+		char *copy = NULL;
+		if(src != NULL) {
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+			dst.buf[0].mem = copy = malloc(size);
+			if(copy == NULL) res = -ENOMEM;
+			else if(fuse_buf_copy(&dst, src, 0) != (ssize_t)size) res = -EIO;
+		}
+		if(res == 0) res = dedupWrite(map, copy != NULL ? copy : buf, size, offset, group, &dead);
+		free(copy);
+		changed = res > 0;
+		if(res > 0) res = 0;
+	} else {
+		if(have < blocks) {
+			res = extentMapGrow(map, blocks - have, group);
+			changed = 1;
+		}
+		if(res == 0) res = dedupUnshare(map, offset, size, group, &dead);
+		if(res > 0) {
+			changed = 1;
+			res = 0;
+		}
+	}
+	if(changed) {
+		location = extentMapStore(map, group);
+		if(location < 0 && res == 0) res = location;
+		if(location > 0) file->nStartBlock = location;
+	}
+	if(res == 0 && !chunked && !dedup && src != NULL)
+		res = extentMapSplice(map, src, size, offset);
+	else if(res == 0 && !chunked && !dedup)
+		res = extentMapIO(map, (char *)buf, size, offset, 1);
+	//the replaced chunks stay on disk until nothing points at them
+	if(res == 0) chunkFree(&dead);
+	else extentMapFree(&dead);
+	if(res == 0) {
+		if(offset + size > file->fsize)
+			file->fsize = offset + size;
+		res = size;
+	} else if(map != &loaded) {
+		//no longer sure it matches the disk; the next open loads it again
+		extentMapFree(map);
+		free(map);
+		node->map = NULL;
+	}
+	if(map == &loaded) extentMapFree(&loaded);
+	return res;
+}
+
+//Write-back: each file buffers one contiguous range of writes in its node.
+//Writes that land inside or right after the range are copied into it, so
+//an appender pays for one large write and one directory update per range
+//instead of one per FUSE request. The range goes to disk at flush, fsync and
+//release, when a write does not touch it, when it reaches -o writeback_kb,
+//or when all files together buffer more than -o dirty_mb.
+//
+//A range always starts at or before the on-disk size, so the file's bytes
+//are the on-disk ones with the range laid over them.
+static long dirtyBytes = 0;	//buffered across all files, updated with atomics
+
+//Size of the file including its buffered writes.
+static size_t fileLength(struct cs1550_file_directory *file, struct cs1550_file_node *node) {
+	if(node->dirtyLength > 0 && node->dirtyStart + node->dirtyLength > file->fsize)
+		return node->dirtyStart + node->dirtyLength;
+	return file->fsize;
+}
+
+//Writes to a small file kept in a tail block, moving its bytes to a larger
+//run when they outgrow theirs, and updates the entry like fileWrite.
+static int tailWrite(int dirSlot, struct cs1550_file_directory *file, const char *buf, size_t size, off_t offset, long group) {
+	struct cs1550_dir_cache *dir = dirCache[dirSlot];
+	size_t fsize = offset + size > file->fsize ? offset + size : file->fsize;
+	long address = -file->nStartBlock;
+	long have = file->nStartBlock < 0 ? tailUnits(file->fsize) : 0;
+	long need = tailUnits(fsize);
+	char bytes[TAIL_MAX];
+	int res = 0;
+
+	pthread_mutex_lock(&dirNodes[dirSlot]->blockLock);
+	if(need > have && have > 0 && tailExtend(dir, address, have, need)) have = need;
+	if(need > have) {
+		//a new run, written whole: the bytes so far with the write laid over them
+		long moved = tailAlloc(dir, need, group);
+		if(moved < 0) res = moved;
+		if(res == 0 && have > 0) res = tailIO(address, bytes, file->fsize, 0, 0);
+		if(res == 0) {
+			memcpy(bytes + offset, buf, size);
+			res = tailIO(moved, bytes, fsize, 0, 1);
+		}
+		if(res == 0 && have > 0) tailFree(dir, address, have);
+		else if(res != 0 && moved >= 0) tailFree(dir, moved, need);
+		if(res == 0) address = moved;
+	} else {
+		res = tailIO(address, (char *)buf, size, offset, 1);
+	}
+	pthread_mutex_unlock(&dirNodes[dirSlot]->blockLock);
+	if(res != 0) return res;
+	file->nStartBlock = -address;
+	file->fsize = fsize;
+	return size;
+}
+
+//Moves a small file out of its tail block onto blocks of its own, before a
+//write makes it too large for one.
+static int tailPromote(int dirSlot, struct cs1550_file_directory *file, struct cs1550_file_node *node, long group) {
+	struct cs1550_file_directory moved = *file;
+	char bytes[TAIL_MAX];
+	int res = tailIO(-file->nStartBlock, bytes, file->fsize, 0, 0);
+
+	moved.fsize = 0;
+	moved.nStartBlock = 0;
+	if(res == 0) res = fileWrite(&moved, node, bytes, NULL, file->fsize, 0, group);
+	if(res < 0) return res;
+	pthread_mutex_lock(&dirNodes[dirSlot]->blockLock);
+	tailFree(dirCache[dirSlot], -file->nStartBlock, tailUnits(file->fsize));
+	pthread_mutex_unlock(&dirNodes[dirSlot]->blockLock);
+	*file = moved;
+	return 0;
+}
+
+//Writes straight to the file's blocks, or its tail run while it is small
+//enough, and publishes its new size and first extent block. The caller
+//holds the directory's lock and the file's write lock. The bytes come from
+//buf, or from src when it is set.
+static int writeFile(int dirSlot, int fileSlot, const char *buf, struct fuse_bufvec *src, size_t size, off_t offset) {
+	struct cs1550_dir_node *node = dirNodes[dirSlot];
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	struct cs1550_file_directory *entry = dirFile(dirSlot, fileSlot);
+	struct cs1550_file_directory file = *entry;
+	long group = blockGroup(readDisk()->directories[dirSlot].nStartBlock / BLOCK_SIZE);
+	char bytes[TAIL_MAX];
+	int res = 0;
+
+	//work on a copy so the shared directory block only changes under
+	//blockLock
+	if(super.version >= 4 && file.nStartBlock <= 0 && offset + size <= TAIL_MAX) {
+		if(src != NULL) {
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+			dst.buf[0].mem = bytes;
+			res = fuse_buf_copy(&dst, src, 0) == (ssize_t)size ? 0 : -EIO;
+			buf = bytes;
+		}
+		if(res == 0) res = tailWrite(dirSlot, &file, buf, size, offset, group);
+	} else {
+		if(file.nStartBlock < 0) res = tailPromote(dirSlot, &file, fnode, group);
+		if(res == 0) res = fileWrite(&file, fnode, buf, src, size, offset, group);
+	}
+	pthread_mutex_lock(&node->blockLock);
+	entry->fsize = file.fsize;
+	entry->nStartBlock = file.nStartBlock;
+	writeDirectory(dirSlot, fileSlot);
+	pthread_mutex_unlock(&node->blockLock);
+	return res < 0 ? res : 0;
+}
+
+//Writes out the file's buffered range. Same locking as writeFile. The range
+//is dropped even if the write fails; the error goes to the caller.
+static int flushFile(int dirSlot, int fileSlot) {
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	int res;
+
+	if(fnode->dirtyLength == 0) return 0;
+	res = writeFile(dirSlot, fileSlot, fnode->dirty, NULL, fnode->dirtyLength, fnode->dirtyStart);
+	__atomic_sub_fetch(&dirtyBytes, fnode->dirtyLength, __ATOMIC_RELAXED);
+	fnode->dirtyLength = 0;
+	return res;
+}
+
+//Frees the buffer of a file nobody has open.
+static void dropBuffer(struct cs1550_file_node *fnode) {
+	free(fnode->dirty);
+	fnode->dirty = NULL;
+	fnode->dirtyCapacity = 0;
+}
+
+//Forgets the buffered writes of a file that is going away.
+static void discardBuffer(struct cs1550_file_node *fnode) {
+	__atomic_sub_fetch(&dirtyBytes, fnode->dirtyLength, __ATOMIC_RELAXED);
+	fnode->dirtyLength = 0;
+	dropBuffer(fnode);
+}
+
+//Makes room for a write in the file's buffered range and returns where its
+//bytes go, or NULL when it cannot be buffered: it does not touch the range
+//or would make it, or all buffered writes, too large. The caller then
+//flushes and writes again.
+static char *bufferReserve(struct cs1550_file_node *fnode, size_t size, off_t offset) {
+	size_t limit = (size_t)options.writeBackKiB * 1024;
+	size_t start = fnode->dirtyLength > 0 ? fnode->dirtyStart : offset;
+	size_t end = fnode->dirtyLength > 0 ? fnode->dirtyStart + fnode->dirtyLength : offset;
+	size_t length;
+
+	if(offset < (off_t)start || offset > (off_t)end) return NULL;
+	if(offset + size > end) end = offset + size;
+	length = end - start;
+	if(length > limit) return NULL;
+	if(length > fnode->dirtyLength &&
+		__atomic_load_n(&dirtyBytes, __ATOMIC_RELAXED) > (long)options.dirtyMiB << 20) return NULL;
+	if(length > fnode->dirtyCapacity) {
+		size_t capacity = fnode->dirtyCapacity ? fnode->dirtyCapacity : 4096;
+		char *dirty;
+		while(capacity < length) capacity *= 2;
+		if(capacity > limit) capacity = limit;
+		dirty = realloc(fnode->dirty, capacity);
+		if(dirty == NULL) return NULL;
+		fnode->dirty = dirty;
+		fnode->dirtyCapacity = capacity;
+	}
+	__atomic_add_fetch(&dirtyBytes, length - fnode->dirtyLength, __ATOMIC_RELAXED);
+	fnode->dirtyStart = start;
+	fnode->dirtyLength = length;
+	return fnode->dirty + (offset - start);
+}
+
+//Adds a write to the file's buffered range. Returns 0 once it is buffered,
+//or 1 when bufferReserve has no room for it.
+static int bufferWrite(struct cs1550_file_node *fnode, const char *buf, size_t size, off_t offset) {
+	char *dirty = bufferReserve(fnode, size, offset);
+	if(dirty == NULL) return 1;
+	memcpy(dirty, buf, size);
+	return 0;
+}
+
+//Frees the blocks of a file whose name is gone and hands its slot to the
+//next file made in the directory. The caller holds the directory's lock and
+//the file's write lock inside a journal bracket. When its extents cannot be
+//read the file stays an orphan, for the next mount to free.
+static void freeSlot(int dirSlot, int fileSlot) {
+	struct cs1550_dir_node *node = dirNodes[dirSlot];
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	struct cs1550_file_directory *file = dirFile(dirSlot, fileSlot);
+	struct cs1550_extent_map map;
+
+	discardBuffer(fnode);
+	if(fnode->map != NULL) extentMapFree(fnode->map);
+	free(fnode->map);
+	fnode->map = NULL;
+	fnode->nextRead = 0;
+	fnode->readAhead = 0;
+	if(file->nStartBlock > 0) {
+		if(extentMapLoad(file->nStartBlock, &map) != 0) {
+			extentMapFree(&map);
+			return;
+		}
+		extentMapTrim(&map, 0, 0);
+		extentMapFree(&map);
+	}
+	//freed slots are only taken under the directory's write lock, but
+	//several releases can free theirs at once
+	pthread_mutex_lock(&node->blockLock);
+	if(file->nStartBlock < 0) tailFree(dirCache[dirSlot], -file->nStartBlock, tailUnits(file->fsize));
+	file->fsize = 0;
+	file->nStartBlock = 0;
+	writeDirectory(dirSlot, fileSlot);
+	pushFreeSlot(dirCache[dirSlot], fileSlot);
+	pthread_mutex_unlock(&node->blockLock);
+	__atomic_store_n(&fnode->unlinked, 0, __ATOMIC_RELAXED);
+}
+
+//Flushes a file's buffered writes. With release set this also ends one
+//open, and the last one drops the file's buffer and loaded extents, or frees
+//the file altogether when it was removed while open. The caller holds the
+//directory's lock inside a journal bracket.
+static int flushSlot(int dirSlot, int fileSlot, int release) {
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	int res = 0;
+
+	pthread_rwlock_wrlock(&fnode->lock);
+	if(release && fnode->nOpen > 0) fnode->nOpen--;
+	if(release && fnode->nOpen == 0 && __atomic_load_n(&fnode->unlinked, __ATOMIC_RELAXED))
+		freeSlot(dirSlot, fileSlot);
+	else
+		res = flushFile(dirSlot, fileSlot);
+	if(release && fnode->nOpen == 0) {
+		dropBuffer(fnode);
+		if(fnode->map != NULL) extentMapFree(fnode->map);
+		free(fnode->map);
+		fnode->map = NULL;
+	}
+	pthread_rwlock_unlock(&fnode->lock);
+	return res;
+}
+
+//Starts an open of a file in a directory locked for reading. Its extents
+//stay loaded until the last release, so reads and writes through any of its
+//handles skip the extent blocks. A small file in a tail block has none.
+static void openSlot(int dirSlot, int fileSlot) {
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+
+	pthread_rwlock_wrlock(&fnode->lock);
+	if(fnode->map == NULL && dirFile(dirSlot, fileSlot)->nStartBlock >= 0) {
+		struct cs1550_extent_map *map = malloc(sizeof(struct cs1550_extent_map));
+		//without them every operation loads its own copy, as before
+		if(map != NULL && extentMapLoad(dirFile(dirSlot, fileSlot)->nStartBlock, map) == 0) {
+			fnode->map = map;
+		} else if(map != NULL) {
+			extentMapFree(map);
+			free(map);
+		}
+	}
+	fnode->nOpen++;
+	pthread_rwlock_unlock(&fnode->lock);
+}
+
+//Same as flushSlot for a file named by its path. Missing files are not an
+//error.
+static int flushPath(const char *path, int release) {
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	int dirSlot, fileSlot;
+	int res = 0;
+
+	tokenPath(path, directory, filename, extension);
+	journalBegin();
+	dirSlot = lockDir(directory, 0);
+	if(dirSlot >= 0) {
+		fileSlot = findFile(dirSlot, filename, extension);
+		if(fileSlot >= 0)
+			res = flushSlot(dirSlot, fileSlot, release);
+		unlockDir(dirSlot);
+	}
+	journalEnd();
+	return res;
+}
+
+//Flushes every file's buffered writes, for unmount.
+static void flushAll() {
+	int i, j;
+	journalBegin();
+	pthread_rwlock_rdlock(&rootLock);
+	for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
+		if(dirNodes[i] == NULL) continue;
+		pthread_rwlock_rdlock(&dirNodes[i]->lock);
+		for(j = 0 ; j < dirFiles(i) ; j++) {
+			pthread_rwlock_wrlock(&fileNode(i, j)->lock);
+			flushFile(i, j);
+			pthread_rwlock_unlock(&fileNode(i, j)->lock);
+		}
+		pthread_rwlock_unlock(&dirNodes[i]->lock);
+	}
+	pthread_rwlock_unlock(&rootLock);
+	journalEnd();
+}
+
+//Makes sure the image holds what has been written: writeback is only
+//started unless wait is set. With the journal, waiting means a commit,
+//which every other operation waiting on one shares.
+static int syncImage(int wait) {
+	if(journalOn) {
+		if(wait) return journalCommit();
+		//the bitmap is written by the next commit
+		return devSync(1);
+	}
+	bitmapStore();
+	dedupStore();
+	return devSync(!wait);
+}
+
+//An open file, kept in fi->fh from cs1550_open to cs1550_release. Open files
+//stay in their slots, so requests on a handle skip tokenPath and the name
+//index altogether.
+struct cs1550_handle
+{
+	int dirSlot;	//-1 for /.stats
+	int fileSlot;
+	char *stats;	//text of /.stats when it was opened
+	size_t statsSize;
+};
+
+//The handle in fi, or NULL for files not opened through cs1550_open.
+static struct cs1550_handle *fileHandle(struct fuse_file_info *fi) {
+	return fi != NULL ? (struct cs1550_handle *)(uintptr_t)fi->fh : NULL;
+}
+
+//Locks the directory of a handle's file for reading. It cannot go away
+//while the file is open, so rootLock is not needed.
+static void lockHandle(struct cs1550_handle *handle) {
+	pthread_rwlock_rdlock(&dirNodes[handle->dirSlot]->lock);
+}
+
+static int flushHandle(struct cs1550_handle *handle, int release) {
+	int res;
+	journalBegin();
+	lockHandle(handle);
+	res = flushSlot(handle->dirSlot, handle->fileSlot, release);
+	unlockDir(handle->dirSlot);
+	journalEnd();
+	return res;
+}
+
+//Request handlers by slot, shared by the path-based handlers below and the
+//inode-based ones. The caller has checked the names and holds the locks
+//noted on each.
+
+//Adds directory to the root. Returns its slot or -errno.
+static int makeDir(const char *directory) {
+	int res;
+
+	journalBegin();
+	pthread_rwlock_wrlock(&rootLock);
+	if (findDir(directory) >= 0 || strcmp(directory, STATS_NAME) == 0) {
+		res = -EEXIST;
+	} else {
+		cs1550_root_directory *root = readDisk();
+		if(root->nDirectories < MAX_DIRS_IN_ROOT) {
+			long group = emptiestGroup();
+			long block = allocBlocks(1, group);
+			if(block == -1) {
+				res = -ENOSPC;
+			} else {
+				long blockAddress = block * BLOCK_SIZE;
+				long location = blockAddress;
+				int dirSlot = 0;
+				struct cs1550_dir_cache *dir = calloc(1, sizeof(struct cs1550_dir_cache));
+				struct cs1550_dir_node *node = newDirNode();
+				//the first slot a removed directory left, or the next one
+				while(root->directories[dirSlot].dname[0] != '\0')
+					dirSlot++;
+				res = dir != NULL && node != NULL ? addDirBlock(dir, node, blockAddress, 1) : -ENOMEM;
+				if(res == 0 && super.version >= 3) {
+					//the root points at the extent block listing the directory's blocks
+					struct cs1550_extent_map map;
+					memset(&map, 0, sizeof(struct cs1550_extent_map));
+					res = extentMapAppend(&map, block, 1);
+					if(res == 0 && (location = extentMapStore(&map, group)) < 0) res = location;
+					extentMapFree(&map);
+				}
+				if(res != 0) {
+					freeDirCache(dir);
+					freeDirNode(node);
+				} else {
+					strcpy(root->directories[dirSlot].dname, directory);
+					root->directories[dirSlot].nStartBlock = location;
+					root->nDirectories = root->nDirectories + 1;
+					dirCache[dirSlot] = dir;
+					dirNodes[dirSlot] = node;
+					dirGenerations[dirSlot] = __atomic_add_fetch(&inoGeneration, 1, __ATOMIC_RELAXED);
+					indexInsert(dirSlot, -1);
+					writeRoot();
+					writeDirectory(dirSlot, 0);
+					res = dirSlot;
+				}
+			}
+		} else {
+			res = -ENOSPC;
+		}
+	}
+	pthread_rwlock_unlock(&rootLock);
+	journalEnd();
+	return res;
+}
+
+//Gives a directory locked for writing one more block, inside a journal
+//bracket. The block goes right after the last one when it is free. Images
+//older than version 3 cannot list more than one.
+static int growDirectory(int dirSlot) {
+	struct cs1550_dir_cache *dir = dirCache[dirSlot];
+	long location = readDisk()->directories[dirSlot].nStartBlock;
+	long group = blockGroup(location / BLOCK_SIZE);
+	struct cs1550_extent_map map;
+	long stored;
+	int res;
+
+	if(super.version < 3) return -ENOSPC;
+	res = extentMapLoad(location, &map);
+	if(res == 0) res = extentMapGrow(&map, 1, group);
+	if(res == 0) {
+		struct cs1550_extent *last = &map.extents[map.nExtents - 1];
+		res = addDirBlock(dir, dirNodes[dirSlot], (last->nStartBlock + last->nBlocks - 1) * BLOCK_SIZE, 1);
+	}
+	if(res == 0 && (stored = extentMapStore(&map, group)) < 0) {
+		//forget the block again; its file nodes stay for the next one
+		dir->nBlocks--;
+		unloadDirectory(dir->blocks[dir->nBlocks]);
+		res = stored;
+	}
+	extentMapFree(&map);
+	return res;
+}
+
+//Adds an empty file to a directory locked for writing, inside a journal
+//bracket. Returns its slot or -errno.
+static int makeFile(int dirSlot, const char *filename, const char *extension) {
+	struct cs1550_dir_cache *dir = dirCache[dirSlot];
+	struct cs1550_file_directory *file;
+	int fileSlot = dir->nFree > 0 ? dir->freeSlots[dir->nFree - 1] : dir->nFiles;
+	int res;
+
+	if(findFile(dirSlot, filename, extension) >= 0) return -EEXIST;
+	if(fileSlot >= MAX_FILES_PER_DIR) return -ENOSPC;
+	if(fileSlot == dir->nBlocks * (int)MAX_FILES_IN_DIR && (res = growDirectory(dirSlot)) != 0) return res;
+	//no blocks until the first write gives the file an extent block
+	file = dirFile(dirSlot, fileSlot);
+	strcpy(file->fname, filename);
+	strcpy(file->fext, extension);
+	file->fsize = 0;
+	file->nStartBlock = 0;
+	fileNode(dirSlot, fileSlot)->generation = __atomic_add_fetch(&inoGeneration, 1, __ATOMIC_RELAXED);
+	if(dir->nFree > 0) {
+		dir->nFree--;
+	} else {
+		dir->blocks[fileSlot / MAX_FILES_IN_DIR]->nFiles++;
+		dir->nFiles++;
+	}
+	indexInsert(dirSlot, fileSlot);
+	writeDirectory(dirSlot, fileSlot);
+	return fileSlot;
+}
+
+//Reads from a file of a directory locked for reading. Returns the bytes
+//read or -errno.
+static int readData(int dirSlot, int fileSlot, char *buf, size_t size, off_t offset) {
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	struct cs1550_file_directory *file = dirFile(dirSlot, fileSlot);
+	size_t length;
+	int res;
+
+	pthread_rwlock_rdlock(&fnode->lock);
+	length = fileLength(file, fnode);
+	if(offset > length) {
+		res = -ENOENT;
+	} else {
+		if(offset + size > length) size = length - offset;
+		res = fileRead(file, fnode, buf, size, offset);
+		//lay the buffered writes over what is on disk
+		if(res >= 0 && fnode->dirtyLength > 0) {
+			off_t from = offset > fnode->dirtyStart ? offset : fnode->dirtyStart;
+			off_t to = fnode->dirtyStart + fnode->dirtyLength;
+			if(to > (off_t)(offset + size)) to = offset + size;
+			if(from < to)
+				memcpy(buf + (from - offset), fnode->dirty + (from - fnode->dirtyStart), to - from);
+			res = size;
+		}
+	}
+	pthread_rwlock_unlock(&fnode->lock);
+	return res;
+}
+
+//Writes to a file of a directory locked for reading, inside a journal
+//bracket. Returns the bytes written or -errno.
+static int writeData(int dirSlot, int fileSlot, const char *buf, size_t size, off_t offset) {
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	int res;
+
+	pthread_rwlock_wrlock(&fnode->lock);
+	if(offset > fileLength(dirFile(dirSlot, fileSlot), fnode)) {
+		res = -ENOENT;
+	} else if(bufferWrite(fnode, buf, size, offset) == 0) {
+		res = size;
+	} else {
+		res = flushFile(dirSlot, fileSlot);
+		if(res == 0 && bufferWrite(fnode, buf, size, offset) != 0)
+			res = writeFile(dirSlot, fileSlot, buf, NULL, size, offset);
+		if(res == 0) res = size;
+	}
+	pthread_rwlock_unlock(&fnode->lock);
+	return res;
+}
+
+//Smallest read worth handing to FUSE as pieces of the image file rather than
+//as one buffer.
+#define READ_BUF_MIN (32 << 10)
+
+//Reads from a file of a directory locked for reading into a new buffer
+//vector: pieces of the image file that FUSE can splice to the kernel when
+//the read is large and none of it is buffered, otherwise one malloc'd
+//buffer. The caller frees each buffer's mem and the vector. Only a caller
+//that sends the reply itself may take pieces, by setting splice: the
+//blocks must stay as they are until then, so it calls spliceDone once the
+//reply is sent when readDataBuf left *splice set. Without the journal a
+//freed block is reused at once, so then it always gets a copy.
+static int readDataBuf(int dirSlot, int fileSlot, struct fuse_bufvec **bufp, size_t size, off_t offset,
+	int *splice) {
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	struct cs1550_file_directory *file = dirFile(dirSlot, fileSlot);
+	struct fuse_bufvec *bufv = NULL;
+	size_t length;
+	char *mem;
+	int res = 0;
+
+	pthread_rwlock_rdlock(&fnode->lock);
+	length = fileLength(file, fnode);
+	if(offset > length) {
+		res = -ENOENT;
+	} else {
+		if(offset + size > length) size = length - offset;
+		//checksummed blocks have to be read to be checked
+		if(*splice && journalOn && size >= READ_BUF_MIN && diskFd >= 0 && sums == NULL && file->nStartBlock >= 0 && (fnode->dirtyLength == 0 ||
+			fnode->dirtyStart >= (off_t)(offset + size) || fnode->dirtyStart + (off_t)fnode->dirtyLength <= offset)) {
+			struct cs1550_extent_map loaded;
+			struct cs1550_extent_map *map = fnode->map;
+			if(map == NULL) {
+				map = &loaded;
+				res = extentMapLoad(file->nStartBlock, map);
+			}
+			//compressed chunks have to go through the cache
+			if(res == 0 && !extentMapPacked(map, offset, size)) bufv = extentMapBufs(map, size, offset);
+			if(map == &loaded) extentMapFree(&loaded);
+			//before the lock goes, so a truncate that frees the blocks comes after
+			if(bufv != NULL) __atomic_add_fetch(&nSplicing, 1, __ATOMIC_RELAXED);
+		}
+	}
+	pthread_rwlock_unlock(&fnode->lock);
+	*splice = bufv != NULL;
+	if(res != 0 || bufv != NULL) {
+		*bufp = bufv;
+		return res;
+	}
+
+	mem = malloc(size > 0 ? size : 1);
+	bufv = malloc(sizeof(struct fuse_bufvec));
+	if(mem == NULL || bufv == NULL) {
+		free(mem);
+		free(bufv);
+		return -ENOMEM;
+	}
+	res = readData(dirSlot, fileSlot, mem, size, offset);
+	if(res < 0) {
+		free(mem);
+		free(bufv);
+		return res;
+	}
+	*bufv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(res);
+	bufv->buf[0].mem = mem;
+	*bufp = bufv;
+	return 0;
+}
+
+//Called once the reply to a readDataBuf that left splice set is sent.
+static void spliceDone() {
+	__atomic_sub_fetch(&nSplicing, 1, __ATOMIC_RELAXED);
+}
+
+//Writes the FUSE buffers in src to a file of a directory locked for
+//reading, inside a journal bracket. A pipe is spliced into the file's
+//write-back buffer, or straight onto its blocks when the write cannot be
+//buffered. Returns the bytes written or -errno.
+static int writeDataBuf(int dirSlot, int fileSlot, struct fuse_bufvec *src, off_t offset) {
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	size_t size = fuse_buf_size(src);
+	char *dirty;
+	int res;
+
+	if(src->count - src->idx == 1 && !(src->buf[src->idx].flags & FUSE_BUF_IS_FD))
+		return writeData(dirSlot, fileSlot, (char *)src->buf[src->idx].mem + src->off, size, offset);
+
+	pthread_rwlock_wrlock(&fnode->lock);
+	if(offset > fileLength(dirFile(dirSlot, fileSlot), fnode)) {
+		res = -ENOENT;
+	} else {
+		off_t oldStart = fnode->dirtyStart;
+		size_t oldLength = fnode->dirtyLength;
+		res = 0;
+		dirty = bufferReserve(fnode, size, offset);
+		if(dirty == NULL) {
+			res = flushFile(dirSlot, fileSlot);
+			oldLength = 0;
+			if(res == 0) dirty = bufferReserve(fnode, size, offset);
+		}
+		if(res == 0 && dirty != NULL) {
+			struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+			ssize_t n;
+			dst.buf[0].mem = dirty;
+			n = fuse_buf_copy(&dst, src, 0);
+			if(n != (ssize_t)size) {
+				//forget the half-copied write
+				__atomic_sub_fetch(&dirtyBytes, fnode->dirtyLength - oldLength, __ATOMIC_RELAXED);
+				fnode->dirtyStart = oldStart;
+				fnode->dirtyLength = oldLength;
+				res = n < 0 ? n : -EIO;
+			}
+		} else if(res == 0) {
+			res = writeFile(dirSlot, fileSlot, NULL, src, size, offset);
+		}
+		if(res == 0) res = size;
+	}
+	pthread_rwlock_unlock(&fnode->lock);
+	return res;
+}
+
+//Sets the size of a file of a directory locked for reading, inside a
+//journal bracket. Growing fills with zeros; shrinking frees the blocks past
+//the new end. Returns 0 or -errno.
+static int truncateSlot(int dirSlot, int fileSlot, off_t size) {
+	static const char zeros[64 << 10];
+	struct cs1550_dir_node *node = dirNodes[dirSlot];
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	struct cs1550_file_directory *entry = dirFile(dirSlot, fileSlot);
+	int res;
+
+	pthread_rwlock_wrlock(&fnode->lock);
+	res = flushFile(dirSlot, fileSlot);
+	while(res == 0 && (off_t)entry->fsize < size) {
+		size_t n = size - entry->fsize < sizeof(zeros) ? size - entry->fsize : sizeof(zeros);
+		res = writeFile(dirSlot, fileSlot, zeros, NULL, n, entry->fsize);
+	}
+	if(res == 0 && size < (off_t)entry->fsize && entry->nStartBlock < 0) {
+		long have = tailUnits(entry->fsize);
+		long keep = tailUnits(size);
+
+		pthread_mutex_lock(&node->blockLock);
+		if(keep < have) tailFree(dirCache[dirSlot], -entry->nStartBlock + keep * TAIL_UNIT, have - keep);
+		entry->fsize = size;
+		if(size == 0) entry->nStartBlock = 0;
+		writeDirectory(dirSlot, fileSlot);
+		pthread_mutex_unlock(&node->blockLock);
+	} else if(res == 0 && size < (off_t)entry->fsize) {
+		struct cs1550_file_directory file = *entry;
+		struct cs1550_extent_map loaded, dead;
+		struct cs1550_extent_map *map = fnode->map != NULL ? fnode->map : &loaded;
+		long location = 0;
+
+		memset(&dead, 0, sizeof(struct cs1550_extent_map));
+		if(map == &loaded) res = extentMapLoad(file.nStartBlock, map);
+		//a compressed chunk the new end falls in is stored plain, to be cut
+		if(res == 0 && size % CHUNK_BYTES != 0 && extentMapPacked(map, size, 1)) {
+			char *image = malloc(CHUNK_BYTES);
+			res = image == NULL ? -ENOMEM : extentMapIO(map, image, CHUNK_BYTES, size - size % CHUNK_BYTES, 0);
+			if(res == 0) res = chunkStore(map, size / CHUNK_BYTES, image, 0, 0, &dead);
+			if(res > 0) res = 0;
+			free(image);
+		}
+		//the rest of the last block reads as zeros if the file grows again
+		if(res == 0 && size % BLOCK_SIZE != 0)
+			res = dedupUnshare(map, size, BLOCK_SIZE - size % BLOCK_SIZE, 0, &dead);
+		if(res >= 0 && size % BLOCK_SIZE != 0)
+			res = extentMapIO(map, (char *)zeros, BLOCK_SIZE - size % BLOCK_SIZE, size, 1);
+		if(res == 0) {
+			extentMapTrim(map, (size + BLOCK_SIZE - 1) / BLOCK_SIZE, 0);
+			location = extentMapStore(map, 0);
+			if(location < 0) res = location;
+		}
+		if(res == 0) chunkFree(&dead);
+		else extentMapFree(&dead);
+		if(map == &loaded) {
+			extentMapFree(&loaded);
+		} else if(res != 0) {
+			extentMapFree(map);
+			free(map);
+			fnode->map = NULL;
+		}
+		if(res == 0) {
+			pthread_mutex_lock(&node->blockLock);
+			entry->fsize = size;
+			entry->nStartBlock = location;
+			writeDirectory(dirSlot, fileSlot);
+			pthread_mutex_unlock(&node->blockLock);
+		}
+		__atomic_store_n(&fnode->nextRead, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&fnode->readAhead, 0, __ATOMIC_RELAXED);
+	}
+	pthread_rwlock_unlock(&fnode->lock);
+	return res;
+}
+
+//Removes a file from a directory locked for writing, inside a journal
+//bracket. Its blocks are freed now, or at its last release while it is
+//still open.
+static void removeFile(int dirSlot, int fileSlot) {
+	struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+	struct cs1550_file_directory *file = dirFile(dirSlot, fileSlot);
+
+	indexRemove(dirSlot, fileSlot);
+	pthread_rwlock_wrlock(&fnode->lock);
+	file->fname[0] = '\0';
+	file->fext[0] = '\0';
+	if(fnode->nOpen > 0) {
+		__atomic_store_n(&fnode->unlinked, 1, __ATOMIC_RELAXED);
+		writeDirectory(dirSlot, fileSlot);
+	} else {
+		freeSlot(dirSlot, fileSlot);
+	}
+	pthread_rwlock_unlock(&fnode->lock);
+}
+
+//Removes an empty directory from the root and frees its blocks. Returns 0
+//or -errno.
+static int removeDir(const char *directory) {
+	cs1550_root_directory *root = readDisk();
+	struct cs1550_dir_cache *dir = NULL;
+	struct cs1550_dir_node *node = NULL;
+	int dirSlot, j;
+	int res = 0;
+
+	journalBegin();
+	pthread_rwlock_wrlock(&rootLock);
+	dirSlot = findDir(directory);
+	if(dirSlot < 0) {
+		res = -ENOENT;
+	} else {
+		dir = dirCache[dirSlot];
+		node = dirNodes[dirSlot];
+		//no new lockers can queue behind rootLock, so this waits out the
+		//handlers already inside
+		pthread_rwlock_wrlock(&node->lock);
+		for(j = 0 ; j < dir->nFiles && res == 0 ; j++) {
+			if(dirFile(dirSlot, j)->fname[0] != '\0') res = -ENOTEMPTY;
+			//a removed file that is still open, or could not be freed
+			else if(dirFile(dirSlot, j)->nStartBlock != 0 || fileNode(dirSlot, j)->nOpen > 0) res = -EBUSY;
+		}
+		if(res == 0 && super.version >= 3) {
+			struct cs1550_extent_map map;
+			res = extentMapLoad(root->directories[dirSlot].nStartBlock, &map);
+			if(res == 0) extentMapTrim(&map, 0, 1);
+			extentMapFree(&map);
+		} else if(res == 0) {
+			freeBlocks(root->directories[dirSlot].nStartBlock / BLOCK_SIZE, 1, 1);
+		}
+		if(res == 0) {
+			indexRemove(dirSlot, -1);
+			memset(&root->directories[dirSlot], 0, sizeof(root->directories[dirSlot]));
+			root->nDirectories = root->nDirectories - 1;
+			writeRoot();
+			dirCache[dirSlot] = NULL;
+			dirNodes[dirSlot] = NULL;
+		}
+		pthread_rwlock_unlock(&node->lock);
+		if(res == 0) {
+			freeDirCache(dir);
+			freeDirNode(node);
+		}
+	}
+	pthread_rwlock_unlock(&rootLock);
+	journalEnd();
+	return res;
+}
+
+//Frees the files that were removed while open when the filesystem went
+//down, at mount.
+static void reclaimOrphans() {
+	int i, j;
+	journalBegin();
+	for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
+		if(dirCache[i] == NULL) continue;
+		for(j = 0 ; j < dirFiles(i) ; j++) {
+			if(dirFile(i, j)->fname[0] == '\0' && dirFile(i, j)->nStartBlock != 0)
+				freeSlot(i, j);
+		}
+	}
+	journalEnd();
+}
+
+//The /.stats file. Its text is taken once at open, so a reader sees one
+//consistent snapshot however it splits its reads.
+
+static unsigned long statsLoad(const unsigned long *counter) {
+	return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+//Upper bound in ns of the histogram bucket holding the q-th percentile, or
+//the slowest call if that was faster.
+static unsigned long statsPercentile(const struct cs1550_op_stats *o, int q) {
+	unsigned long seen = 0;
+	int k;
+	for(k = 0 ; k < STATS_BUCKETS - 1 ; k++) {
+		seen += o->hist[k];
+		if(seen * 100 >= o->calls * q) break;
+	}
+	return (2UL << k) < o->maxNanos ? 2UL << k : o->maxNanos;
+}
+
+//Adds up every thread's counts and renders them, one "name value" line per
+//counter and one line per handler that was called. Returns a malloc'd
+//buffer, or NULL when out of memory.
+static char *statsRender(size_t *size) {
+	struct cs1550_op_stats ops[STAT_OPS];
+	unsigned long counters[STAT_COUNTERS];
+	struct cs1550_cache_counters cache;
+	struct cs1550_stats *s;
+	char *text = NULL;
+	FILE *out;
+	long since;
+	int i, k;
+
+	memset(ops, 0, sizeof(ops));
+	memset(counters, 0, sizeof(counters));
+	pthread_mutex_lock(&statsLock);
+	since = statsSince;
+	for(s = allStats ; s != NULL ; s = s->next) {
+		if(__atomic_load_n(&s->epoch, __ATOMIC_ACQUIRE) != statsEpoch) continue;
+		for(i = 0 ; i < STAT_OPS ; i++) {
+			unsigned long maxNanos = statsLoad(&s->ops[i].maxNanos);
+			ops[i].calls += statsLoad(&s->ops[i].calls);
+			ops[i].errors += statsLoad(&s->ops[i].errors);
+			ops[i].nanos += statsLoad(&s->ops[i].nanos);
+			if(maxNanos > ops[i].maxNanos) ops[i].maxNanos = maxNanos;
+			for(k = 0 ; k < STATS_BUCKETS ; k++)
+				ops[i].hist[k] += statsLoad(&s->ops[i].hist[k]);
+		}
+		for(i = 0 ; i < STAT_COUNTERS ; i++)
+			counters[i] += statsLoad(&s->counters[i]);
+	}
+	pthread_mutex_unlock(&statsLock);
+	cacheCounters(&cache);
+
+	out = open_memstream(&text, size);
+	if(out == NULL) return NULL;
+	fprintf(out, "since_reset_s %.3f\n", (statsNow() - since) / 1e9);
+	for(i = 0 ; i < STAT_OPS ; i++) {
+		struct cs1550_op_stats *o = &ops[i];
+		const char *sep = "";
+		if(o->calls == 0) continue;
+		fprintf(out, "op %s calls=%lu errors=%lu avg_us=%.1f p50_us=%.1f p99_us=%.1f max_us=%.1f hist_ns=",
+			statOpNames[i], o->calls, o->errors, o->nanos / 1e3 / o->calls,
+			statsPercentile(o, 50) / 1e3, statsPercentile(o, 99) / 1e3, o->maxNanos / 1e3);
+		//bucket upper bound:calls
+		for(k = 0 ; k < STATS_BUCKETS ; k++) {
+			if(o->hist[k] == 0) continue;
+			fprintf(out, "%s%lu:%lu", sep, 2UL << k, o->hist[k]);
+			sep = ",";
+		}
+		fprintf(out, "\n");
+	}
+	for(i = 0 ; i < STAT_COUNTERS ; i++)
+		fprintf(out, "%s %lu\n", statCounterNames[i], counters[i]);
+	fprintf(out, "cache_hits %lu\ncache_misses %lu\ncache_ghost_hits %lu\ncache_prefetched %lu\ncache_prefetch_hits %lu\n",
+		cache.hits, cache.misses, cache.ghostHits, cache.prefetched, cache.prefetchHits);
+	if(fclose(out) != 0) {
+		free(text);
+		return NULL;
+	}
+	return text;
+}
+
+//Starts every count over. Threads clear their own slabs when they next
+//record something; until then statsRender skips them.
+static void statsReset() {
+	pthread_mutex_lock(&statsLock);
+	__atomic_store_n(&statsEpoch, statsEpoch + 1, __ATOMIC_RELEASE);
+	statsSince = statsNow();
+	pthread_mutex_unlock(&statsLock);
+	cacheResetCounters();
+}
+
+static void statsAttr(struct stat *stbuf) {
+	size_t size = 0;
+	free(statsRender(&size));
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_mode = S_IFREG | 0644;
+	stbuf->st_nlink = 1;
+	stbuf->st_size = size;
+}
+
+//Snapshots /.stats into a new handle in fi. Reads skip the page cache, as
+//the text changes size between opens.
+static int statsOpen(struct fuse_file_info *fi) {
+	struct cs1550_handle *handle = malloc(sizeof(struct cs1550_handle));
+	if(handle == NULL) return -ENOMEM;
+	handle->dirSlot = -1;
+	handle->fileSlot = -1;
+	handle->stats = statsRender(&handle->statsSize);
+	if(handle->stats == NULL) {
+		free(handle);
+		return -ENOMEM;
+	}
+	fi->direct_io = 1;
+	fi->fh = (uintptr_t)handle;
+	return 0;
+}
+
+static int statsRead(struct cs1550_handle *handle, char *buf, size_t size, off_t offset) {
+	if(offset >= (off_t)handle->statsSize) return 0;
+	if(size > handle->statsSize - offset) size = handle->statsSize - offset;
+	memcpy(buf, handle->stats + offset, size);
+	return size;
+}
+
+static int statsReadBuf(struct cs1550_handle *handle, struct fuse_bufvec **bufp, size_t size, off_t offset) {
+	struct fuse_bufvec *bufv = malloc(sizeof(struct fuse_bufvec));
+	char *mem = malloc(size > 0 ? size : 1);
+	if(bufv == NULL || mem == NULL) {
+		free(bufv);
+		free(mem);
+		return -ENOMEM;
+	}
+	*bufv = (struct fuse_bufvec)FUSE_BUFVEC_INIT(statsRead(handle, mem, size, offset));
+	bufv->buf[0].mem = mem;
+	*bufp = bufv;
+	return 0;
+}
+
+static void statsClose(struct cs1550_handle *handle) {
+	free(handle->stats);
+	free(handle);
+}
+
+static int isContainDir(char *directory) {
+	int dirSlot;
+	pthread_rwlock_rdlock(&rootLock);
+	dirSlot = findDir(directory);
+	pthread_rwlock_unlock(&rootLock);
+	return dirSlot >= 0;
+}
+
+//Size of the file, or -1 if it does not exist.
+static long getFileSize(char* directory, char* filename, char* extension) {
+	int dirSlot = lockDir(directory, 0);
+	int fileSlot;
+	long size = -1;
+	if(dirSlot < 0) return -1;
+	fileSlot = findFile(dirSlot, filename, extension);
+	if(fileSlot >= 0) {
+		struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+		pthread_rwlock_rdlock(&fnode->lock);
+		size = fileLength(dirFile(dirSlot, fileSlot), fnode);
+		pthread_rwlock_unlock(&fnode->lock);
+	}
+	unlockDir(dirSlot);
+	return size;
+}
+/*
+ * Called whenever the system wants to know the file attributes, including
+ * simply whether the file exists or not.
+ *
+ * man -s 2 stat will show the fields of a stat structure
+ */
+static int cs1550_getattr(const char *path, struct stat *stbuf)
+{
+
+	// printf("---Call function getattr---\n");
+
+	int res = 0;
+	long size;
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	tokenPath(path, directory, filename, extension);
+
+	// printf("---Dir: %s File: %s Ext: %s---\n", directory, filename, extension);
+	// printf("---Dir: %d File: %d Ext: %d---\n", (int)strlen(directory), (int)strlen(filename), (int)strlen(extension));
+
+	memset(stbuf, 0, sizeof(struct stat));
+
+	//is path the root dir?
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else if(strcmp(path, STATS_PATH) == 0) {
+		statsAttr(stbuf);
+	} else {
+		if(isContainDir(directory) == 1 && strlen(filename) == 0 && strlen(extension) == 0) {  //Check if name is subdirectory
+			//Might want to return a structure with these fields
+			stbuf->st_mode = S_IFDIR | 0755;
+			stbuf->st_nlink = 2;
+		} else if(strlen(filename) != 0 && (size = getFileSize(directory, filename, extension)) >= 0)  {	//Check if name is a regular file
+			//regular file, probably want to be read and write
+			stbuf->st_mode = S_IFREG | 0666;
+			stbuf->st_nlink = 1; //file links
+			stbuf->st_size = size; //file size - make sure you replace with real size!
+		} else {  //Else return that path doesn't exist
+			res = -ENOENT;
+		}
+	}
+	return res;
+}
+
+/*
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ */
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
+			 off_t offset, struct fuse_file_info *fi)
+{
+	// printf("---Call function readdir---\n");
+	//Since we're building with -Wall (all warnings reported) we need
+	//to "use" every parameter, so let's just cast them to void to
+	//satisfy the compiler
+	(void) fi;
+
+	cs1550_root_directory *root = readDisk();
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	tokenPath(path, directory, filename, extension);
+
+	//This line assumes we have no subdirectories, need to change
+	// if (strcmp(path, "/") != 0)
+	// 	return -ENOENT;
+
+	//Entries are numbered as in the inode-based readdir: . and .. are 0 and
+	//1, then come the slots. Each one is passed with the number of the next,
+	//so a listing that fills the buffer carries on where it stopped instead
+	//of being built whole.
+	if(offset < 1 && filler(buf, ".", NULL, 1) != 0) return 0;
+	if(offset < 2 && filler(buf, "..", NULL, 2) != 0) return 0;
+
+	if (strcmp(path, "/") == 0) {
+		long i;
+		pthread_rwlock_rdlock(&rootLock);
+		for(i = offset > 2 ? offset - 2 : 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
+			if(strcmp(root->directories[i].dname, "") != 0) {
+				if(filler(buf, root->directories[i].dname, NULL, i + 3) != 0) break;
+			}
+		}
+		pthread_rwlock_unlock(&rootLock);
+		if(i == MAX_DIRS_IN_ROOT) filler(buf, STATS_NAME, NULL, i + 3);
+		return 0;
+	} else {
+		int dirSlot = lockDir(directory, 0);
+		long j;
+
+		if(dirSlot >= 0) {
+			for(j = offset > 2 ? offset - 2 : 0 ; j < dirFiles(dirSlot) ; j++) {
+				struct cs1550_file_directory *file = dirFile(dirSlot, j);
+				char result[MAX_FILENAME + MAX_EXTENSION + 2];
+				if(file->fname[0] == '\0') continue;	//a removed file's slot
+				strcpy(result, file->fname);
+				if(strcmp(file->fext, "") != 0) {
+					strcat(result, ".");
+					strcat(result, file->fext);
+				}
+				if(filler(buf, result, NULL, j + 3) != 0) break;
+			}
+			unlockDir(dirSlot);
+		}
+	}
+	/*
+	//add the user stuff (subdirs or files)
+	//the +1 skips the leading '/' on the filenames
+	filler(buf, newpath + 1, NULL, 0);
+	*/
+	return 0;
+}
+
+/*
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+	// printf("---Call function mkdir---\n");
+	(void) path;
+	(void) mode;
+
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	tokenPath(path, directory, filename, extension);
+
+	int res = 0;
+
+	if(strlen(directory) > MAX_FILENAME) {
+		return -ENAMETOOLONG;
+	} else if (strlen(directory) == 0 || strlen(filename) != 0) {
+		return -EPERM;
+	}
+	res = makeDir(directory);
+	return res < 0 ? res : 0;
+}
+
+/*
+ * Removes a directory. Only empty ones can go.
+ */
+static int cs1550_rmdir(const char *path)
+{
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	tokenPath(path, directory, filename, extension);
+
+	if(strcmp(path, STATS_PATH) == 0 || strlen(filename) != 0) {
+		return -ENOTDIR;
+	} else if(strlen(directory) == 0) {
+		return -EBUSY;
+	}
+	return removeDir(directory);
+}
+
+/*
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ *
+ */
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+{
+	// printf("---Call function mknod---\n");
+	(void) mode;
+	(void) dev;
+
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	tokenPath(path, directory, filename, extension);
+
+	int res = 0;
+
+	if(strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) {
+		return -ENAMETOOLONG;
+	} else if (strlen(directory) == 0) {
+		return -EPERM;
+	} else {
+		journalBegin();
+		int dirSlot = lockDir(directory, 1);
+		if(dirSlot < 0) {
+			journalEnd();
+			return -ENOENT;
+		}
+		res = makeFile(dirSlot, filename, extension);
+		if(res > 0) res = 0;
+		unlockDir(dirSlot);
+		journalEnd();
+	}
+
+	return res;
+}
+
+/*
+ * Deletes a file. A file that is still open keeps its blocks until it is
+ * released.
+ */
+static int cs1550_unlink(const char *path)
+{
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	int dirSlot, fileSlot;
+	int res = 0;
+
+	tokenPath(path, directory, filename, extension);
+
+	if(strcmp(path, STATS_PATH) == 0) {
+		return -EACCES;
+	} else if(strlen(filename) == 0) {
+		return strlen(directory) == 0 || isContainDir(directory) ? -EISDIR : -ENOENT;
+	}
+	journalBegin();
+	dirSlot = lockDir(directory, 1);
+	if(dirSlot < 0) {
+		res = -ENOENT;
+	} else {
+		fileSlot = findFile(dirSlot, filename, extension);
+		if(fileSlot >= 0) removeFile(dirSlot, fileSlot);
+		else res = -ENOENT;
+		unlockDir(dirSlot);
+	}
+	journalEnd();
+	return res;
+}
+
+/*
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	// printf("---Call function read---\n");
+	(void) buf;
+	(void) offset;
+	(void) fi;
+	(void) path;
+
+	//check to make sure path exists
+	//check that size is > 0
+	//check that offset is <= to the file size
+	//read in data
+	//set size and return, or error
+	// size = 0;
+	if(size <= 0) return -ENOENT;
+
+	struct cs1550_handle *handle = fileHandle(fi);
+	if(handle != NULL && handle->stats != NULL) return statsRead(handle, buf, size, offset);
+	if(handle != NULL) {
+		int res;
+		lockHandle(handle);
+		res = readData(handle->dirSlot, handle->fileSlot, buf, size, offset);
+		unlockDir(handle->dirSlot);
+		return res;
+	}
+
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	tokenPath(path, directory, filename, extension);
+
+	if(strlen(directory) == 0) {
+		return -EPERM;
+	} else {
+		if(strlen(filename) == 0) {
+			return -EPERM;
+		} else if(strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) {
+			return -ENAMETOOLONG;
+		} else {
+			int dirSlot = lockDir(directory, 0);
+			int fileSlot;
+			int res = 0;
+			if(dirSlot < 0) return -EPERM;
+			fileSlot = findFile(dirSlot, filename, extension);
+			if(fileSlot >= 0)
+				res = readData(dirSlot, fileSlot, buf, size, offset);
+			unlockDir(dirSlot);
+			return res;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write size bytes from buf into file starting from offset
+ *
+ */
+static int cs1550_write(const char *path, const char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	// printf("---Call function write---\n");
+	(void) buf;
+	(void) offset;
+	(void) fi;
+	(void) path;
+
+	//check to make sure path exists
+	//check that size is > 0
+	//check that offset is <= to the file size
+	//write data
+	//set size (should be same as input) and return, or error
+	if(size <= 0) return -ENOENT;
+
+	struct cs1550_handle *handle = fileHandle(fi);
+	if(handle != NULL && handle->stats != NULL) {
+		//any write to /.stats resets it
+		statsReset();
+		return size;
+	}
+	if(handle != NULL) {
+		int res;
+		journalBegin();
+		lockHandle(handle);
+		res = writeData(handle->dirSlot, handle->fileSlot, buf, size, offset);
+		unlockDir(handle->dirSlot);
+		journalEnd();
+		return res;
+	}
+
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+
+	tokenPath(path, directory, filename, extension);
+
+	if(strlen(directory) == 0) {
+		return -EPERM;
+	} else {
+		if(strlen(filename) == 0) {
+			return -EPERM;
+		} else if(strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) {
+			return -ENAMETOOLONG;
+		} else {
+			journalBegin();
+			int dirSlot = lockDir(directory, 0);	// find the directory in root
+			int i;
+			int res = 0;
+			if(dirSlot < 0) {
+				journalEnd();
+				return -EPERM;
+			}
+			i = findFile(dirSlot, filename, extension);
+			if(i >= 0)
+				res = writeData(dirSlot, i, buf, size, offset);
+			unlockDir(dirSlot);
+			journalEnd();
+			return res;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Read size bytes from file starting from offset into a buffer vector. FUSE
+ * replies after this returns, when a truncate may have freed the blocks, so
+ * the data is always copied
+ */
+static int cs1550_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	struct cs1550_handle *handle = fileHandle(fi);
+	int dirSlot, fileSlot;
+	int splice = 0;
+	int res = -ENOENT;
+
+	if(size <= 0) return -ENOENT;
+	if(handle != NULL && handle->stats != NULL) return statsReadBuf(handle, bufp, size, offset);
+	if(handle != NULL) {
+		lockHandle(handle);
+		res = readDataBuf(handle->dirSlot, handle->fileSlot, bufp, size, offset, &splice);
+		unlockDir(handle->dirSlot);
+		return res;
+	}
+
+	tokenPath(path, directory, filename, extension);
+	if(strlen(directory) == 0 || strlen(filename) == 0) return -EPERM;
+	if(strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) return -ENAMETOOLONG;
+	dirSlot = lockDir(directory, 0);
+	if(dirSlot < 0) return -EPERM;
+	fileSlot = findFile(dirSlot, filename, extension);
+	if(fileSlot >= 0)
+		res = readDataBuf(dirSlot, fileSlot, bufp, size, offset, &splice);
+	unlockDir(dirSlot);
+	return res;
+}
+
+/*
+ * Write the buffer vector into file starting from offset, splicing it into
+ * the image when FUSE hands over a pipe
+ */
+static int cs1550_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	struct cs1550_handle *handle = fileHandle(fi);
+	int dirSlot, fileSlot;
+	int res = 0;
+
+	if(fuse_buf_size(buf) <= 0) return -ENOENT;
+	if(handle != NULL && handle->stats != NULL) {
+		statsReset();
+		return fuse_buf_size(buf);
+	}
+	if(handle != NULL) {
+		journalBegin();
+		lockHandle(handle);
+		res = writeDataBuf(handle->dirSlot, handle->fileSlot, buf, offset);
+		unlockDir(handle->dirSlot);
+		journalEnd();
+		return res;
+	}
+
+	tokenPath(path, directory, filename, extension);
+	if(strlen(directory) == 0 || strlen(filename) == 0) return -EPERM;
+	if(strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) return -ENAMETOOLONG;
+	journalBegin();
+	dirSlot = lockDir(directory, 0);
+	if(dirSlot < 0) {
+		journalEnd();
+		return -EPERM;
+	}
+	fileSlot = findFile(dirSlot, filename, extension);
+	if(fileSlot >= 0)
+		res = writeDataBuf(dirSlot, fileSlot, buf, offset);
+	unlockDir(dirSlot);
+	journalEnd();
+	return res;
+}
+
+/******************************************************************************
+ *
+ *  DO NOT MODIFY ANYTHING BELOW THIS LINE
+ *
+ *****************************************************************************/
+
 /*
- * Read size bytes from file into buf starting from offset
+ * truncate is called when a new file is created (with a 0 size) or when an
+ * existing file is made shorter or longer. Blocks past the new end are
+ * freed; a longer file reads as zeros up to its new size.
  *
  */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset,
+static int cs1550_truncate(const char *path, off_t size)
+{
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	int dirSlot, fileSlot;
+	int res;
+
+	tokenPath(path, directory, filename, extension);
+
+	if(strcmp(path, STATS_PATH) == 0) {
+		return -EACCES;
+	} else if(strlen(filename) == 0) {
+		return strlen(directory) == 0 || isContainDir(directory) ? -EISDIR : -ENOENT;
+	} else if(size < 0) {
+		return -EINVAL;
+	}
+	journalBegin();
+	dirSlot = lockDir(directory, 0);
+	if(dirSlot < 0) {
+		res = -ENOENT;
+	} else {
+		fileSlot = findFile(dirSlot, filename, extension);
+		res = fileSlot >= 0 ? truncateSlot(dirSlot, fileSlot, size) : -ENOENT;
+		unlockDir(dirSlot);
+	}
+	journalEnd();
+	return res;
+}
+
+
+/*
+ * Called when we open a file. Resolves it once and leaves a handle in fi for
+ * the read, write, flush, fsync and release calls that follow.
+ */
+static int cs1550_open(const char *path, struct fuse_file_info *fi)
+{
+	char directory[MAX_FILENAME + 1];
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	struct cs1550_handle *handle;
+	int dirSlot, fileSlot;
+
+	if(strcmp(path, STATS_PATH) == 0) return statsOpen(fi);
+	tokenPath(path, directory, filename, extension);
+
+	dirSlot = lockDir(directory, 0);
+	if(dirSlot < 0) return -ENOENT;
+	fileSlot = findFile(dirSlot, filename, extension);
+	if(fileSlot < 0) {
+		unlockDir(dirSlot);
+		return strlen(filename) == 0 ? -EISDIR : -ENOENT;
+	}
+	handle = malloc(sizeof(struct cs1550_handle));
+	if(handle == NULL) {
+		unlockDir(dirSlot);
+		return -ENOMEM;
+	}
+	handle->dirSlot = dirSlot;
+	handle->fileSlot = fileSlot;
+	handle->stats = NULL;
+	openSlot(dirSlot, fileSlot);
+	unlockDir(dirSlot);
+
+    /* We're not going to worry about permissions for this project, but
+	   if we were and we don't have them to the file we should return an error
+
+        return -EACCES;
+    */
+
+	fi->fh = (uintptr_t)handle;
+    return 0; //success!
+}
+
+/*
+ * Called when close is called on a file descriptor, but because it might
+ * have been dup'ed, this isn't a guarantee we won't ever need the file
+ * again. Writes out the file's buffered writes and starts writeback of
+ * the image.
+ */
+static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+{
+	struct cs1550_handle *handle = fileHandle(fi);
+	if(handle != NULL && handle->stats != NULL) return 0;
+	int res = handle != NULL ? flushHandle(handle, 0) : flushPath(path, 0);
+	//start writeback of a mapped image without waiting on it
+	if(res == 0) res = syncImage(0);
+	return res;
+}
+
+/*
+ * Called on fsync(2). Waits until the image file holds everything written.
+ */
+static int cs1550_fsync(const char *path, int datasync, struct fuse_file_info *fi)
+{
+	(void) datasync;
+
+	struct cs1550_handle *handle = fileHandle(fi);
+	if(handle != NULL && handle->stats != NULL) return 0;
+	int res = handle != NULL ? flushHandle(handle, 0) : flushPath(path, 0);
+	if(res == 0) res = syncImage(1);
+	return res;
+}
+
+/*
+ * Called when the last descriptor of an open file is closed. Writes out
+ * what is still buffered and frees the handle; the file's last release also
+ * frees its buffer.
+ */
+static int cs1550_release(const char *path, struct fuse_file_info *fi)
+{
+	struct cs1550_handle *handle = fileHandle(fi);
+	int res;
+
+	if(handle == NULL) return flushPath(path, 1);
+	if(handle->stats != NULL) {
+		statsClose(handle);
+		fi->fh = 0;
+		return 0;
+	}
+	res = flushHandle(handle, 1);
+	free(handle);
+	fi->fh = 0;
+	return res;
+}
+
+//Why the image could not be mounted. FUSE serves the mount point anyway, so
+//the handlers fail every request with -EIO rather than touch what is not
+//loaded.
+static int mountError = 0;
+
+/*
+ * Called once when the filesystem is mounted. Opens the block device that
+ * every other handler reads and writes through, replays the journal, loads
+ * the metadata cache, builds the name index and frees the files that were
+ * removed while open. On failure it leaves mountError set.
+ */
+static void *cs1550_init(struct fuse_conn_info *conn)
+{
+	(void) conn;
+
+	mountError = 0;
+	statsReset();
+	crcInit();
+	int res = devOpen(diskPath);
+	if(res == 0)
+		ioOpen();
+	if(res == 0)
+		res = cacheInit();
+	if(res == 0)
+		res = loadSuperblock();
+	if(res == 0)
+		res = journalOpen();
+	if(res == 0)
+		res = sumLoad();
+	if(res == 0)
+		res = bitmapLoad();
+	if(res == 0)
+		res = dedupLoad();
+	if(res == 0)
+		res = loadMetadata();
+	if(res == 0)
+		res = indexBuild();
+	if(res == 0)
+		reclaimOrphans();
+	if(res != 0) {
+		fprintf(stderr, "cs1550: cannot mount %s: %s\n", diskPath, strerror(-res));
+		mountError = res;
+	}
+
+	return NULL;
+}
+
+/*
+ * Called on unmount. Writes out buffered data and closes the block device.
+ */
+static void cs1550_destroy(void *private_data)
+{
+	(void) private_data;
+
+	flushAll();
+	journalClose();
+	freeRelease(-1);
+	bitmapStore();
+	dedupStore();
+	sumStore();
+	bitmapFree();
+	dedupFree();
+	sumFree();
+	indexFree();
+	unloadMetadata();
+	if(options.cacheStats && cacheShards != NULL) cacheReport(stderr);
+	cacheFree();
+	ioClose();
+	devClose();
+}
+
+//Every handler is registered through a wrapper that times it for /.stats,
+//and that fails it with -EIO when the image could not be mounted.
+#define STATS_TIMED(name, op, params, args) \
+static int timed_##name params \
+{ \
+	long start = statsStart(); \
+	int res = mountError != 0 ? -EIO : cs1550_##name args; \
+	statsEnd(op, start, res); \
+	return res; \
+}
+
+STATS_TIMED(getattr, STAT_GETATTR, (const char *path, struct stat *stbuf), (path, stbuf))
+STATS_TIMED(readdir, STAT_READDIR, (const char *path, void *buf, fuse_fill_dir_t filler, off_t offset,
+	struct fuse_file_info *fi), (path, buf, filler, offset, fi))
+STATS_TIMED(mkdir, STAT_MKDIR, (const char *path, mode_t mode), (path, mode))
+STATS_TIMED(rmdir, STAT_RMDIR, (const char *path), (path))
+STATS_TIMED(mknod, STAT_MKNOD, (const char *path, mode_t mode, dev_t dev), (path, mode, dev))
+STATS_TIMED(unlink, STAT_UNLINK, (const char *path), (path))
+STATS_TIMED(truncate, STAT_TRUNCATE, (const char *path, off_t size), (path, size))
+STATS_TIMED(open, STAT_OPEN, (const char *path, struct fuse_file_info *fi), (path, fi))
+STATS_TIMED(read, STAT_READ, (const char *path, char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi), (path, buf, size, offset, fi))
+STATS_TIMED(write, STAT_WRITE, (const char *path, const char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi), (path, buf, size, offset, fi))
+STATS_TIMED(read_buf, STAT_READ_BUF, (const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+	struct fuse_file_info *fi), (path, bufp, size, offset, fi))
+STATS_TIMED(write_buf, STAT_WRITE_BUF, (const char *path, struct fuse_bufvec *buf, off_t offset,
+	struct fuse_file_info *fi), (path, buf, offset, fi))
+STATS_TIMED(flush, STAT_FLUSH, (const char *path, struct fuse_file_info *fi), (path, fi))
+STATS_TIMED(fsync, STAT_FSYNC, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+STATS_TIMED(release, STAT_RELEASE, (const char *path, struct fuse_file_info *fi), (path, fi))
+
+//register our new functions as the implementations of the syscalls
+static struct fuse_operations hello_oper = {
+    .getattr	= timed_getattr,
+    .readdir	= timed_readdir,
+    .mkdir	= timed_mkdir,
+	.rmdir = timed_rmdir,
+    .read	= timed_read,
+    .write	= timed_write,
+	.read_buf	= timed_read_buf,
+	.write_buf	= timed_write_buf,
+	.mknod	= timed_mknod,
+	.unlink = timed_unlink,
+	.truncate = timed_truncate,
+	.flush = timed_flush,
+	.fsync = timed_fsync,
+	.release = timed_release,
+	.open	= timed_open,
+	.init	= cs1550_init,
+	.destroy = cs1550_destroy,
+};
+
+//Inode-based backend (-o lowlevel). Inode numbers are made of the directory
+//and file slots, so a name is resolved once by lookup and later requests go
+//straight to their file. Only this process changes the image, which lets the
+//kernel cache entries and attributes for -o ll_timeout seconds and answer
+//most stat calls itself.
+#define INO_FILE_BITS 16
+#define STATS_INO 2	//no slot maps to it: directories start at 1 << INO_FILE_BITS
+
+typedef char cs1550_ino_check[MAX_FILES_PER_DIR < (1 << INO_FILE_BITS) - 1 ? 1 : -1];
+
+static fuse_ino_t slotIno(int dirSlot, int fileSlot) {
+	if(dirSlot < 0) return FUSE_ROOT_ID;
+	return ((fuse_ino_t)(dirSlot + 1) << INO_FILE_BITS) | (fuse_ino_t)(fileSlot + 1);
+}
+
+//Splits an inode number into slots: dirSlot is -1 for the root and fileSlot
+//-1 for a directory. Returns -ENOENT for numbers never handed out.
+static int inoSlots(fuse_ino_t ino, int *dirSlot, int *fileSlot) {
+	*dirSlot = -1;
+	*fileSlot = -1;
+	if(ino == FUSE_ROOT_ID) return 0;
+	if((ino >> INO_FILE_BITS) == 0 || (ino >> INO_FILE_BITS) > MAX_DIRS_IN_ROOT) return -ENOENT;
+	*dirSlot = (int)(ino >> INO_FILE_BITS) - 1;
+	*fileSlot = (int)(ino & ((1 << INO_FILE_BITS) - 1)) - 1;
+	return 0;
+}
+
+//Locks the directory an inode is, or is in, for reading. The root takes no
+//lock. Returns -ENOENT if the inode names nothing; a file removed while
+//open still counts until its last release.
+static int lockIno(fuse_ino_t ino, int *dirSlot, int *fileSlot) {
+	if(inoSlots(ino, dirSlot, fileSlot) != 0) return -ENOENT;
+	if(*dirSlot < 0) return 0;
+	if(lockDirSlot(*dirSlot, 0) < 0) return -ENOENT;
+	if(*fileSlot >= dirFiles(*dirSlot) || (*fileSlot >= 0 && dirFile(*dirSlot, *fileSlot)->fname[0] == '\0' &&
+		!__atomic_load_n(&fileNode(*dirSlot, *fileSlot)->unlinked, __ATOMIC_RELAXED))) {
+		unlockDir(*dirSlot);
+		return -ENOENT;
+	}
+	return 0;
+}
+
+static void unlockIno(int dirSlot) {
+	if(dirSlot >= 0) unlockDir(dirSlot);
+}
+
+//Splits a file name the way tokenPath does.
+static int splitName(const char *name, char *filename, char *extension) {
+	const char *dot = strchr(name, '.');
+	size_t length = dot != NULL ? (size_t)(dot - name) : strlen(name);
+
+	if(length == 0) return -EPERM;
+	if(length > MAX_FILENAME || (dot != NULL && strlen(dot + 1) > MAX_EXTENSION)) return -ENAMETOOLONG;
+	memcpy(filename, name, length);
+	filename[length] = '\0';
+	strcpy(extension, dot != NULL ? dot + 1 : "");
+	return 0;
+}
+
+//Attributes of an inode whose directory the caller holds locked.
+static void inoAttr(int dirSlot, int fileSlot, struct stat *stbuf) {
+	memset(stbuf, 0, sizeof(struct stat));
+	stbuf->st_ino = slotIno(dirSlot, fileSlot);
+	if(fileSlot < 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+	} else {
+		struct cs1550_file_node *fnode = fileNode(dirSlot, fileSlot);
+		stbuf->st_mode = S_IFREG | 0666;
+		stbuf->st_nlink = 1;
+		pthread_rwlock_rdlock(&fnode->lock);
+		stbuf->st_size = fileLength(dirFile(dirSlot, fileSlot), fnode);
+		pthread_rwlock_unlock(&fnode->lock);
+	}
+}
+
+static void inoEntry(int dirSlot, int fileSlot, struct fuse_entry_param *e) {
+	memset(e, 0, sizeof(struct fuse_entry_param));
+	e->ino = slotIno(dirSlot, fileSlot);
+	e->generation = fileSlot < 0 ? dirGenerations[dirSlot] : fileNode(dirSlot, fileSlot)->generation;
+	e->attr_timeout = options.llTimeout;
+	e->entry_timeout = options.llTimeout;
+	inoAttr(dirSlot, fileSlot, &e->attr);
+}
+
+//Flushes a file inode's buffered writes like flushSlot.
+static int flushIno(fuse_ino_t ino, int release) {
+	int dirSlot, fileSlot;
+	int res;
+
+	if(ino == STATS_INO) return 0;
+	journalBegin();
+	res = lockIno(ino, &dirSlot, &fileSlot);
+	if(res == 0) {
+		if(fileSlot >= 0) res = flushSlot(dirSlot, fileSlot, release);
+		unlockIno(dirSlot);
+	}
+	journalEnd();
+	return res;
+}
+
+static void cs1550_ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+	(void) userdata;
+
+	//fewer, larger writes for the write-back buffer to coalesce
+	if(conn->capable & FUSE_CAP_BIG_WRITES) conn->want |= FUSE_CAP_BIG_WRITES;
+	cs1550_init(conn);
+}
+
+static void cs1550_ll_destroy(void *userdata)
+{
+	cs1550_destroy(userdata);
+}
+
+static void cs1550_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	struct fuse_entry_param e;
+	int dirSlot, fileSlot;
+	int res = inoSlots(parent, &dirSlot, &fileSlot);
+
+	if(res == 0 && fileSlot >= 0) res = -ENOTDIR;
+	if(res == 0 && dirSlot < 0 && strcmp(name, STATS_NAME) == 0) {
+		//changes with every request, so the kernel must not cache it
+		memset(&e, 0, sizeof(struct fuse_entry_param));
+		e.ino = STATS_INO;
+		statsAttr(&e.attr);
+		e.attr.st_ino = STATS_INO;
+	} else if(res == 0 && dirSlot < 0) {
+		pthread_rwlock_rdlock(&rootLock);
+		dirSlot = strlen(name) > MAX_FILENAME ? -1 : findDir(name);
+		if(dirSlot >= 0) inoEntry(dirSlot, -1, &e);
+		else res = -ENOENT;
+		pthread_rwlock_unlock(&rootLock);
+	} else if(res == 0) {
+		if(splitName(name, filename, extension) != 0 || lockDirSlot(dirSlot, 0) < 0) {
+			res = -ENOENT;
+		} else {
+			fileSlot = findFile(dirSlot, filename, extension);
+			if(fileSlot >= 0) inoEntry(dirSlot, fileSlot, &e);
+			else res = -ENOENT;
+			unlockDir(dirSlot);
+		}
+	}
+	if(res != 0) fuse_reply_err(req, -res);
+	else fuse_reply_entry(req, &e);
+}
+
+//Inode numbers are slots, told apart over reuse by their generation, and
+//need no bookkeeping.
+static void cs1550_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+	(void) ino;
+	(void) nlookup;
+
+	fuse_reply_none(req);
+}
+
+static void cs1550_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	struct stat stbuf;
+	int dirSlot, fileSlot;
+	int res;
+
+	if(ino == STATS_INO) {
+		statsAttr(&stbuf);
+		stbuf.st_ino = STATS_INO;
+		fuse_reply_attr(req, &stbuf, 0);
+		return;
+	}
+	res = lockIno(ino, &dirSlot, &fileSlot);
+	if(res == 0) {
+		inoAttr(dirSlot, fileSlot, &stbuf);
+		unlockIno(dirSlot);
+		fuse_reply_attr(req, &stbuf, options.llTimeout);
+	} else {
+		fuse_reply_err(req, -res);
+	}
+}
+
+//Only the size can be set, like cs1550_truncate; the other attributes are
+//fixed. Replies with the attributes as they are afterwards.
+static void cs1550_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
+			  int to_set, struct fuse_file_info *fi)
+{
+	int dirSlot, fileSlot;
+	int res = 0;
+
+	if((to_set & FUSE_SET_ATTR_SIZE) && ino != STATS_INO) {
+		journalBegin();
+		res = lockIno(ino, &dirSlot, &fileSlot);
+		if(res == 0) {
+			res = fileSlot >= 0 ? truncateSlot(dirSlot, fileSlot, attr->st_size) : -EISDIR;
+			unlockIno(dirSlot);
+		}
+		journalEnd();
+	} else if(to_set & FUSE_SET_ATTR_SIZE) {
+		res = -EACCES;
+	}
+	if(res != 0) fuse_reply_err(req, -res);
+	else cs1550_ll_getattr(req, ino, fi);
+}
+
+static void cs1550_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+	(void) mode;
+
+	struct fuse_entry_param e;
+	int res;
+
+	if(parent != FUSE_ROOT_ID) {
+		res = -EPERM;
+	} else if(strlen(name) > MAX_FILENAME) {
+		res = -ENAMETOOLONG;
+	} else {
+		res = makeDir(name);
+		//a new directory has nothing in it to lock
+		if(res >= 0) inoEntry(res, -1, &e);
+	}
+	if(res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_entry(req, &e);
+}
+
+static void cs1550_ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name,
+			  mode_t mode, dev_t rdev)
+{
+	(void) mode;
+	(void) rdev;
+
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	struct fuse_entry_param e;
+	int dirSlot, fileSlot;
+	int res = inoSlots(parent, &dirSlot, &fileSlot);
+
+	if(res == 0 && (dirSlot < 0 || fileSlot >= 0)) res = -EPERM;
+	if(res == 0) res = splitName(name, filename, extension);
+	if(res == 0) {
+		journalBegin();
+		if(lockDirSlot(dirSlot, 1) < 0) {
+			res = -ENOENT;
+		} else {
+			res = makeFile(dirSlot, filename, extension);
+			if(res >= 0) inoEntry(dirSlot, res, &e);
+			unlockDir(dirSlot);
+		}
+		journalEnd();
+	}
+	if(res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_entry(req, &e);
+}
+
+static void cs1550_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	char filename[MAX_FILENAME + 1];
+	char extension[MAX_EXTENSION + 1];
+	int dirSlot, fileSlot;
+	int res = inoSlots(parent, &dirSlot, &fileSlot);
+
+	if(res == 0 && fileSlot >= 0) res = -ENOTDIR;
+	if(res == 0 && dirSlot < 0) res = strcmp(name, STATS_NAME) == 0 ? -EACCES : -EISDIR;
+	if(res == 0 && splitName(name, filename, extension) != 0) res = -ENOENT;
+	if(res == 0) {
+		journalBegin();
+		if(lockDirSlot(dirSlot, 1) < 0) {
+			res = -ENOENT;
+		} else {
+			fileSlot = findFile(dirSlot, filename, extension);
+			if(fileSlot >= 0) removeFile(dirSlot, fileSlot);
+			else res = -ENOENT;
+			unlockDir(dirSlot);
+		}
+		journalEnd();
+	}
+	fuse_reply_err(req, -res);
+}
+
+static void cs1550_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+	int res = parent == FUSE_ROOT_ID ? 0 : -ENOTDIR;
+
+	if(res == 0 && strcmp(name, STATS_NAME) == 0) res = -ENOTDIR;
+	if(res == 0) res = strlen(name) > MAX_FILENAME ? -ENOENT : removeDir(name);
+	fuse_reply_err(req, -res);
+}
+
+static void cs1550_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	int dirSlot, fileSlot;
+	int res;
+
+	if(ino == STATS_INO) {
+		res = statsOpen(fi);
+		if(res != 0) fuse_reply_err(req, -res);
+		else fuse_reply_open(req, fi);
+		return;
+	}
+	res = lockIno(ino, &dirSlot, &fileSlot);
+	if(res == 0) {
+		if(fileSlot < 0) res = -EISDIR;
+		else openSlot(dirSlot, fileSlot);
+		unlockIno(dirSlot);
+	}
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+	} else {
+		//all changes come through the kernel, and a file made in a reused slot
+		//has a new generation and so a new inode, so its cached pages stay valid
+		fi->keep_cache = 1;
+		fuse_reply_open(req, fi);
+	}
+}
+
+static void cs1550_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+			  struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	struct fuse_bufvec *bufv = NULL;
+	int dirSlot, fileSlot;
+	int splice = 1;	//pieces of the image file are fine, the reply is sent here
+	int res;
+	size_t i;
+
+	if(ino == STATS_INO) {
+		splice = 0;
+		res = statsReadBuf(fileHandle(fi), &bufv, size, offset);
+	} else {
+		res = lockIno(ino, &dirSlot, &fileSlot);
+		if(res == 0) {
+			res = fileSlot >= 0 ? readDataBuf(dirSlot, fileSlot, &bufv, size, offset, &splice) : -EISDIR;
+			unlockIno(dirSlot);
+		}
+	}
+	if(res < 0) {
+		fuse_reply_err(req, -res);
+		return;
+	}
+	fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+	if(splice) spliceDone();
+	for(i = 0 ; i < bufv->count ; i++)
+		free(bufv->buf[i].mem);
+	free(bufv);
+}
+
+static void cs1550_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	int dirSlot, fileSlot;
+	int res;
+
+	if(ino == STATS_INO) {
+		statsReset();
+		fuse_reply_write(req, size);
+		return;
+	}
+	journalBegin();
+	res = lockIno(ino, &dirSlot, &fileSlot);
+	if(res == 0) {
+		res = fileSlot >= 0 ? writeData(dirSlot, fileSlot, buf, size, offset) : -EISDIR;
+		unlockIno(dirSlot);
+	}
+	journalEnd();
+	if(res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_write(req, res);
+}
+
+static void cs1550_ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv,
+			  off_t offset, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	int dirSlot, fileSlot;
+	int res;
+
+	if(ino == STATS_INO) {
+		statsReset();
+		fuse_reply_write(req, fuse_buf_size(bufv));
+		return;
+	}
+	journalBegin();
+	res = lockIno(ino, &dirSlot, &fileSlot);
+	if(res == 0) {
+		res = fileSlot >= 0 ? writeDataBuf(dirSlot, fileSlot, bufv, offset) : -EISDIR;
+		unlockIno(dirSlot);
+	}
+	journalEnd();
+	if(res < 0) fuse_reply_err(req, -res);
+	else fuse_reply_write(req, res);
+}
+
+static void cs1550_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	(void) fi;
+
+	int res = flushIno(ino, 0);
+	if(res == 0) res = syncImage(0);
+	fuse_reply_err(req, -res);
+}
+
+static void cs1550_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+			  struct fuse_file_info *fi)
+{
+	(void) datasync;
+	(void) fi;
+
+	int res = flushIno(ino, 0);
+	if(res == 0) res = syncImage(1);
+	fuse_reply_err(req, -res);
+}
+
+static void cs1550_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+	if(ino == STATS_INO) statsClose(fileHandle(fi));
+	fuse_reply_err(req, -flushIno(ino, 1));
+}
+
+//Entries are numbered by slot, after . and .., so an offset stays valid
+//while files are added. The root lists /.stats last.
+static void cs1550_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
 			  struct fuse_file_info *fi)
 {
-	// printf("---Call function read---\n");
-	(void) buf;
-	(void) offset;
 	(void) fi;
-	(void) path;
-
-	//check to make sure path exists
-	//check that size is > 0
-	//check that offset is <= to the file size
-	//read in data
-	//set size and return, or error
-	// size = 0;
-	if(size <= 0) return -ENOENT;
 
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+	char *buf = malloc(size > 0 ? size : 1);
+	size_t used = 0;
+	struct stat stbuf;
+	int dirSlot, fileSlot;
+	int res = buf != NULL ? lockIno(ino, &dirSlot, &fileSlot) : -ENOMEM;
+	long i, count;
 
-	tokenPath(path, directory, filename, extension);
+	if(res == 0 && fileSlot >= 0) {
+		unlockIno(dirSlot);
+		res = -ENOTDIR;
+	}
+	if(res != 0) {
+		fuse_reply_err(req, -res);
+		free(buf);
+		return;
+	}
+	if(dirSlot < 0) pthread_rwlock_rdlock(&rootLock);
+	count = dirSlot < 0 ? (long)MAX_DIRS_IN_ROOT + 1 : dirFiles(dirSlot);
+	memset(&stbuf, 0, sizeof(struct stat));
+	for(i = offset ; i < count + 2 ; i++) {
+		char name[MAX_FILENAME + MAX_EXTENSION + 2];
+		size_t entry;
 
-	if(strlen(directory) == 0) {
-		return -EPERM;
-	} else {
-		if(strlen(filename) == 0) {
-			return -EPERM;
-		} else if(strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) {
-			return -ENAMETOOLONG;
-		} else if (isContainDir(directory) == 0) {
-			return -EPERM;
-		} else if (isContainFile(directory, filename, extension)) {
-			cs1550_root_directory root = readDisk();
-			int i;
-			cs1550_directory_entry currDir;
-			long fileNStartBlock = -1;
-			size_t fileSize = -1;
-			for(i = 0 ; i < root.nDirectories ; i++) {
-				if(strcmp(root.directories[i].dname, directory) == 0) {
-					currDir = readDirectory(root.directories[i].nStartBlock);
-					break;
-				}
-			}
-			for(i = 0 ; i < currDir.nFiles ; i++) {
-				if(strcmp(currDir.files[i].fname, filename) == 0) {
-					if(strlen(extension) != 0) {
-						if(strcmp(currDir.files[i].fext, extension) != 0)
-							return -EPERM;
-					}
-					fileNStartBlock = currDir.files[i].nStartBlock;
-					fileSize = currDir.files[i].fsize;
-					break;
-				}
+		if(i < 2) {
+			strcpy(name, i == 0 ? "." : "..");
+			stbuf.st_ino = i == 0 ? slotIno(dirSlot, -1) : FUSE_ROOT_ID;
+			stbuf.st_mode = S_IFDIR;
+		} else if(dirSlot < 0 && i == count + 1) {
+			strcpy(name, STATS_NAME);
+			stbuf.st_ino = STATS_INO;
+			stbuf.st_mode = S_IFREG;
+		} else if(dirSlot < 0) {
+			if(strcmp(rootDir->directories[i - 2].dname, "") == 0) continue;
+			strcpy(name, rootDir->directories[i - 2].dname);
+			stbuf.st_ino = slotIno(i - 2, -1);
+			stbuf.st_mode = S_IFDIR;
+		} else {
+			struct cs1550_file_directory *file = dirFile(dirSlot, i - 2);
+			if(file->fname[0] == '\0') continue;
+			strcpy(name, file->fname);
+			if(strcmp(file->fext, "") != 0) {
+				strcat(name, ".");
+				strcat(name, file->fext);
 			}
-			if(offset > fileSize) return -ENOENT;
-			readFile(buf, (long)offset+fileNStartBlock, size);
-			return size;
+			stbuf.st_ino = slotIno(dirSlot, i - 2);
+			stbuf.st_mode = S_IFREG;
 		}
+		entry = fuse_add_direntry(req, buf + used, size - used, name, &stbuf, i + 1);
+		if(entry > size - used) break;
+		used += entry;
 	}
-	return 0;
+	if(dirSlot < 0) pthread_rwlock_unlock(&rootLock);
+	unlockIno(dirSlot);
+	fuse_reply_buf(req, buf, used);
+	free(buf);
 }
 
-/*
- * Write size bytes from buf into file starting from offset
- *
- */
-static int cs1550_write(const char *path, const char *buf, size_t size,
-			  off_t offset, struct fuse_file_info *fi)
+//These reply on their own, so only their calls and latencies are counted.
+//A forget needs no image and gets no reply but its own.
+#define STATS_TIMED_LL(name, op, params, args) \
+static void timed_ll_##name params \
+{ \
+	long start = statsStart(); \
+	if(mountError != 0 && op != STAT_FORGET) fuse_reply_err(req, EIO); \
+	else cs1550_ll_##name args; \
+	statsEnd(op, start, 0); \
+}
+
+STATS_TIMED_LL(lookup, STAT_LOOKUP, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+STATS_TIMED_LL(forget, STAT_FORGET, (fuse_req_t req, fuse_ino_t ino, unsigned long nlookup), (req, ino, nlookup))
+STATS_TIMED_LL(getattr, STAT_GETATTR, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+STATS_TIMED_LL(setattr, STAT_SETATTR, (fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set,
+	struct fuse_file_info *fi), (req, ino, attr, to_set, fi))
+STATS_TIMED_LL(mkdir, STAT_MKDIR, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode),
+	(req, parent, name, mode))
+STATS_TIMED_LL(mknod, STAT_MKNOD, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev),
+	(req, parent, name, mode, rdev))
+STATS_TIMED_LL(unlink, STAT_UNLINK, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+STATS_TIMED_LL(rmdir, STAT_RMDIR, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+STATS_TIMED_LL(open, STAT_OPEN, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+STATS_TIMED_LL(read, STAT_READ, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+	struct fuse_file_info *fi), (req, ino, size, offset, fi))
+STATS_TIMED_LL(write, STAT_WRITE, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, off_t offset,
+	struct fuse_file_info *fi), (req, ino, buf, size, offset, fi))
+STATS_TIMED_LL(write_buf, STAT_WRITE_BUF, (fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t offset,
+	struct fuse_file_info *fi), (req, ino, bufv, offset, fi))
+STATS_TIMED_LL(flush, STAT_FLUSH, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+STATS_TIMED_LL(fsync, STAT_FSYNC, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi),
+	(req, ino, datasync, fi))
+STATS_TIMED_LL(release, STAT_RELEASE, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+STATS_TIMED_LL(readdir, STAT_READDIR, (fuse_req_t req, fuse_ino_t ino, size_t size, off_t offset,
+	struct fuse_file_info *fi), (req, ino, size, offset, fi))
+
+static struct fuse_lowlevel_ops hello_ll_oper = {
+	.init	= cs1550_ll_init,
+	.destroy	= cs1550_ll_destroy,
+	.lookup	= timed_ll_lookup,
+	.forget	= timed_ll_forget,
+	.getattr	= timed_ll_getattr,
+	.setattr	= timed_ll_setattr,
+	.mkdir	= timed_ll_mkdir,
+	.mknod	= timed_ll_mknod,
+	.unlink	= timed_ll_unlink,
+	.rmdir	= timed_ll_rmdir,
+	.open	= timed_ll_open,
+	.read	= timed_ll_read,
+	.write	= timed_ll_write,
+	.write_buf	= timed_ll_write_buf,
+	.flush	= timed_ll_flush,
+	.fsync	= timed_ll_fsync,
+	.release	= timed_ll_release,
+	.readdir	= timed_ll_readdir,
+};
+
+#ifdef CS1550_LIBRARY
+
+//Entry points for programs that drive the filesystem directly, without
+//mounting it (build with -DCS1550_LIBRARY). Call cs1550_set_disk before the
+//init operation.
+void cs1550_set_disk(const char *path)
 {
-	// printf("---Call function write---\n");
-	(void) buf;
-	(void) offset;
-	(void) fi;
-	(void) path;
+	strncpy(diskPath, path, sizeof(diskPath) - 1);
+	diskPath[sizeof(diskPath) - 1] = '\0';
+}
 
-	//check to make sure path exists
-	//check that size is > 0
-	//check that offset is <= to the file size
-	//write data
-	//set size (should be same as input) and return, or error
-	if(size <= 0) return -ENOENT;
+const struct fuse_operations *cs1550_operations(void)
+{
+	return &hello_oper;
+}
 
-	char directory[MAX_FILENAME + 1];
-	char filename[MAX_FILENAME + 1];
-	char extension[MAX_EXTENSION + 1];
+const struct fuse_lowlevel_ops *cs1550_lowlevel_operations(void)
+{
+	return &hello_ll_oper;
+}
 
-	tokenPath(path, directory, filename, extension);
+//Same as -o compress, for files written from now on.
+void cs1550_set_compress(int on)
+{
+	options.compress = on;
+}
 
-	if(strlen(directory) == 0) {
-		return -EPERM;
-	} else {
-		if(strlen(filename) == 0) {
-			return -EPERM;
-		} else if(strlen(filename) > MAX_FILENAME || strlen(extension) > MAX_EXTENSION) {
-			return -ENAMETOOLONG;
-		} else if (isContainDir(directory) == 0) {
-			return -EPERM;
-		} else if (isContainFile(directory, filename, extension)) {
-			cs1550_root_directory root = readDisk();
-			int i;
-			cs1550_directory_entry currDir;
-			long fileNStartBlock = -1;
-			long dirNStartBlock = -1;
-			size_t fileSize = -1;
-			for(i = 0 ; i < root.nDirectories ; i++) {
-				if(strcmp(root.directories[i].dname, directory) == 0) {	// find the directory in root
-					currDir = readDirectory(root.directories[i].nStartBlock);
-					dirNStartBlock = root.directories[i].nStartBlock;	// find the nStartBlock of the dir
-					break;
-				}
-			}
-			int blocks = 1;
-			for(i = 0 ; i < currDir.nFiles ; i++) {
-				if(strcmp(currDir.files[i].fname, filename) == 0) {
-					if(strlen(extension) != 0) {
-						if(strcmp(currDir.files[i].fext, extension) != 0)
-							return -EPERM;
-						}
-					fileNStartBlock = currDir.files[i].nStartBlock;
-					fileSize = currDir.files[i].fsize;
-					break;
-				}
+//Same as -o dedup: images formatted from now on get a dedup table, and
+//files written from now on share blocks on images that have one.
+void cs1550_set_dedup(int on)
+{
+	options.dedup = on;
+}
+
+//Same as -o checksum, for images formatted from now on.
+void cs1550_set_checksum(int on)
+{
+	options.checksum = on;
+}
+
+//Prints the block cache counters of the mounted image.
+void cs1550_cache_report(FILE *out)
+{
+	if(cacheShards != NULL) cacheReport(out);
+}
+
+//Offline check and repair, for cs1550_fsck.c. The image is opened the way a
+//mount opens it, so the journal is replayed first, but of the metadata only
+//the root, the bitmap and the dedup table are loaded. The directories'
+//extent maps and then their blocks are read straight from the image by
+//fsckThreads threads, each taking the next item off a shared counter and
+//following the extents of the files it finds. Every block found counts in
+//fsckRefs, with atomics: 1 for each extent that points at it as data, and
+//FSCK_META for a metadata block. Once the scan is done the counts tell for
+//each block whether it is free, metadata or data, and how many extents
+//share it, and the bitmap and the share counts are checked against them.
+//
+//With repair set, what can be put right without guessing is: the bitmap and
+//the share counts are rebuilt, files that point outside the data area are
+//emptied and such directories dropped from the root, extent chains are cut
+//at a bad link and sizes are cut down to the blocks a file has. The fixes go
+//through the journal like any other change. When some block of the scan
+//could not be read, what it pointed at is unknown, so then repair only adds
+//missing bits to the bitmap and leaves leaked bits and the dedup state be.
+#define FSCK_META (1U << 24)
+
+//A small file's run in a tail block.
+struct cs1550_fsck_tail
+{
+	long address;	//byte address
+	long units;
+};
+
+//A directory of the root, as the scan sees it.
+struct cs1550_fsck_dir
+{
+	int slot;
+	char path[MAX_FILENAME + 2];
+	long nBlocks;
+	long *blocks;	//its directory blocks, in slot order
+	int lost;	//none of its blocks could be found
+	pthread_mutex_t lock;	//guards the tail runs
+	struct cs1550_fsck_tail *tails;
+	long nTails;
+	long tailCapacity;
+};
+
+//A directory block to scan.
+struct cs1550_fsck_item
+{
+	int dir;
+	long index;
+};
+
+static int fsckRepair = 0;
+static int fsckThreads = 1;
+static FILE *fsckOut = NULL;
+static uint32_t *fsckRefs = NULL;	//per block
+static long fsckFirst = 0;	//first block after the regions the superblock lists
+static struct cs1550_fsck_dir *fsckDirs = NULL;
+static int nFsckDirs = 0;
+static struct cs1550_fsck_item *fsckItems = NULL;
+static long nFsckItems = 0;
+static long fsckNext = 0;	//next item of the running stage, taken with atomics
+static long fsckFiles = 0;	//the counts below are updated with atomics
+static long fsckFound = 0;
+static long fsckFixed = 0;
+static int fsckError = 0;	//the check itself failed
+static int fsckIncomplete = 0;	//the scan skipped blocks it could not read
+
+//Prints a problem with what is at path. fixed: repair put it right.
+static void fsckProblem(const char *path, int fixed, const char *format, ...) {
+	va_list args;
+
+	__atomic_add_fetch(&fsckFound, 1, __ATOMIC_RELAXED);
+	if(fixed) __atomic_add_fetch(&fsckFixed, 1, __ATOMIC_RELAXED);
+	flockfile(fsckOut);
+	fprintf(fsckOut, "%s: ", path);
+	va_start(args, format);
+	vfprintf(fsckOut, format, args);
+	va_end(args);
+	fprintf(fsckOut, fixed ? ", fixed\n" : "\n");
+	funlockfile(fsckOut);
+}
+
+//Where a run of count blocks at block points when that is outside the data
+//area, or NULL.
+static const char *fsckRange(long block, long count) {
+	if(block >= super.nBlocks || count > super.nBlocks - block) return "past the end of the image";
+	if(block < fsckFirst) return "before the first data block";
+	return NULL;
+}
+
+//Counts the run of count blocks at block as used by one more extent, or as
+//metadata. Returns how many of them something else uses too, not counting
+//data blocks that an image with a dedup table lets extents share.
+static long fsckClaim(long block, long count, int meta) {
+	long b, clashes = 0;
+	for(b = block ; b < block + count ; b++) {
+		uint32_t old = __atomic_fetch_add(&fsckRefs[b], meta ? FSCK_META : 1, __ATOMIC_RELAXED);
+		if(old != 0 && (meta || old >= FSCK_META || dedupTable == NULL)) clashes++;
+	}
+	return clashes;
+}
+
+static void fsckFail(int err) {
+	__atomic_store_n(&fsckError, err, __ATOMIC_RELAXED);
+}
+
+static void fsckSkipped() {
+	__atomic_store_n(&fsckIncomplete, 1, __ATOMIC_RELAXED);
+}
+
+//Writes a repaired metadata block.
+static void fsckWrite(const void *data, long block) {
+	journalBegin();
+	metaWrite(data, block * BLOCK_SIZE);
+	journalEnd();
+}
+
+//Loads the extent chain whose first block is block into map, counting its
+//blocks as metadata. A link that leaves the data area or leads to a block
+//something else uses ends the chain there, and repair cuts it off.
+static void fsckChain(const char *path, long block, struct cs1550_extent_map *map) {
+	cs1550_extent_block chain;
+	int k;
+
+	memset(map, 0, sizeof(struct cs1550_extent_map));
+	for(;;) {
+		long next;
+		if(extentMapAddChain(map, block) != 0) {
+			fsckFail(-ENOMEM);
+			return;
+		}
+		if(sumRead(&chain, block, 1) != BLOCK_SIZE) {
+			fsckProblem(path, 0, "extent block %ld cannot be read", block);
+			fsckSkipped();
+			return;
+		}
+		if(chain.nExtents < 0 || chain.nExtents > (int)MAX_EXTENTS_IN_BLOCK) {
+			fsckProblem(path, 0, "extent block %ld lists %d extents", block, chain.nExtents);
+			fsckSkipped();
+		}
+		for(k = 0 ; k < chain.nExtents && k < (int)MAX_EXTENTS_IN_BLOCK ; k++) {
+			if(extentMapAppend(map, chain.extents[k].nStartBlock, chain.extents[k].nBlocks) != 0) {
+				fsckFail(-ENOMEM);
+				return;
 			}
-			if(offset > fileSize) return -ENOENT;
-			if(offset + size > fileSize) {
-				int currBlocks = fileSize / BLOCK_SIZE;
-				if(currBlocks == 0) currBlocks = currBlocks+1;
-				int currRest = fileSize % BLOCK_SIZE;
-				if(currRest > 0) currBlocks = currBlocks + 1;
-				blocks = (offset + size) / BLOCK_SIZE;
-				int rest = (offset + size) % BLOCK_SIZE;
-				if(rest > 0) blocks = blocks + 1;
-				if(currBlocks < blocks) {
-					long blockAddress = (long)getBlockAddress();
-					if(blockAddress != (fileNStartBlock + currBlocks*BLOCK_SIZE)) {
-						FILE *fp = fopen(".disk", "rb");
-						fseek(fp, fileNStartBlock, SEEK_SET);
-						unsigned char temp[fileSize];
-						fread(temp, fileSize, 1, fp);
-						fclose(fp);
-						writeBlock(temp, 1, blockAddress);
-						fileNStartBlock = blockAddress;
-					}
-				}
+		}
+		next = chain.nNextBlock;
+		if(next == 0) return;
+		if(fsckRange(next, 1) != NULL) {
+			fsckProblem(path, fsckRepair, "extent block %ld links %s", block, fsckRange(next, 1));
+		} else if(fsckClaim(next, 1, 1) != 0) {
+			fsckProblem(path, fsckRepair, "extent block %ld links to block %ld, which something else uses", block, next);
+		} else {
+			block = next;
+			continue;
+		}
+		if(fsckRepair) {
+			chain.nNextBlock = 0;
+			fsckWrite(&chain, block);
+		}
+		return;
+	}
+}
+
+//Checks a file's extents and counts their blocks. Returns the blocks of
+//the file they stand for, and sets outside when an extent points outside
+//the data area, for fsckFile to empty the file with repair.
+static long fsckExtents(const char *path, const struct cs1550_extent_map *map, int *outside) {
+	long logical = 0;
+	int k;
+
+	*outside = 0;
+	for(k = 0 ; k < map->nExtents ; k++) {
+		const struct cs1550_extent *e = &map->extents[k];
+		const char *wrong;
+		long clashes;
+
+		if(e->nBlocks == 0 || e->nBlocks < -CHUNK_BYTES) {
+			fsckProblem(path, 0, "extent %d has a length of %ld", k, e->nBlocks);
+			continue;
+		}
+		if(e->nBlocks < 0 && logical % CHUNK_BLOCKS != 0)
+			fsckProblem(path, 0, "compressed extent %d does not start a chunk", k);
+		if((wrong = fsckRange(e->nStartBlock, extentBlocks(e))) != NULL) {
+			fsckProblem(path, fsckRepair, "extent %d points %s", k, wrong);
+			*outside = 1;
+		} else if((clashes = fsckClaim(e->nStartBlock, extentBlocks(e), 0)) > 0)
+			fsckProblem(path, 0, "extent %d has blocks something else uses too: %ld", k, clashes);
+		logical += extentLength(e);
+	}
+	return logical;
+}
+
+//Takes back what fsckChain and fsckExtents counted for a file that repair
+//empties, so that its blocks are freed with the rest.
+static void fsckUnclaim(const struct cs1550_extent_map *map) {
+	long b;
+	int k;
+
+	for(k = 0 ; k < map->nChain ; k++)
+		__atomic_sub_fetch(&fsckRefs[map->chain[k]], FSCK_META, __ATOMIC_RELAXED);
+	for(k = 0 ; k < map->nExtents ; k++) {
+		const struct cs1550_extent *e = &map->extents[k];
+		if(e->nBlocks == 0 || e->nBlocks < -CHUNK_BYTES || fsckRange(e->nStartBlock, extentBlocks(e)) != NULL) continue;
+		for(b = e->nStartBlock ; b < e->nStartBlock + extentBlocks(e) ; b++)
+			__atomic_sub_fetch(&fsckRefs[b], 1, __ATOMIC_RELAXED);
+	}
+}
+
+//Checks a small file's run and keeps it for fsckTails.
+static int fsckTail(struct cs1550_fsck_dir *dir, struct cs1550_file_directory *file, const char *path) {
+	long address = -file->nStartBlock;
+	long units = tailUnits(file->fsize);
+	const char *wrong = fsckRange(address / BLOCK_SIZE, 1);
+
+	if(wrong != NULL || address % TAIL_UNIT != 0 || file->fsize == 0 || file->fsize > TAIL_MAX ||
+		address % BLOCK_SIZE / TAIL_UNIT + units > TAIL_UNITS) {
+		if(wrong != NULL) fsckProblem(path, fsckRepair, "its tail run points %s", wrong);
+		else fsckProblem(path, fsckRepair, "its %zu bytes do not fit a tail run at byte %ld", file->fsize, address);
+		file->nStartBlock = 0;
+		file->fsize = 0;
+		return 1;
+	}
+	pthread_mutex_lock(&dir->lock);
+	if(dir->nTails == dir->tailCapacity) {
+		long capacity = dir->tailCapacity ? dir->tailCapacity * 2 : 64;
+		struct cs1550_fsck_tail *tails = realloc(dir->tails, capacity * sizeof(struct cs1550_fsck_tail));
+		if(tails == NULL) {
+			pthread_mutex_unlock(&dir->lock);
+			fsckFail(-ENOMEM);
+			return 0;
+		}
+		dir->tails = tails;
+		dir->tailCapacity = capacity;
+	}
+	dir->tails[dir->nTails].address = address;
+	dir->tails[dir->nTails].units = units;
+	dir->nTails++;
+	pthread_mutex_unlock(&dir->lock);
+	return 0;
+}
+
+//Checks one file entry and counts its blocks. Returns 1 when the entry was
+//changed, to be written back with repair.
+static int fsckFile(struct cs1550_fsck_dir *dir, struct cs1550_file_directory *file, const char *path) {
+	struct cs1550_extent_map map;
+	long logical;
+	const char *wrong;
+	int outside;
+
+	__atomic_add_fetch(&fsckFiles, 1, __ATOMIC_RELAXED);
+	if(file->nStartBlock < 0) return fsckTail(dir, file, path);
+	if(file->nStartBlock == 0) {
+		if(file->fsize == 0) return 0;
+		fsckProblem(path, fsckRepair, "has a size of %zu but no blocks", file->fsize);
+		file->fsize = 0;
+		return 1;
+	}
+	wrong = file->nStartBlock % BLOCK_SIZE != 0 ? "inside a block" : fsckRange(file->nStartBlock / BLOCK_SIZE, 1);
+	if(wrong == NULL && fsckClaim(file->nStartBlock / BLOCK_SIZE, 1, 1) != 0)
+		wrong = "to a block something else uses";
+	if(wrong != NULL) {
+		fsckProblem(path, fsckRepair, "its first extent block points %s", wrong);
+		file->nStartBlock = 0;
+		file->fsize = 0;
+		return 1;
+	}
+	fsckChain(path, file->nStartBlock / BLOCK_SIZE, &map);
+	logical = fsckExtents(path, &map, &outside);
+	if(outside && fsckRepair) {
+		fsckUnclaim(&map);
+		extentMapFree(&map);
+		file->nStartBlock = 0;
+		file->fsize = 0;
+		return 1;
+	}
+	extentMapFree(&map);
+	if(file->fsize <= (size_t)logical * BLOCK_SIZE) return 0;
+	fsckProblem(path, fsckRepair, "has a size of %zu but blocks for %ld bytes", file->fsize, logical * BLOCK_SIZE);
+	file->fsize = logical * BLOCK_SIZE;
+	return 1;
+}
+
+//Finds the blocks of the directories, one directory at a time.
+static void *fsckScanDirs(void *arg) {
+	long i;
+	(void) arg;
+
+	while((i = __atomic_fetch_add(&fsckNext, 1, __ATOMIC_RELAXED)) < nFsckDirs) {
+		struct cs1550_fsck_dir *dir = &fsckDirs[i];
+		long location = rootDir->directories[dir->slot].nStartBlock;
+		const char *wrong = location % BLOCK_SIZE != 0 ? "inside a block" : fsckRange(location / BLOCK_SIZE, 1);
+		struct cs1550_extent_map map;
+		struct cs1550_extent only = { location / BLOCK_SIZE, 1 };
+		long b;
+		int k;
+
+		if(wrong == NULL && fsckClaim(location / BLOCK_SIZE, 1, 1) != 0) wrong = "to a block something else uses";
+		if(wrong != NULL) {
+			fsckProblem(dir->path, fsckRepair, "its first block points %s, so it is lost", wrong);
+			dir->lost = 1;
+			continue;
+		}
+		if(super.version < 3) {
+			map.nExtents = 1;
+			map.extents = &only;
+		} else {
+			fsckChain(dir->path, location / BLOCK_SIZE, &map);
+		}
+		for(k = 0 ; k < map.nExtents ; k++) {
+			const struct cs1550_extent *e = &map.extents[k];
+			long *blocks;
+			if(super.version < 3) {
+				//the block is counted already
+			} else if(e->nBlocks <= 0) {
+				fsckProblem(dir->path, 0, "extent %d has a length of %ld", k, e->nBlocks);
+				fsckSkipped();
+				continue;
+			} else if((wrong = fsckRange(e->nStartBlock, e->nBlocks)) != NULL) {
+				fsckProblem(dir->path, 0, "extent %d points %s", k, wrong);
+				fsckSkipped();
+				continue;
+			} else if(fsckClaim(e->nStartBlock, e->nBlocks, 1) != 0) {
+				fsckProblem(dir->path, 0, "blocks of extent %d are used by something else too", k);
 			}
-			writeMultiBlock(buf, blocks*BLOCK_SIZE, fileNStartBlock+offset);
-			currDir.files[i].nStartBlock = fileNStartBlock;
-			if(offset+size > fileSize)
-				currDir.files[i].fsize = offset+size;
-			int k;
-			for(k = 0 ; k < blocks ; k++) {
-				updateBitmap(fileNStartBlock + k*BLOCK_SIZE);
+			blocks = realloc(dir->blocks, (dir->nBlocks + e->nBlocks) * sizeof(long));
+			if(blocks == NULL) {
+				fsckFail(-ENOMEM);
+				break;
 			}
-			writeBlock(&currDir, 1, dirNStartBlock);
-			return size;
+			dir->blocks = blocks;
+			for(b = 0 ; b < e->nBlocks ; b++)
+				dir->blocks[dir->nBlocks++] = e->nStartBlock + b;
 		}
+		if(super.version >= 3) extentMapFree(&map);
 	}
-	return 0;
+	return NULL;
 }
 
-/******************************************************************************
- *
- *  DO NOT MODIFY ANYTHING BELOW THIS LINE
- *
- *****************************************************************************/
+//Checks the files of the directory blocks, one block at a time.
+static void *fsckScanBlocks(void *arg) {
+	cs1550_directory_entry *block = malloc(sizeof(cs1550_directory_entry));
+	char path[2 * MAX_FILENAME + MAX_EXTENSION + 32];
+	long i;
+	(void) arg;
 
-/*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
- */
-static int cs1550_truncate(const char *path, off_t size)
-{
-	(void) path;
-	(void) size;
+	if(block == NULL) {
+		fsckFail(-ENOMEM);
+		return NULL;
+	}
+	while((i = __atomic_fetch_add(&fsckNext, 1, __ATOMIC_RELAXED)) < nFsckItems) {
+		struct cs1550_fsck_dir *dir = &fsckDirs[fsckItems[i].dir];
+		long index = fsckItems[i].index;
+		long b = dir->blocks[index];
+		int nFiles, changed = 0, j;
 
-    return 0;
+		if(sumRead(block, b, 1) != BLOCK_SIZE) {
+			fsckProblem(dir->path, 0, "directory block %ld cannot be read", b);
+			fsckSkipped();
+			continue;
+		}
+		nFiles = block->nFiles;
+		if(nFiles < 0 || nFiles > (int)MAX_FILES_IN_DIR) {
+			fsckProblem(dir->path, 0, "directory block %ld holds %d files", b, nFiles);
+			nFiles = nFiles < 0 ? 0 : MAX_FILES_IN_DIR;
+		} else if(nFiles < (int)MAX_FILES_IN_DIR && index < dir->nBlocks - 1) {
+			fsckProblem(dir->path, 0, "directory block %ld is not full but another one follows it", b);
+		}
+		for(j = 0 ; j < nFiles ; j++) {
+			struct cs1550_file_directory *file = &block->files[j];
+			if(file->fname[0] == '\0' && file->nStartBlock == 0) continue;
+			//a removed file that was still open, which the next mount frees
+			if(file->fname[0] == '\0')
+				snprintf(path, sizeof(path), "%s/(slot %ld)", dir->path, index * (long)MAX_FILES_IN_DIR + j);
+			else if(file->fext[0] == '\0')
+				snprintf(path, sizeof(path), "%s/%.*s", dir->path, MAX_FILENAME, file->fname);
+			else
+				snprintf(path, sizeof(path), "%s/%.*s.%.*s", dir->path, MAX_FILENAME, file->fname, MAX_EXTENSION, file->fext);
+			changed |= fsckFile(dir, file, path);
+		}
+		if(changed && fsckRepair) fsckWrite(block, b);
+	}
+	free(block);
+	return NULL;
 }
 
+//Runs work on fsckThreads threads until they have taken every item.
+static void fsckRun(void *(*work)(void *)) {
+	pthread_t *threads = malloc(fsckThreads * sizeof(pthread_t));
+	int i, started = 0;
 
-/*
- * Called when we open a file
- *
- */
-static int cs1550_open(const char *path, struct fuse_file_info *fi)
-{
-	(void) path;
-	(void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
+	fsckNext = 0;
+	for(i = 0 ; threads != NULL && i < fsckThreads ; i++) {
+		if(pthread_create(&threads[started], NULL, work, NULL) == 0) started++;
+	}
+	if(started == 0) work(NULL);
+	for(i = 0 ; i < started ; i++)
+		pthread_join(threads[i], NULL);
+	free(threads);
+}
 
-    //It's not really necessary for this project to anything in open
+static int compareTails(const void *a, const void *b) {
+	long x = ((const struct cs1550_fsck_tail *)a)->address, y = ((const struct cs1550_fsck_tail *)b)->address;
+	return x < y ? -1 : x > y;
+}
 
-    /* We're not going to worry about permissions for this project, but
-	   if we were and we don't have them to the file we should return an error
+//Counts the tail blocks of a directory and checks that no two of its small
+//files share bytes.
+static void fsckTails(struct cs1550_fsck_dir *dir) {
+	long k, end = 0;
 
-        return -EACCES;
-    */
+	if(dir->nTails == 0) return;
+	qsort(dir->tails, dir->nTails, sizeof(struct cs1550_fsck_tail), compareTails);
+	for(k = 0 ; k < dir->nTails ; k++) {
+		struct cs1550_fsck_tail *t = &dir->tails[k];
+		long b = t->address / BLOCK_SIZE;
+		if(k == 0 || b != dir->tails[k - 1].address / BLOCK_SIZE) {
+			if(fsckClaim(b, 1, 1) != 0) fsckProblem(dir->path, 0, "tail block %ld is used by something else too", b);
+		} else if(t->address < end) {
+			fsckProblem(dir->path, 0, "two small files overlap in tail block %ld", b);
+		}
+		if(t->address + t->units * TAIL_UNIT > end) end = t->address + t->units * TAIL_UNIT;
+	}
+}
 
-    return 0; //success!
+//Checks the share counts against the extents that point at each block, and
+//the dedup entries against the blocks in use. They are not repaired after
+//an incomplete scan, which may have missed extents that share a block.
+static void fsckShares() {
+	int repair = fsckRepair && !fsckIncomplete;
+	long b, k, wrong = 0, over = 0, stale = 0;
+	long firstWrong = 0, firstOver = 0, firstStale = 0;
+
+	if(dedupTable == NULL) return;
+	for(b = 0 ; b < super.nBlocks ; b++) {
+		uint32_t refs = fsckRefs[b];
+		long want = refs > 0 && refs < FSCK_META ? refs - 1 : 0;
+		if(want > UINT16_MAX) {
+			if(over++ == 0) firstOver = b;
+		} else if(dedupShares[b] != want) {
+			if(wrong++ == 0) firstWrong = b;
+			if(repair) dedupShare(b, want - dedupShares[b]);
+		}
+	}
+	for(k = 0 ; k < dedupEntries ; k++) {
+		b = dedupTable[k].block;
+		if(b == 0 || (b > 0 && b < super.nBlocks && fsckRefs[b] > 0 && fsckRefs[b] < FSCK_META)) continue;
+		if(stale++ == 0) firstStale = b;
+		if(repair) dedupDrop(k);
+	}
+	if(wrong > 0) fsckProblem("share counts", repair, "blocks with the wrong count: %ld, the first %ld", wrong, firstWrong);
+	if(over > 0) fsckProblem("share counts", 0, "blocks with more extents than a count holds: %ld, the first %ld", over, firstOver);
+	if(stale > 0) fsckProblem("dedup table", repair, "entries for blocks no file uses: %ld, the first %ld", stale, firstStale);
 }
 
-/*
- * Called when close is called on a file descriptor, but because it might
- * have been dup'ed, this isn't a guarantee we won't ever need the file
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
- */
-static int cs1550_flush (const char *path , struct fuse_file_info *fi)
+//Checks the bitmap against the blocks the scan found and rebuilds it from
+//them with repair. After an incomplete scan a block that looks unused may
+//still hold data, so then repair only marks the missing blocks used.
+//Returns the blocks in use.
+static long fsckBitmap() {
+	long nWords = (super.nBlocks + 63) / 64;
+	long w, used = 0, missing = 0, leaked = 0, firstMissing = 0, firstLeaked = 0;
+
+	for(w = 0 ; w < nWords ; w++) {
+		uint64_t want = 0, have = bitmapWords[w];
+		int i;
+		for(i = 0 ; i < 64 ; i++) {
+			long b = w * 64 + i;
+			if(b < fsckFirst || b >= super.nBlocks || fsckRefs[b] != 0) want |= 1ULL << (63 - i);
+			if(b < super.nBlocks && (b < fsckFirst || fsckRefs[b] != 0)) used++;
+		}
+		if(want == have) continue;
+		if((want & ~have) != 0 && missing == 0) firstMissing = w * 64 + __builtin_clzll(want & ~have);
+		if((have & ~want) != 0 && leaked == 0) firstLeaked = w * 64 + __builtin_clzll(have & ~want);
+		missing += __builtin_popcountll(want & ~have);
+		leaked += __builtin_popcountll(have & ~want);
+		if(fsckRepair) {
+			bitmapWords[w] = fsckIncomplete ? have | want : want;
+			bitmapDirty[w / BITMAP_WORDS_PER_BLOCK] = 1;
+		}
+	}
+	if(missing > 0) fsckProblem("bitmap", fsckRepair, "blocks in use but marked free: %ld, the first %ld", missing, firstMissing);
+	if(leaked > 0) fsckProblem("bitmap", fsckRepair && !fsckIncomplete, "blocks marked used that nothing uses: %ld, the first %ld", leaked, firstLeaked);
+	return used;
+}
+
+//Sets up a directory of the root for the scan for each slot that names one,
+//and checks the root's count of them.
+static int fsckRoot() {
+	int i;
+
+	if(sumRead(rootDir, super.nRootBlock, 1) != BLOCK_SIZE) return -EIO;
+	fsckDirs = calloc(MAX_DIRS_IN_ROOT, sizeof(struct cs1550_fsck_dir));
+	if(fsckDirs == NULL) return -ENOMEM;
+	for(i = 0 ; i < MAX_DIRS_IN_ROOT ; i++) {
+		struct cs1550_fsck_dir *dir;
+		if(rootDir->directories[i].dname[0] == '\0') continue;
+		dir = &fsckDirs[nFsckDirs++];
+		dir->slot = i;
+		snprintf(dir->path, sizeof(dir->path), "/%.*s", MAX_FILENAME, rootDir->directories[i].dname);
+		pthread_mutex_init(&dir->lock, NULL);
+	}
+	return 0;
+}
+
+//Removes the directories whose blocks are lost from the root with repair,
+//and checks its count of directories.
+static void fsckRootRepair() {
+	int i, changed = 0, left = nFsckDirs;
+
+	for(i = 0 ; i < nFsckDirs ; i++) {
+		if(!fsckDirs[i].lost || !fsckRepair) continue;
+		memset(&rootDir->directories[fsckDirs[i].slot], 0, sizeof(struct cs1550_directory));
+		left--;
+		changed = 1;
+	}
+	if(rootDir->nDirectories != nFsckDirs) {
+		fsckProblem("/", fsckRepair, "counts %d directories but holds %d", rootDir->nDirectories, nFsckDirs);
+		changed = 1;
+	}
+	if(changed && fsckRepair) {
+		rootDir->nDirectories = left;
+		fsckWrite(rootDir, super.nRootBlock);
+	}
+}
+
+static void fsckFree() {
+	int i;
+	for(i = 0 ; i < nFsckDirs ; i++) {
+		free(fsckDirs[i].blocks);
+		free(fsckDirs[i].tails);
+		pthread_mutex_destroy(&fsckDirs[i].lock);
+	}
+	free(fsckDirs);
+	free(fsckItems);
+	free(fsckRefs);
+	fsckDirs = NULL;
+	fsckItems = NULL;
+	fsckRefs = NULL;
+	nFsckDirs = 0;
+	nFsckItems = 0;
+}
+
+//Checks the image set with cs1550_set_disk, which must not be mounted, on
+//threads threads, and repairs what it can when repair is set. Problems go to
+//out. Returns what fsck(8) would exit with: 0 when the image is clean, 1
+//when every problem was fixed, 4 when some are left and 8 when the check
+//could not run.
+int cs1550_fsck(int threads, int repair, FILE *out)
 {
-	(void) path;
-	(void) fi;
+	struct cs1550_options saved = options;
+	long used = 0;
+	int res, i;
 
-	return 0; //success!
+	fsckThreads = threads > 0 ? threads : 1;
+	fsckRepair = repair;
+	fsckOut = out;
+	fsckFiles = fsckFound = fsckFixed = 0;
+	fsckError = 0;
+	fsckIncomplete = 0;
+	//nothing is read twice, and nothing may run behind the scan's back
+	options.cacheMiB = 0;
+	options.commitMs = 0;
+	statsReset();
+	crcInit();
+	res = devOpen(diskPath);
+	if(res == 0) {
+		ioOpen();
+		if(devRead(&super, BLOCK_SIZE, 0) != BLOCK_SIZE || super.magic != CS1550_MAGIC) {
+			fprintf(stderr, "cs1550: %s is not a cs1550 image\n", diskPath);
+			res = -EINVAL;
+		}
+	}
+	if(res == 0)
+		res = loadSuperblock();
+	if(res == 0)
+		res = journalOpen();
+	if(res == 0)
+		res = sumLoad();
+	if(res == 0)
+		res = bitmapLoad();
+	if(res == 0)
+		res = dedupLoad();
+	if(res == 0) {
+		fsckFirst = super.nRootBlock + 1;
+		if(super.nBitmapStart + super.nBitmapBlocks > fsckFirst) fsckFirst = super.nBitmapStart + super.nBitmapBlocks;
+		if(super.nJournalStart + super.nJournalBlocks > fsckFirst) fsckFirst = super.nJournalStart + super.nJournalBlocks;
+		if(super.nDedupBlocks > 0 && super.nShareStart + super.nShareBlocks > fsckFirst) fsckFirst = super.nShareStart + super.nShareBlocks;
+		if(super.nSumBlocks > 0 && super.nSumStart + super.nSumBlocks > fsckFirst) fsckFirst = super.nSumStart + super.nSumBlocks;
+		fsckRefs = calloc(super.nBlocks, sizeof(uint32_t));
+		res = fsckRefs == NULL ? -ENOMEM : fsckRoot();
+	}
+	if(res == 0) {
+		fsckRun(fsckScanDirs);
+		fsckRootRepair();
+		for(i = 0 ; i < nFsckDirs ; i++)
+			nFsckItems += fsckDirs[i].nBlocks;
+		fsckItems = malloc((nFsckItems + 1) * sizeof(struct cs1550_fsck_item));
+		if(fsckItems == NULL) res = -ENOMEM;
+	}
+	if(res == 0) {
+		long n = 0, k;
+		for(i = 0 ; i < nFsckDirs ; i++) {
+			for(k = 0 ; k < fsckDirs[i].nBlocks ; k++) {
+				fsckItems[n].dir = i;
+				fsckItems[n++].index = k;
+			}
+		}
+		fsckRun(fsckScanBlocks);
+		for(i = 0 ; i < nFsckDirs ; i++)
+			fsckTails(&fsckDirs[i]);
+		res = fsckError;
+	}
+	if(res == 0) {
+		if(fsckIncomplete)
+			fprintf(out, "%s: some blocks could not be read, so no block is freed and no share count changed\n", diskPath);
+		fsckShares();
+		used = fsckBitmap();
+		fprintf(out, "%s: %d directories, %ld files, %ld of %ld blocks used; problems found: %ld, fixed: %ld\n",
+			diskPath, nFsckDirs, fsckFiles, used, super.nBlocks, fsckFound, fsckFixed);
+	}
+	//commits the repairs and stores what a mount stores at unmount
+	cs1550_destroy(NULL);
+	fsckFree();
+	options = saved;
+	if(res != 0) {
+		fprintf(stderr, "cs1550: cannot check %s: %s\n", diskPath, strerror(-res));
+		return 8;
+	}
+	return fsckFound == 0 ? 0 : fsckFound > fsckFixed ? 4 : 1;
 }
 
+#else
 
-//register our new functions as the implementations of the syscalls
-static struct fuse_operations hello_oper = {
-    .getattr	= cs1550_getattr,
-    .readdir	= cs1550_readdir,
-    .mkdir	= cs1550_mkdir,
-	.rmdir = cs1550_rmdir,
-    .read	= cs1550_read,
-    .write	= cs1550_write,
-	.mknod	= cs1550_mknod,
-	.unlink = cs1550_unlink,
-	.truncate = cs1550_truncate,
-	.flush = cs1550_flush,
-	.open	= cs1550_open,
+#define CS1550_OPT(t, p, v) { t, offsetof(struct cs1550_options, p), v }
+
+static struct fuse_opt cs1550_opts[] = {
+	CS1550_OPT("mmap", useMmap, 1),
+	CS1550_OPT("io_uring", ioUring, 1),
+	CS1550_OPT("cache_mb=%u", cacheMiB, 0),
+	CS1550_OPT("readahead_kb=%u", readAheadKiB, 0),
+	CS1550_OPT("cache_stats", cacheStats, 1),
+	CS1550_OPT("writeback_kb=%u", writeBackKiB, 0),
+	CS1550_OPT("dirty_mb=%u", dirtyMiB, 0),
+	CS1550_OPT("commit_ms=%u", commitMs, 0),
+	CS1550_OPT("lowlevel", lowLevel, 1),
+	CS1550_OPT("ll_timeout=%u", llTimeout, 0),
+	CS1550_OPT("compress", compress, 1),
+	CS1550_OPT("dedup", dedup, 1),
+	CS1550_OPT("checksum", checksum, 1),
+	FUSE_OPT_END
 };
 
-//Don't change this.
+//Mounts with the inode-based backend; the steps fuse_main takes for the
+//path-based one.
+static int lowLevelMain(struct fuse_args *args)
+{
+	struct fuse_session *se;
+	struct fuse_chan *ch;
+	char *mountpoint = NULL;
+	int multithreaded, foreground;
+	int res = -1;
+
+	if(fuse_parse_cmdline(args, &mountpoint, &multithreaded, &foreground) == -1)
+		return 1;
+	ch = fuse_mount(mountpoint, args);
+	if(ch != NULL) {
+		se = fuse_lowlevel_new(args, &hello_ll_oper, sizeof(hello_ll_oper), NULL);
+		if(se != NULL) {
+			if(fuse_set_signal_handlers(se) != -1) {
+				fuse_session_add_chan(se, ch);
+				if(fuse_daemonize(foreground) != -1)
+					res = multithreaded ? fuse_session_loop_mt(se) : fuse_session_loop(se);
+				fuse_remove_signal_handlers(se);
+				fuse_session_remove_chan(ch);
+			}
+			fuse_session_destroy(se);
+		}
+		fuse_unmount(mountpoint, ch);
+	}
+	free(mountpoint);
+	return res == 0 ? 0 : 1;
+}
+
 int main(int argc, char *argv[])
 {
-	return fuse_main(argc, argv, &hello_oper, NULL);
+	struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+	int res;
+
+	if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1)
+		return 1;
+
+	//fuse_main may daemonize and chdir to /, so pin down the image path first
+	if(realpath(".disk", diskPath) == NULL) {
+		fprintf(stderr, "cs1550: cannot find .disk: %s\n", strerror(errno));
+		return 1;
+	}
+	if(options.lowLevel)
+		res = lowLevelMain(&args);
+	else
+		res = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+	fuse_opt_free_args(&args);
+	return res;
 }
+
+#endif
@@ -0,0 +1,734 @@
+/*
+	Benchmark harness for cs1550.c.
+
+	Drives the filesystem operations directly against a scratch image, so no
+	mount is needed. Build it once per block size and compare the results:
+
+	gcc -Wall -O2 -DCS1550_LIBRARY -DBLOCK_SIZE=4096 `pkg-config fuse --cflags` \
+		cs1550.c cs1550_bench.c -o cs1550_bench_4096 `pkg-config fuse --libs` -lpthread
+
+	./cs1550_bench_4096 [-m file MiB] [-n ops] [scenario...]
+
+	Scenarios (all of them when none are named):
+		stat		getattr on random files of a populated image
+		readdir		listing of a full directory
+		create		burst of small files: mknod, 1 KiB write, release
+		seq		sequential write then read at 4 KiB, 128 KiB and 1 MiB
+		randwrite	random 4 KiB overwrites of an existing file
+		churn		rounds of 64 KiB files written, then unlinked and synced
+		compress	log text written, read back and read at random 4 KiB
+				offsets, with -o compress off and on
+		dedup		copies of one artifact that differ in a few blocks
+				written, then overwritten at random 4 KiB offsets,
+				with -o dedup off and on
+		checksum	a file written, read back and read at random 4 KiB
+				offsets, with -o checksum off and on
+		fsck		an image of small files and -m MiB of large ones
+				checked offline on one thread and on every CPU
+
+	Every result is one line of key=value pairs on stdout, e.g.
+
+	scenario=stat block_size=4096 ops=200000 ops_s=988749.2 p50_us=0.6 p99_us=1.0
+
+	Sequential and random write results also carry io_kib, sequential ones
+	mib_s. Create results carry image_kib, the space the image file takes on
+	the host afterwards. Churn results carry that space after the first and
+	the last round next to the total written; reusing freed blocks keeps its
+	growth down to the journal filling up. Compress results carry compress=0
+	or 1, and the write ones ratio, the bytes written over the space they
+	took in the image. Dedup results carry dedup=0 or 1, and the write ones
+	image_kib and write_kib, the space the copies took in the image and the
+	bytes written to it for them. Checksum results carry checksum=0 or 1;
+	the file is larger than the cache, so most reads verify blocks. Fsck
+	results carry threads and image_mib, the size of the image checked; -m
+	2048 makes it a few GiB. The cache counters of each run go to stderr.
+*/
+
+#define	FUSE_USE_VERSION 26
+
+#include <fuse.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+//must match the -DBLOCK_SIZE cs1550.c was built with
+#ifndef BLOCK_SIZE
+#define	BLOCK_SIZE 512
+#endif
+
+#define MAX_CREATE 1000	//files in the create burst, fewer if the root fills up
+#define CHURN_ROUNDS 16
+#define CHURN_FILES 256	//written and unlinked in each round
+#define CHURN_KIB 64
+#define DEDUP_COPIES 8	//artifact copies, -m MiB in all
+#define DEDUP_CHANGED 64	//one 4 KiB page in this many differs between copies
+#define FSCK_FILES 20000	//small files on the image fsck checks
+#define FSCK_FILE_MIB 64	//size of its large files
+
+void cs1550_set_disk(const char *path);
+const struct fuse_operations *cs1550_operations(void);
+void cs1550_cache_report(FILE *out);
+void cs1550_set_compress(int on);
+void cs1550_set_dedup(int on);
+void cs1550_set_checksum(int on);
+int cs1550_fsck(int threads, int repair, FILE *out);
+
+static const struct fuse_operations *ops;
+static char image[] = "/tmp/cs1550_bench.XXXXXX";
+static long fileMiB = 64;
+static long nOps = 200000;
+
+//latencies of the current run, in seconds
+static double *samples = NULL;
+static long nSamples = 0;
+
+static double now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void fail(const char *what) {
+	fprintf(stderr, "cs1550_bench: %s failed\n", what);
+	unlink(image);
+	exit(1);
+}
+
+//Formats a fresh scratch image and mounts it.
+static void mountImage() {
+	struct fuse_conn_info conn;
+	int fd = mkstemp(image);
+
+	//sparse room for the largest file plus the small ones and metadata
+	if(fd < 0 || ftruncate(fd, (off_t)(fileMiB << 21) + (256 << 20)) < 0) fail("scratch image");
+	close(fd);
+	memset(&conn, 0, sizeof(conn));
+	cs1550_set_disk(image);
+	ops->init(&conn);
+}
+
+static void unmountImage() {
+	cs1550_cache_report(stderr);
+	ops->destroy(NULL);
+	unlink(image);
+	strcpy(image, "/tmp/cs1550_bench.XXXXXX");
+}
+
+static void startRun(long capacity) {
+	free(samples);
+	samples = malloc(capacity * sizeof(double));
+	if(samples == NULL) fail("malloc");
+	nSamples = 0;
+}
+
+static void sample(double start) {
+	samples[nSamples++] = now() - start;
+}
+
+static int compareSamples(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+//Prints the line for the current run; extra goes between the scenario keys
+//and the latencies.
+static void report(const char *scenario, const char *extra, double elapsed) {
+	long p50, p99;
+	if(nSamples == 0) return;
+	qsort(samples, nSamples, sizeof(double), compareSamples);
+	p50 = nSamples * 50 / 100;
+	p99 = nSamples * 99 / 100;
+	printf("scenario=%s block_size=%d%s ops=%ld ops_s=%.1f p50_us=%.1f p99_us=%.1f\n",
+		scenario, BLOCK_SIZE, extra, nSamples, nSamples / elapsed,
+		samples[p50] * 1e6, samples[p99] * 1e6);
+	fflush(stdout);
+}
+
+//Space the scratch image takes on the host, in KiB.
+static long footprintKiB() {
+	struct stat st;
+	if(stat(image, &st) != 0) fail("stat");
+	return (long)st.st_blocks / 2;
+}
+
+//8.3 names: directories d0, d1, ..., files f0.dat, f1.dat, ...
+static void dirPath(char *path, int dir) {
+	sprintf(path, "/d%d", dir);
+}
+
+static void filePath(char *path, int dir, int file) {
+	sprintf(path, "/d%d/f%d.dat", dir, file);
+}
+
+//Creates up to count small files, filling one directory after another.
+//Returns how many were made; their paths are in paths when it is set. The
+//latency of each create, write and release is sampled when timed is set.
+static long createFiles(long count, char (*paths)[32], int timed) {
+	static char data[1024];
+	struct fuse_file_info fi;
+	char path[32];
+	long made = 0;
+	int dir = 0, file = 0;
+	double start;
+
+	dirPath(path, dir);
+	if(ops->mkdir(path, 0755) != 0) fail("mkdir");
+	while(made < count) {
+		int res;
+		filePath(path, dir, file);
+		memset(&fi, 0, sizeof(fi));
+		start = now();
+		res = ops->mknod(path, 0644, 0);
+		if(res == -ENOSPC && file > 0) {
+			//the directory is full: move on to the next one
+			dir++;
+			file = 0;
+			dirPath(path, dir);
+			if(ops->mkdir(path, 0755) != 0) break;
+			continue;
+		}
+		if(res != 0) break;
+		if(ops->open(path, &fi) != 0 || ops->write(path, data, sizeof(data), 0, &fi) != sizeof(data)) fail("small file write");
+		ops->release(path, &fi);
+		if(timed) sample(start);
+		if(paths != NULL) strcpy(paths[made], path);
+		made++;
+		file++;
+	}
+	return made;
+}
+
+static void benchStat() {
+	char (*paths)[32] = malloc(MAX_CREATE * sizeof(*paths));
+	struct stat st;
+	long made, i;
+	double begin, start;
+
+	mountImage();
+	made = createFiles(MAX_CREATE, paths, 0);
+	startRun(nOps);
+	srand(1);
+	begin = now();
+	for(i = 0 ; i < nOps ; i++) {
+		start = now();
+		if(ops->getattr(paths[rand() % made], &st) != 0) fail("getattr");
+		sample(start);
+	}
+	report("stat", "", now() - begin);
+	unmountImage();
+	free(paths);
+}
+
+static int countEntry(void *buf, const char *name, const struct stat *st, off_t off) {
+	(void) name;
+	(void) st;
+	(void) off;
+	(*(long *)buf)++;
+	return 0;
+}
+
+static void benchReaddir() {
+	char path[32];
+	long entries, i, runs = nOps / 10;
+	double begin, start;
+
+	mountImage();
+	//one directory, filled until mknod refuses
+	dirPath(path, 0);
+	if(ops->mkdir(path, 0755) != 0) fail("mkdir");
+	for(entries = 0 ; ; entries++) {
+		filePath(path, 0, entries);
+		if(ops->mknod(path, 0644, 0) != 0) break;
+	}
+	dirPath(path, 0);
+	startRun(runs);
+	begin = now();
+	for(i = 0 ; i < runs ; i++) {
+		long n = 0;
+		start = now();
+		if(ops->readdir(path, &n, countEntry, 0, NULL) != 0) fail("readdir");
+		sample(start);
+		if(i == 0) entries = n;
+	}
+	sprintf(path, " entries=%ld", entries);
+	report("readdir", path, now() - begin);
+	unmountImage();
+}
+
+static void benchCreate() {
+	char extra[32];
+	double begin, elapsed;
+
+	mountImage();
+	startRun(MAX_CREATE);
+	begin = now();
+	createFiles(MAX_CREATE, NULL, 1);
+	elapsed = now() - begin;
+	sprintf(extra, " image_kib=%ld", footprintKiB());
+	report("create", extra, elapsed);
+	unmountImage();
+}
+
+static void benchSeq(long ioKiB) {
+	struct fuse_file_info fi;
+	const char *path = "/seq/data.bin";
+	size_t fileSize = fileMiB << 20;
+	size_t ioSize = ioKiB << 10;
+	char *buf = malloc(ioSize);
+	char extra[64];
+	size_t off;
+	double begin, start, elapsed;
+
+	for(off = 0 ; off < ioSize ; off++)
+		buf[off] = (char)(off * 31 + 7);
+	memset(&fi, 0, sizeof(fi));
+	mountImage();
+	if(ops->mkdir("/seq", 0755) != 0 || ops->mknod(path, 0644, 0) != 0 || ops->open(path, &fi) != 0) fail("create");
+
+	startRun(fileSize / ioSize + 1);
+	begin = now();
+	for(off = 0 ; off < fileSize ; off += ioSize) {
+		start = now();
+		if(ops->write(path, buf, ioSize, off, &fi) != (int)ioSize) fail("write");
+		sample(start);
+	}
+	ops->fsync(path, 0, &fi);
+	elapsed = now() - begin;
+	sprintf(extra, " io_kib=%ld mib_s=%.1f", ioKiB, fileMiB / elapsed);
+	report("seq_write", extra, elapsed);
+
+	startRun(fileSize / ioSize + 1);
+	begin = now();
+	for(off = 0 ; off < fileSize ; off += ioSize) {
+		start = now();
+		if(ops->read(path, buf, ioSize, off, &fi) != (int)ioSize) fail("read");
+		sample(start);
+	}
+	elapsed = now() - begin;
+	sprintf(extra, " io_kib=%ld mib_s=%.1f", ioKiB, fileMiB / elapsed);
+	report("seq_read", extra, elapsed);
+
+	ops->release(path, &fi);
+	unmountImage();
+	free(buf);
+}
+
+static void benchRandWrite() {
+	struct fuse_file_info fi;
+	const char *path = "/rand/data.bin";
+	size_t fileSize = fileMiB << 20;
+	static char buf[128 << 10];
+	long blocks = fileSize / 4096, i;
+	size_t off;
+	double begin, start;
+
+	memset(buf, 0x5a, sizeof(buf));
+	memset(&fi, 0, sizeof(fi));
+	mountImage();
+	if(ops->mkdir("/rand", 0755) != 0 || ops->mknod(path, 0644, 0) != 0 || ops->open(path, &fi) != 0) fail("create");
+	for(off = 0 ; off < fileSize ; off += sizeof(buf))
+		if(ops->write(path, buf, sizeof(buf), off, &fi) != sizeof(buf)) fail("write");
+	ops->fsync(path, 0, &fi);
+
+	startRun(nOps);
+	srand(2);
+	begin = now();
+	for(i = 0 ; i < nOps ; i++) {
+		start = now();
+		if(ops->write(path, buf, 4096, (off_t)(rand() % blocks) * 4096, &fi) != 4096) fail("overwrite");
+		sample(start);
+	}
+	ops->fsync(path, 0, &fi);
+	report("randwrite", " io_kib=4", now() - begin);
+	ops->release(path, &fi);
+	unmountImage();
+}
+
+static void benchChurn() {
+	static char data[CHURN_KIB << 10];
+	struct fuse_file_info fi, anchor;
+	char path[32], extra[96];
+	long first = 0, round, i;
+	double begin, start;
+
+	memset(data, 0x3c, sizeof(data));
+	memset(&anchor, 0, sizeof(anchor));
+	mountImage();
+	//a file that stays, to sync the image through after each round
+	if(ops->mkdir("/churn", 0755) != 0 || ops->mknod("/churn/anchor", 0644, 0) != 0 ||
+		ops->open("/churn/anchor", &anchor) != 0) fail("create");
+	startRun(CHURN_ROUNDS * CHURN_FILES);
+	begin = now();
+	for(round = 0 ; round < CHURN_ROUNDS ; round++) {
+		for(i = 0 ; i < CHURN_FILES ; i++) {
+			sprintf(path, "/churn/f%ld.dat", i);
+			memset(&fi, 0, sizeof(fi));
+			start = now();
+			if(ops->mknod(path, 0644, 0) != 0 || ops->open(path, &fi) != 0 ||
+				ops->write(path, data, sizeof(data), 0, &fi) != sizeof(data)) fail("churn write");
+			ops->release(path, &fi);
+			sample(start);
+		}
+		for(i = 0 ; i < CHURN_FILES ; i++) {
+			sprintf(path, "/churn/f%ld.dat", i);
+			if(ops->unlink(path) != 0) fail("unlink");
+		}
+		if(ops->write("/churn/anchor", data, 1, 0, &anchor) != 1) fail("anchor write");
+		ops->fsync("/churn/anchor", 0, &anchor);
+		if(round == 0) first = footprintKiB();
+	}
+	sprintf(extra, " written_kib=%ld first_kib=%ld last_kib=%ld",
+		(long)CHURN_ROUNDS * CHURN_FILES * CHURN_KIB, first, footprintKiB());
+	report("churn", extra, now() - begin);
+	ops->release("/churn/anchor", &anchor);
+	unmountImage();
+}
+
+//Fills buf with lines like an application log's.
+static void logText(char *buf, size_t size) {
+	static const char *levels[] = { "INFO", "INFO", "INFO", "DEBUG", "WARN" };
+	static const char *paths[] = { "/api/v1/items", "/api/v1/users", "/health", "/api/v1/orders" };
+	char line[160];
+	size_t off = 0;
+	long n = 0;
+
+	while(off < size) {
+		int len = sprintf(line, "2024-05-01T12:%02ld:%02ld.%03ld %s worker-%d request id=%ld path=%s status=%d ms=%d\n",
+			n / 60000 % 60, n / 1000 % 60, n % 1000, levels[rand() % 5], rand() % 16, 100000 + n,
+			paths[rand() % 4], rand() % 10 ? 200 : 404, rand() % 250);
+		if(off + len > size) len = size - off;
+		memcpy(buf + off, line, len);
+		off += len;
+		n += 1 + rand() % 7;
+	}
+}
+
+static void benchCompress(int on) {
+	struct fuse_file_info fi;
+	const char *path = "/comp/app.log";
+	size_t fileSize = fileMiB << 20;
+	size_t ioSize = 128 << 10;
+	long blocks = fileSize / 4096, reads = nOps < 20000 ? nOps : 20000, i;
+	char *text = malloc(fileSize);
+	char *buf = malloc(ioSize);
+	char extra[96];
+	long before;
+	size_t off;
+	double begin, start, elapsed;
+
+	if(text == NULL || buf == NULL) fail("malloc");
+	srand(3);
+	logText(text, fileSize);
+	memset(&fi, 0, sizeof(fi));
+	mountImage();
+	cs1550_set_compress(on);
+	if(ops->mkdir("/comp", 0755) != 0 || ops->mknod(path, 0644, 0) != 0 || ops->open(path, &fi) != 0) fail("create");
+	ops->fsync(path, 0, &fi);
+	before = footprintKiB();
+
+	startRun(fileSize / ioSize + 1);
+	begin = now();
+	for(off = 0 ; off < fileSize ; off += ioSize) {
+		start = now();
+		if(ops->write(path, text + off, ioSize, off, &fi) != (int)ioSize) fail("write");
+		sample(start);
+	}
+	ops->fsync(path, 0, &fi);
+	elapsed = now() - begin;
+	sprintf(extra, " compress=%d mib_s=%.1f ratio=%.2f", on, fileMiB / elapsed,
+		(double)(fileSize >> 10) / (footprintKiB() - before));
+	report("compress_write", extra, elapsed);
+
+	startRun(fileSize / ioSize + 1);
+	begin = now();
+	for(off = 0 ; off < fileSize ; off += ioSize) {
+		start = now();
+		if(ops->read(path, buf, ioSize, off, &fi) != (int)ioSize || memcmp(buf, text + off, ioSize) != 0) fail("read");
+		sample(start);
+	}
+	elapsed = now() - begin;
+	sprintf(extra, " compress=%d mib_s=%.1f", on, fileMiB / elapsed);
+	report("compress_read", extra, elapsed);
+
+	startRun(reads);
+	srand(4);
+	begin = now();
+	for(i = 0 ; i < reads ; i++) {
+		off = (size_t)(rand() % blocks) * 4096;
+		start = now();
+		if(ops->read(path, buf, 4096, off, &fi) != 4096) fail("random read");
+		sample(start);
+	}
+	sprintf(extra, " compress=%d io_kib=4", on);
+	report("compress_randread", extra, now() - begin);
+
+	ops->release(path, &fi);
+	cs1550_set_compress(0);
+	unmountImage();
+	free(text);
+	free(buf);
+}
+
+//A counter of /.stats, or -1.
+static long statsCounter(const char *name) {
+	static char text[64 << 10];
+	struct fuse_file_info fi;
+	char key[64];
+	char *at;
+	int n;
+
+	memset(&fi, 0, sizeof(fi));
+	if(ops->open("/.stats", &fi) != 0) return -1;
+	n = ops->read("/.stats", text, sizeof(text) - 1, 0, &fi);
+	ops->release("/.stats", &fi);
+	if(n < 0) return -1;
+	text[n] = '\0';
+	sprintf(key, "\n%s ", name);
+	at = strstr(text, key);
+	return at != NULL ? atol(at + strlen(key)) : -1;
+}
+
+static void benchDedup(int on) {
+	struct fuse_file_info fi;
+	size_t fileSize = (fileMiB << 20) / DEDUP_COPIES;
+	size_t ioSize = 128 << 10;
+	long pages = fileSize / 4096, writes = nOps < 20000 ? nOps : 20000, i;
+	char *base = malloc(fileSize);
+	char *copy = malloc(fileSize);
+	char path[32], extra[128];
+	long before, written;
+	size_t off;
+	double begin, start, elapsed;
+	int k;
+
+	if(base == NULL || copy == NULL || pages == 0) fail("malloc");
+	srand(5);
+	for(off = 0 ; off < fileSize ; off++)
+		base[off] = rand();
+	memset(&fi, 0, sizeof(fi));
+	//the table is made when the image is formatted
+	cs1550_set_dedup(on);
+	mountImage();
+	if(ops->mkdir("/dedup", 0755) != 0) fail("mkdir");
+	before = footprintKiB();
+	written = statsCounter("dev_write_bytes");
+
+	startRun(DEDUP_COPIES * (fileSize / ioSize + 1));
+	begin = now();
+	for(k = 0 ; k < DEDUP_COPIES ; k++) {
+		memcpy(copy, base, fileSize);
+		for(i = k ; i < pages ; i += DEDUP_CHANGED)
+			memset(copy + i * 4096, k + 1, 4096);
+		sprintf(path, "/dedup/a%d.bin", k);
+		if(ops->mknod(path, 0644, 0) != 0 || ops->open(path, &fi) != 0) fail("create");
+		for(off = 0 ; off < fileSize ; off += ioSize) {
+			size_t n = fileSize - off < ioSize ? fileSize - off : ioSize;
+			start = now();
+			if(ops->write(path, copy + off, n, off, &fi) != (int)n) fail("write");
+			sample(start);
+		}
+		ops->release(path, &fi);
+	}
+	ops->fsync(path, 0, &fi);
+	elapsed = now() - begin;
+	sprintf(extra, " dedup=%d mib_s=%.1f image_kib=%ld write_kib=%ld", on, fileMiB / elapsed,
+		footprintKiB() - before, (statsCounter("dev_write_bytes") - written) >> 10);
+	report("dedup_write", extra, elapsed);
+
+	//each one lands on a block the copies share, until it has been copied
+	startRun(writes);
+	srand(6);
+	begin = now();
+	for(i = 0 ; i < writes ; i++) {
+		sprintf(path, "/dedup/a%d.bin", rand() % DEDUP_COPIES);
+		off = (size_t)(rand() % pages) * 4096;
+		memset(copy, rand(), 4096);
+		start = now();
+		if(ops->write(path, copy, 4096, off, &fi) != 4096) fail("overwrite");
+		sample(start);
+	}
+	ops->fsync(path, 0, &fi);
+	sprintf(extra, " dedup=%d io_kib=4", on);
+	report("dedup_randwrite", extra, now() - begin);
+
+	cs1550_set_dedup(0);
+	unmountImage();
+	free(base);
+	free(copy);
+}
+
+static void benchChecksum(int on) {
+	struct fuse_file_info fi;
+	const char *path = "/sums/data.bin";
+	size_t fileSize = fileMiB << 20;
+	size_t ioSize = 128 << 10;
+	long blocks = fileSize / 4096, reads = nOps < 20000 ? nOps : 20000, i;
+	char *data = malloc(fileSize);
+	char *buf = malloc(ioSize);
+	char extra[64];
+	size_t off;
+	double begin, start, elapsed;
+
+	if(data == NULL || buf == NULL) fail("malloc");
+	srand(7);
+	for(off = 0 ; off < fileSize ; off++)
+		data[off] = rand();
+	memset(&fi, 0, sizeof(fi));
+	//the sums are made when the image is formatted
+	cs1550_set_checksum(on);
+	mountImage();
+	if(ops->mkdir("/sums", 0755) != 0 || ops->mknod(path, 0644, 0) != 0 || ops->open(path, &fi) != 0) fail("create");
+
+	startRun(fileSize / ioSize + 1);
+	begin = now();
+	for(off = 0 ; off < fileSize ; off += ioSize) {
+		start = now();
+		if(ops->write(path, data + off, ioSize, off, &fi) != (int)ioSize) fail("write");
+		sample(start);
+	}
+	ops->fsync(path, 0, &fi);
+	elapsed = now() - begin;
+	sprintf(extra, " checksum=%d mib_s=%.1f", on, fileMiB / elapsed);
+	report("checksum_write", extra, elapsed);
+
+	startRun(fileSize / ioSize + 1);
+	begin = now();
+	for(off = 0 ; off < fileSize ; off += ioSize) {
+		start = now();
+		if(ops->read(path, buf, ioSize, off, &fi) != (int)ioSize || memcmp(buf, data + off, ioSize) != 0) fail("read");
+		sample(start);
+	}
+	elapsed = now() - begin;
+	sprintf(extra, " checksum=%d mib_s=%.1f", on, fileMiB / elapsed);
+	report("checksum_read", extra, elapsed);
+
+	startRun(reads);
+	srand(8);
+	begin = now();
+	for(i = 0 ; i < reads ; i++) {
+		off = (size_t)(rand() % blocks) * 4096;
+		start = now();
+		if(ops->read(path, buf, 4096, off, &fi) != 4096) fail("random read");
+		sample(start);
+	}
+	sprintf(extra, " checksum=%d io_kib=4", on);
+	report("checksum_randread", extra, now() - begin);
+
+	ops->release(path, &fi);
+	cs1550_set_checksum(0);
+	unmountImage();
+	free(data);
+	free(buf);
+}
+
+static void benchFsck() {
+	struct fuse_file_info fi;
+	size_t ioSize = 1 << 20;
+	char *data = malloc(ioSize);
+	char path[32], extra[96];
+	long files, mib, k;
+	int threads[2] = { 1, (int)sysconf(_SC_NPROCESSORS_ONLN) };
+	FILE *out = fopen("/dev/null", "w");
+	double begin, elapsed;
+	int t;
+
+	if(data == NULL || out == NULL) fail("malloc");
+	memset(data, 'f', ioSize);
+	memset(&fi, 0, sizeof(fi));
+	mountImage();
+	files = createFiles(FSCK_FILES, NULL, 0);
+	if(ops->mkdir("/big", 0755) != 0) fail("mkdir");
+	for(mib = 0 ; mib < fileMiB ; mib += FSCK_FILE_MIB) {
+		sprintf(path, "/big/b%ld.dat", mib / FSCK_FILE_MIB);
+		if(ops->mknod(path, 0644, 0) != 0 || ops->open(path, &fi) != 0) fail("create");
+		for(k = 0 ; k < FSCK_FILE_MIB && mib + k < fileMiB ; k++) {
+			if(ops->write(path, data, ioSize, k * ioSize, &fi) != (int)ioSize) fail("write");
+		}
+		ops->release(path, &fi);
+		files++;
+	}
+	cs1550_cache_report(stderr);
+	ops->destroy(NULL);
+
+	for(t = 0 ; t < 2 ; t++) {
+		startRun(1);
+		begin = now();
+		if(cs1550_fsck(threads[t], 0, out) != 0) fail("fsck");
+		elapsed = now() - begin;
+		samples[nSamples++] = elapsed;
+		sprintf(extra, " threads=%d image_mib=%ld files=%ld", threads[t], (fileMiB << 1) + 256, files);
+		report("fsck", extra, elapsed);
+	}
+	unlink(image);
+	strcpy(image, "/tmp/cs1550_bench.XXXXXX");
+	fclose(out);
+	free(data);
+}
+
+static int wanted(int argc, char *argv[], const char *scenario) {
+	int i;
+	if(optind >= argc) return 1;
+	for(i = optind ; i < argc ; i++)
+		if(strcmp(argv[i], scenario) == 0) return 1;
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int c, i;
+
+	while((c = getopt(argc, argv, "m:n:")) != -1) {
+		switch(c) {
+		case 'm':
+			fileMiB = atol(optarg);
+			break;
+		case 'n':
+			nOps = atol(optarg);
+			break;
+		default:
+			fileMiB = 0;
+		}
+	}
+	for(i = optind ; i < argc ; i++) {
+		if(strcmp(argv[i], "stat") != 0 && strcmp(argv[i], "readdir") != 0 && strcmp(argv[i], "create") != 0 &&
+			strcmp(argv[i], "seq") != 0 && strcmp(argv[i], "randwrite") != 0 && strcmp(argv[i], "churn") != 0 &&
+			strcmp(argv[i], "compress") != 0 && strcmp(argv[i], "dedup") != 0 &&
+			strcmp(argv[i], "checksum") != 0 && strcmp(argv[i], "fsck") != 0)
+			fileMiB = 0;
+	}
+	if(fileMiB <= 0 || nOps <= 0) {
+		fprintf(stderr, "usage: %s [-m file MiB] [-n ops] [stat|readdir|create|seq|randwrite|churn|compress|dedup|checksum|fsck...]\n", argv[0]);
+		return 1;
+	}
+
+	ops = cs1550_operations();
+	if(wanted(argc, argv, "stat")) benchStat();
+	if(wanted(argc, argv, "readdir")) benchReaddir();
+	if(wanted(argc, argv, "create")) benchCreate();
+	if(wanted(argc, argv, "seq")) {
+		benchSeq(4);
+		benchSeq(128);
+		benchSeq(1024);
+	}
+	if(wanted(argc, argv, "randwrite")) benchRandWrite();
+	if(wanted(argc, argv, "churn")) benchChurn();
+	if(wanted(argc, argv, "compress")) {
+		benchCompress(0);
+		benchCompress(1);
+	}
+	if(wanted(argc, argv, "dedup")) {
+		benchDedup(0);
+		benchDedup(1);
+	}
+	if(wanted(argc, argv, "checksum")) {
+		benchChecksum(0);
+		benchChecksum(1);
+	}
+	if(wanted(argc, argv, "fsck")) benchFsck();
+	free(samples);
+	return 0;
+}
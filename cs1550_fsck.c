@@ -0,0 +1,70 @@
+/*
+	Offline checker for cs1550 images.
+
+	Checks an image that is not mounted, and with -r repairs what it can.
+	Build it once per block size, the same way as the filesystem:
+
+	gcc -Wall -O2 -DCS1550_LIBRARY -DBLOCK_SIZE=4096 `pkg-config fuse --cflags` \
+		cs1550.c cs1550_fsck.c -o cs1550_fsck_4096 `pkg-config fuse --libs` -lpthread
+
+	./cs1550_fsck_4096 [-r] [-j threads] image
+
+	Like a mount it replays the journal first, and it stores the block
+	checksums, if the image has them, the way an unmount does; without -r it
+	writes nothing else. The directories are scanned on -j threads, one per
+	CPU by default, and every block they reach is counted. It then reports:
+
+		entries that point past the end of the image or before its data area
+		blocks that two entries use, unless the image shares them by dedup
+		sizes larger than the blocks a file has
+		small files that overlap in a tail block
+		blocks in use that the bitmap marks free, and leaked ones it marks used
+		dedup share counts and entries that do not match the files
+
+	With -r the bitmap and the share counts are rebuilt from what was found,
+	files that point outside the data area are emptied and such directories
+	dropped, extent chains are cut at a bad link and sizes are cut down to
+	the blocks a file has. If a directory or extent block cannot be read,
+	the blocks it points at are unknown, so -r then only marks missing blocks
+	used: leaked blocks stay allocated and the share counts stay as they are.
+	Each problem is one line on stdout, with ", fixed" when -r put it right,
+	and a summary line ends the run.
+
+	The exit status is that of fsck(8): 0 for a clean image, 1 when every
+	problem was fixed, 4 when some are left and 8 when the check could not
+	run.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+void cs1550_set_disk(const char *path);
+int cs1550_fsck(int threads, int repair, FILE *out);
+
+int main(int argc, char *argv[])
+{
+	long threads = sysconf(_SC_NPROCESSORS_ONLN);
+	int repair = 0;
+	int c;
+
+	while((c = getopt(argc, argv, "rj:")) != -1) {
+		switch(c) {
+		case 'r':
+			repair = 1;
+			break;
+		case 'j':
+			threads = atol(optarg);
+			break;
+		default:
+			threads = 0;
+		}
+	}
+	if(threads <= 0 || optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-r] [-j threads] image\n", argv[0]);
+		return 8;
+	}
+
+	cs1550_set_disk(argv[optind]);
+	return cs1550_fsck(threads, repair, stdout);
+}